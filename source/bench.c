@@ -0,0 +1,506 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Benchmark of the serial transfer hot path. A fake emulator running on its
+//   own thread drives a session over a local socket pair, while the main
+//   thread runs the session's event loop the same way the engine does.
+//   Results are printed as "key value" lines, for scripts to compare.
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include <mobile.h>
+
+#include "session.h"
+#include "socket.h"
+#include "thread.h"
+#include "timer.h"
+
+// Emulated clock ticks per serial transfer, one byte at 8192 bits per second
+#define BENCH_TICKS_PER_TRANSFER ((1 << 21) / 1024)
+
+// Idle bytes sent while waiting on the adapter's reply before giving up
+#define BENCH_IDLE_MAX 10000
+
+#define SERIAL_IDLE 0x4B
+#define SERIAL_DEVICE 0x80
+
+// Count the syscalls made by the thread running the session, by intercepting
+//   the socket functions it uses. This is only done on Linux, where they can
+//   be forwarded to the kernel directly.
+#if defined(__linux__)
+#include <sys/syscall.h>
+#if defined(SYS_recvfrom) && defined(SYS_sendto) && defined(SYS_ppoll) && \
+    defined(SYS_epoll_pwait)
+#define BENCH_COUNT_SYSCALLS
+#endif
+#endif
+
+#ifdef BENCH_COUNT_SYSCALLS
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+static volatile unsigned long bench_syscalls = 0;
+static _Thread_local bool bench_syscalls_count = false;
+
+#define BENCH_SYSCALL(...) \
+    (bench_syscalls += bench_syscalls_count, syscall(__VA_ARGS__))
+
+ssize_t recv(int fd, void *buf, size_t len, int flags)
+{
+    return BENCH_SYSCALL(SYS_recvfrom, fd, buf, len, flags, NULL, NULL);
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags)
+{
+    return BENCH_SYSCALL(SYS_sendto, fd, buf, len, flags, NULL, 0);
+}
+
+ssize_t recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *addr, socklen_t *addrlen)
+{
+    return BENCH_SYSCALL(SYS_recvfrom, fd, buf, len, flags, addr, addrlen);
+}
+
+ssize_t sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addrlen)
+{
+    return BENCH_SYSCALL(SYS_sendto, fd, buf, len, flags, addr, addrlen);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    struct timespec ts = {timeout / 1000, (timeout % 1000) * 1000000L};
+    return BENCH_SYSCALL(SYS_ppoll, fds, nfds, timeout < 0 ? NULL : &ts,
+        NULL, 0);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    return BENCH_SYSCALL(SYS_epoll_pwait, epfd, events, maxevents, timeout,
+        NULL, 8);
+}
+
+// Fortified builds call these instead
+ssize_t __recv_chk(int fd, void *buf, size_t len, size_t buflen, int flags)
+{
+    if (len > buflen) abort();
+    return recv(fd, buf, len, flags);
+}
+
+int __poll_chk(struct pollfd *fds, nfds_t nfds, int timeout, size_t fdslen)
+{
+    if (fdslen / sizeof(*fds) < nfds) abort();
+    return poll(fds, nfds, timeout);
+}
+#endif
+
+struct bench_command {
+    const char *name;
+    unsigned char cmd;
+    const char *data;
+    unsigned size;
+    uint64_t *samples;
+};
+
+// Session setup and teardown, making a call to the ISP and sending some data
+static struct bench_command bench_commands[] = {
+    {"cmd_start", 0x10, "NINTENDO", 8, NULL},
+    {"cmd_tel", 0x12, "\x00" "0755311973", 11, NULL},
+    {"cmd_data", 0x15, "\xFF" "0123456789ABCDEF", 17, NULL},
+    {"cmd_hangup", 0x13, "", 0, NULL},
+    {"cmd_end", 0x11, "", 0, NULL},
+};
+#define BENCH_COMMANDS (sizeof(bench_commands) / sizeof(*bench_commands))
+
+struct bench_state {
+    SOCKET sock;
+    uint32_t timestamp;
+    unsigned transfers;
+    unsigned commands;
+    bool ok;
+
+    uint64_t *turnaround;
+    uint64_t transfers_time;
+    unsigned long transfers_syscalls;
+    unsigned commands_done;
+    unsigned commands_failed;
+};
+
+static bool bench_packet_send(struct bench_state *state, const unsigned char *packet)
+{
+    unsigned offset = 0;
+    while (offset < 8) {
+        ssize_t num = send(state->sock, (char *)packet + offset, 8 - offset, 0);
+        if (num <= 0) {
+            socket_perror("bench_packet_send");
+            return false;
+        }
+        offset += num;
+    }
+    return true;
+}
+
+static bool bench_packet_recv(struct bench_state *state, unsigned char *packet)
+{
+    unsigned offset = 0;
+    while (offset < 8) {
+        ssize_t num = recv(state->sock, (char *)packet + offset, 8 - offset, 0);
+        if (num <= 0) {
+            if (num == -1) socket_perror("bench_packet_recv");
+            return false;
+        }
+        offset += num;
+    }
+    return true;
+}
+
+static bool bench_handshake(struct bench_state *state)
+{
+    static const unsigned char version[8] = {1, 1, 4, 0, 0, 0, 0, 0};
+    static const unsigned char status[8] = {108, 1, 0, 0, 0, 0, 0, 0};
+    unsigned char packet[8];
+
+    if (!bench_packet_recv(state, packet)) return false;
+    if (memcmp(packet, version, sizeof(packet)) != 0) {
+        fprintf(stderr, "bench: Invalid handshake\n");
+        return false;
+    }
+    if (!bench_packet_send(state, version)) return false;
+    if (!bench_packet_recv(state, packet) || packet[0] != 108) return false;
+    if (!bench_packet_send(state, status)) return false;
+    if (!bench_packet_recv(state, packet) || packet[0] != 108) return false;
+    return true;
+}
+
+// Exchange a byte with the adapter as the emulator's master clock would
+static bool bench_transfer(struct bench_state *state, unsigned char in, unsigned char *out)
+{
+    unsigned char packet[8] = {104, in, 0x81, 0};
+
+    state->timestamp += BENCH_TICKS_PER_TRANSFER;
+    state->timestamp &= 0x7FFFFFFF;
+    packet[4] = state->timestamp >> 0;
+    packet[5] = state->timestamp >> 8;
+    packet[6] = state->timestamp >> 16;
+    packet[7] = state->timestamp >> 24;
+    if (!bench_packet_send(state, packet)) return false;
+
+    // Skip anything that isn't the reply
+    do {
+        if (!bench_packet_recv(state, packet)) return false;
+    } while (packet[0] != 105);
+    *out = packet[1];
+    return true;
+}
+
+// Send a command packet, and wait for the adapter's reply to it
+static bool bench_command(struct bench_state *state, const struct bench_command *command)
+{
+    unsigned char packet[6 + 0xFF + 2];
+    unsigned size = 0;
+    unsigned char c;
+
+    packet[size++] = 0x99;
+    packet[size++] = 0x66;
+    packet[size++] = command->cmd;
+    packet[size++] = 0;
+    packet[size++] = 0;
+    packet[size++] = command->size;
+    memcpy(packet + size, command->data, command->size);
+    size += command->size;
+    unsigned checksum = 0;
+    for (unsigned i = 2; i < size; i++) checksum += packet[i];
+    packet[size++] = checksum >> 8;
+    packet[size++] = checksum;
+
+    for (unsigned i = 0; i < size; i++) {
+        if (!bench_transfer(state, packet[i], &c)) return false;
+    }
+    if (!bench_transfer(state, SERIAL_DEVICE, &c)) return false;
+    if (!bench_transfer(state, 0, &c)) return false;
+    if (c != (command->cmd ^ 0x80)) {
+        fprintf(stderr, "bench: %s: Not acknowledged: %02X\n",
+            command->name, c);
+        return false;
+    }
+
+    // Wait for the reply to start
+    unsigned idle = 0;
+    unsigned char last = 0;
+    for (;;) {
+        if (idle++ >= BENCH_IDLE_MAX) {
+            fprintf(stderr, "bench: %s: No reply\n", command->name);
+            return false;
+        }
+        if (!bench_transfer(state, SERIAL_IDLE, &c)) return false;
+        if (last == 0x99 && c == 0x66) break;
+        last = c;
+    }
+
+    // Receive the rest of the reply, and acknowledge it
+    unsigned char header[4];
+    for (unsigned i = 0; i < sizeof(header); i++) {
+        if (!bench_transfer(state, SERIAL_IDLE, &header[i])) return false;
+    }
+    for (unsigned i = 0; i < header[3] + 2u; i++) {
+        if (!bench_transfer(state, SERIAL_IDLE, &c)) return false;
+    }
+    if (!bench_transfer(state, SERIAL_DEVICE, &c)) return false;
+    if (!bench_transfer(state, header[0] ^ 0x80, &c)) return false;
+    return true;
+}
+
+static void bench_emulator(void *arg)
+{
+    struct bench_state *state = arg;
+    unsigned char c;
+
+    if (!bench_handshake(state)) goto done;
+
+    // Raw transfers, idling the adapter
+#ifdef BENCH_COUNT_SYSCALLS
+    unsigned long syscalls = bench_syscalls;
+#endif
+    uint64_t start = timer_host_ns();
+    for (unsigned i = 0; i < state->transfers; i++) {
+        uint64_t before = timer_host_ns();
+        if (!bench_transfer(state, SERIAL_IDLE, &c)) goto done;
+        state->turnaround[i] = timer_host_ns() - before;
+    }
+    state->transfers_time = timer_host_ns() - start;
+#ifdef BENCH_COUNT_SYSCALLS
+    state->transfers_syscalls = bench_syscalls - syscalls;
+#endif
+
+    // Full command round trips
+    for (unsigned i = 0; i < state->commands; i++) {
+        for (unsigned x = 0; x < BENCH_COMMANDS; x++) {
+            struct bench_command *command = &bench_commands[x];
+            uint64_t before = timer_host_ns();
+            if (!bench_command(state, command)) {
+                state->commands_failed++;
+                goto commands_done;
+            }
+            command->samples[i] = timer_host_ns() - before;
+        }
+        state->commands_done++;
+    }
+commands_done:
+
+    state->ok = true;
+done:
+    // Closing the socket ends the session
+    socket_close(state->sock);
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_report(const char *name, uint64_t *samples, unsigned count)
+{
+    if (!count) return;
+    qsort(samples, count, sizeof(*samples), bench_compare);
+    printf("%s_p50_ns %llu\n", name,
+        (unsigned long long)samples[(count - 1) * 50 / 100]);
+    printf("%s_p99_ns %llu\n", name,
+        (unsigned long long)samples[(count - 1) * 99 / 100]);
+    printf("%s_p999_ns %llu\n", name,
+        (unsigned long long)samples[(count - 1) * 999 / 1000]);
+    printf("%s_max_ns %llu\n", name,
+        (unsigned long long)samples[count - 1]);
+}
+
+static char *program_name;
+
+static void show_help(void)
+{
+    fprintf(stderr, "%s [-c config] [--transfers count] [--commands count] "
+        "[--link-thread]\n", program_name);
+    exit(EXIT_FAILURE);
+}
+
+static unsigned main_parse_count(char *argv[])
+{
+    if (!argv[1]) {
+        fprintf(stderr, "Missing parameter for %s\n", argv[0]);
+        show_help();
+    }
+    // Every count gets a sample buffer one entry larger than it
+    char *endptr;
+    errno = 0;
+    unsigned long count = strtoul(argv[1], &endptr, 10);
+    if (!*argv[1] || *endptr || *argv[1] == '-' || errno == ERANGE ||
+            count >= UINT_MAX) {
+        fprintf(stderr, "Invalid parameter for %s: %s\n", argv[0], argv[1]);
+        show_help();
+    }
+    return count;
+}
+
+// Create an empty config in the temporary directory, so every run starts
+//   from the same state without leaving files behind
+static bool bench_config_temp(char *fname, size_t size)
+{
+#if defined(_WIN32)
+    char dir[MAX_PATH];
+    if (size < MAX_PATH || !GetTempPathA(sizeof(dir), dir) ||
+            !GetTempFileNameA(dir, "mob", 0, fname)) {
+        fprintf(stderr, "Could not create a temporary config\n");
+        return false;
+    }
+    return true;
+#else
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+    int len = snprintf(fname, size, "%s/mobile-bench-XXXXXX", dir);
+    if (len < 0 || (size_t)len >= size) {
+        fprintf(stderr, "Temporary directory path too long: %s\n", dir);
+        return false;
+    }
+    int fd = mkstemp(fname);
+    if (fd == -1) {
+        perror("mkstemp");
+        return false;
+    }
+    close(fd);
+    return true;
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    program_name = argv[0];
+
+    char *fname_config = NULL;
+    char fname_temp[0x1000];
+    bool link_thread = false;
+    struct bench_state state = {
+        .sock = INVALID_SOCKET,
+        .transfers = 100000,
+        .commands = 100,
+    };
+
+    while (*++argv) {
+        if (strcmp(*argv, "-c") == 0 || strcmp(*argv, "--config") == 0) {
+            if (!argv[1]) show_help();
+            fname_config = argv[1];
+            argv += 1;
+        } else if (strcmp(*argv, "--transfers") == 0) {
+            state.transfers = main_parse_count(argv);
+            argv += 1;
+        } else if (strcmp(*argv, "--commands") == 0) {
+            state.commands = main_parse_count(argv);
+            argv += 1;
+        } else if (strcmp(*argv, "--link-thread") == 0) {
+            link_thread = true;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", *argv);
+            show_help();
+        }
+    }
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    int wsa_err = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (wsa_err != NO_ERROR) {
+        fprintf(stderr, "WSAStartup failed with error: %d\n", wsa_err);
+        return EXIT_FAILURE;
+    }
+#endif
+
+    // Allocate the sample buffers up front, to keep them out of the timings
+    state.turnaround = calloc(state.transfers + 1, sizeof(uint64_t));
+    if (!state.turnaround) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (unsigned i = 0; i < BENCH_COMMANDS; i++) {
+        bench_commands[i].samples = calloc(state.commands + 1,
+            sizeof(uint64_t));
+        if (!bench_commands[i].samples) {
+            perror("calloc");
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct session_options options = {
+        .device = MOBILE_ADAPTER_BLUE,
+        .relay_token_update = false,
+        .link_thread = link_thread,
+    };
+    struct socket_poller poller;
+    SOCKET pair[2];
+    if (!socket_poller_init(&poller)) return EXIT_FAILURE;
+    if (socket_pair(pair) == -1) return EXIT_FAILURE;
+    state.sock = pair[1];
+
+    if (!fname_config) {
+        if (!bench_config_temp(fname_temp, sizeof(fname_temp))) {
+            return EXIT_FAILURE;
+        }
+        fname_config = fname_temp;
+    }
+    struct mobile_user *mobile = session_new(fname_config, &options);
+    if (!mobile) return EXIT_FAILURE;
+    if (!session_link(mobile, pair[0])) return EXIT_FAILURE;
+    if (!session_attach(mobile, &poller)) return EXIT_FAILURE;
+
+    thread_t thread;
+    if (!thread_create(&thread, bench_emulator, &state)) return EXIT_FAILURE;
+
+    // Run the session until the emulator hangs up
+#ifdef BENCH_COUNT_SYSCALLS
+    bench_syscalls_count = true;
+#endif
+    for (;;) {
+        socket_poller_wait(&poller, session_delay(mobile, SESSION_WAIT_IDLE));
+#if defined(BENCH_COUNT_SYSCALLS) && defined(SOCKET_USE_IO_URING)
+        // Waiting on io_uring goes through syscall(), which isn't intercepted
+        if (poller.uring_ready) bench_syscalls++;
+#endif
+        if (!session_loop(mobile)) break;
+    }
+#ifdef BENCH_COUNT_SYSCALLS
+    bench_syscalls_count = false;
+#endif
+    thread_join(thread);
+    session_free(mobile);
+    socket_poller_deinit(&poller);
+    if (fname_config == fname_temp) remove(fname_temp);
+
+    if (!state.ok) {
+        fprintf(stderr, "bench: Benchmark failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("transfers %u\n", state.transfers);
+    if (state.transfers_time) {
+        printf("transfers_per_second %.1f\n",
+            state.transfers * 1e9 / state.transfers_time);
+    }
+    bench_report("turnaround", state.turnaround, state.transfers);
+#ifdef BENCH_COUNT_SYSCALLS
+    // The link thread's syscalls aren't counted
+    if (state.transfers && !link_thread) {
+        printf("syscalls_per_transfer %.3f\n",
+            (double)state.transfers_syscalls / state.transfers);
+    }
+#endif
+    printf("commands %u\n", state.commands_done);
+    printf("commands_failed %u\n", state.commands_failed);
+    for (unsigned i = 0; i < BENCH_COMMANDS; i++) {
+        bench_report(bench_commands[i].name, bench_commands[i].samples,
+            state.commands_done);
+    }
+
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return state.commands_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
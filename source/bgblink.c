@@ -6,7 +6,11 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "log.h"
+#include "probe.h"
+#include "record.h"
 #include "socket.h"
+#include "timer.h"
 
 // Attribute packed
 #if defined(__GNUC__)
@@ -39,6 +43,37 @@ A_PACKED(struct bgb_packet {
     uint32_t timestamp;
 });
 
+static const char *bgb_stat_names[BGB_STAT_CMDS] = {
+    "version",
+    "joypad",
+    "sync1",
+    "sync2",
+    "sync3",
+    "status",
+    "wantdisconnect",
+    "unknown",
+};
+
+static unsigned bgb_stat_index(unsigned char cmd)
+{
+    switch (cmd) {
+    case BGB_CMD_VERSION: return 0;
+    case BGB_CMD_JOYPAD: return 1;
+    case BGB_CMD_SYNC1: return 2;
+    case BGB_CMD_SYNC2: return 3;
+    case BGB_CMD_SYNC3: return 4;
+    case BGB_CMD_STATUS: return 5;
+    case BGB_CMD_WANTDISCONNECT: return 6;
+    default: return 7;
+    }
+}
+
+// Name of a packet type in struct bgb_stats
+const char *bgb_stat_name(unsigned index)
+{
+    return bgb_stat_names[index];
+}
+
 static const struct bgb_packet handshake = {
     .cmd = BGB_CMD_VERSION,
     .b2 = 1,
@@ -47,24 +82,94 @@ static const struct bgb_packet handshake = {
     .timestamp = 0,
 };
 
-static bool bgb_send(SOCKET socket, struct bgb_packet *buf)
+// With a shared memory link, the socket only becomes readable once the
+//   emulator has gone away
+static bool bgb_check_socket(struct bgb_state *state)
 {
-    ssize_t num = send(socket, (char *)buf, sizeof(struct bgb_packet), 0);
+    char buf[8];
+    ssize_t num = recv(state->socket, buf, sizeof(buf), 0);
     if (num == -1) {
-        socket_perror("bgb_send");
+        if (socket_geterror() == SOCKET_EWOULDBLOCK) {
+            state->ready = false;
+            return true;
+        }
+        log_socket_error(NULL, "bgb_recv");
         return false;
     }
-    return num == sizeof(struct bgb_packet);
+    return num != 0;
 }
 
-static bool bgb_recv(SOCKET socket, struct bgb_packet *buf)
+// Send as many of the queued up packets as the emulator takes in one go
+// Whatever doesn't fit is kept for the next flush, instead of waiting on an
+//   emulator that isn't reading, which would hold up every other session
+//   handled by the same thread. The link is dropped once the emulator hasn't
+//   taken anything for BGB_SEND_TIMEOUT.
+static bool bgb_flush(struct bgb_state *state)
 {
-    ssize_t num = recv(socket, (char *)buf, sizeof(struct bgb_packet), 0);
-    if (num == -1) {
-        socket_perror("bgb_recv");
+    unsigned offset = 0;
+    while (state->shm && offset < state->send_size) {
+        unsigned num = shmlink_send(state->shm, state->send_buf + offset,
+            state->send_size - offset);
+        if (!num) break;
+        offset += num;
+    }
+    while (!state->shm && offset < state->send_size) {
+        ssize_t num = send(state->socket, (char *)state->send_buf + offset,
+            state->send_size - offset, 0);
+        if (num == -1) {
+            if (socket_geterror() == SOCKET_EWOULDBLOCK) break;
+            log_socket_error(NULL, "bgb_send");
+            return false;
+        }
+        offset += num;
+    }
+    if (offset) PROBE(bgb_flush, state, offset);
+
+    state->send_size -= offset;
+    memmove(state->send_buf, state->send_buf + offset, state->send_size);
+    if (!state->send_size) {
+        state->send_stall = 0;
+        return true;
+    }
+
+    uint64_t now = timer_host_ns();
+    if (offset || !state->send_stall) {
+        state->send_stall = now;
+    } else if (now - state->send_stall >=
+            (uint64_t)BGB_SEND_TIMEOUT * 1000000) {
+        log_warn(NULL, "bgb_send: Emulator stopped reading, dropping link");
         return false;
     }
-    return num == sizeof(struct bgb_packet);
+    return true;
+}
+
+// Check whether any packets are still waiting to be taken by the emulator
+// The poller doesn't tell when that might happen, so bgb_loop() should be
+//   called again within BGB_SEND_RETRY.
+bool bgb_pending(struct bgb_state *state)
+{
+    return state->send_size != 0;
+}
+
+// Queue a packet to be sent on the next flush, keeping the order
+static bool bgb_queue(struct bgb_state *state, struct bgb_packet *buf)
+{
+    if (state->send_size + sizeof(struct bgb_packet) >
+            sizeof(state->send_buf)) {
+        if (!bgb_flush(state)) return false;
+    }
+    if (state->send_size + sizeof(struct bgb_packet) >
+            sizeof(state->send_buf)) {
+        log_warn(NULL, "bgb_send: Emulator stopped reading, dropping link");
+        return false;
+    }
+    if (state->record) record_write(state->record, RECORD_SEND, buf);
+    unsigned index = bgb_stat_index(buf->cmd);
+    __atomic_fetch_add(&state->stats.packets_sent[index], 1, __ATOMIC_RELAXED);
+    PROBE(bgb_send, state, buf->cmd, buf->b2, buf->timestamp);
+    memcpy(state->send_buf + state->send_size, buf, sizeof(*buf));
+    state->send_size += sizeof(*buf);
+    return true;
 }
 
 bool bgb_init(struct bgb_state *state, SOCKET socket, unsigned char init_byte, bgb_transfer_cb callback_transfer, bgb_timestamp_cb callback_timestamp, void *user)
@@ -78,65 +183,99 @@ bool bgb_init(struct bgb_state *state, SOCKET socket, unsigned char init_byte, b
     state->byte = init_byte;
     state->timestamp_last = 0;
     state->timestamp_init = false;
+    state->stage = BGB_STAGE_VERSION;
+    state->recv_size = 0;
+    state->recv_time = 0;
+    state->turnaround = 0;
+    state->send_size = 0;
+    state->send_stall = 0;
+    state->want_disconnect = false;
+
+    // The rest of the handshake happens in bgb_loop, as packets arrive
+    if (socket_setblocking(socket, 0) == -1) return false;
+    state->ready = true;
+    state->shm_ready = true;
 
     // Handshake
     memcpy(&packet, &handshake, sizeof(packet));
-    if (!bgb_send(socket, &packet)) return false;
-    if (!bgb_recv(socket, &packet)) return false;
-    if (memcmp(&packet, &handshake, sizeof(packet)) != 0) {
-        fprintf(stderr, "bgb_loop: Invalid handshake\n");
-        return false;
-    }
+    if (!bgb_queue(state, &packet)) return false;
+    return bgb_flush(state);
+}
+
+static bool bgb_handshake(struct bgb_state *state, struct bgb_packet *packet)
+{
+    switch (state->stage) {
+    case BGB_STAGE_VERSION:
+        if (memcmp(packet, &handshake, sizeof(*packet)) != 0) {
+            log_warn(NULL, "bgb_loop: Invalid handshake");
+            return false;
+        }
 
-    // Send initial status
-    packet.cmd = BGB_CMD_STATUS;
-    packet.b2 = BGB_STATUS_RUNNING | BGB_STATUS_PAUSED |
-        BGB_STATUS_SUPPORTRECONNECT;
-    packet.b3 = 0;
-    packet.b4 = 0;
-    packet.timestamp = 0;
-    if (!bgb_send(socket, &packet)) return false;
+        // Send initial status
+        packet->cmd = BGB_CMD_STATUS;
+        packet->b2 = BGB_STATUS_RUNNING | BGB_STATUS_PAUSED |
+            BGB_STATUS_SUPPORTRECONNECT;
+        packet->b3 = 0;
+        packet->b4 = 0;
+        packet->timestamp = 0;
+        if (!bgb_queue(state, packet)) return false;
+
+        // Expect a status packet back
+        state->stage = BGB_STAGE_STATUS;
+        break;
 
-    // Expect a status packet back
-    if (!bgb_recv(socket, &packet)) return false;
-    if (packet.cmd != BGB_CMD_STATUS) {
-        fprintf(stderr, "bgb_init: unexpected packet (1)\n");
-        return false;
-    }
+    case BGB_STAGE_STATUS:
+        if (packet->cmd != BGB_CMD_STATUS) {
+            log_warn(NULL, "bgb_loop: Unexpected packet during handshake");
+            return false;
+        }
 
-    // Unpause the emulator
-    packet.cmd = BGB_CMD_STATUS;
-    packet.b2 = BGB_STATUS_RUNNING | BGB_STATUS_SUPPORTRECONNECT;
-    packet.b3 = 0;
-    packet.b4 = 0;
-    if (!bgb_send(socket, &packet)) return false;
+        // Unpause the emulator
+        packet->cmd = BGB_CMD_STATUS;
+        packet->b2 = BGB_STATUS_RUNNING | BGB_STATUS_SUPPORTRECONNECT;
+        packet->b3 = 0;
+        packet->b4 = 0;
+        packet->timestamp = 0;
+        if (!bgb_queue(state, packet)) return false;
 
+        state->stage = BGB_STAGE_RUNNING;
+        break;
+
+    default:
+        break;
+    }
     return true;
 }
 
-bool bgb_loop(struct bgb_state *state)
+static bool bgb_handle(struct bgb_state *state, struct bgb_packet *packet)
 {
-    struct bgb_packet packet;
     unsigned char byte_cur;
     uint32_t timestamp_cur = state->timestamp_last;
 
-    if (socket_hasdata(state->socket) <= 0) return true;
-    if (!bgb_recv(state->socket, &packet)) return false;
+    if (state->stage != BGB_STAGE_RUNNING) {
+        return bgb_handshake(state, packet);
+    }
 
-    switch (packet.cmd) {
+    switch (packet->cmd) {
     case BGB_CMD_JOYPAD:
         // Not relevant
         break;
 
     case BGB_CMD_SYNC1:
-        byte_cur = packet.b2;
-        timestamp_cur = packet.timestamp;
-        packet.cmd = BGB_CMD_SYNC2;
-        packet.b2 = state->byte;
-        packet.b3 = 0x80;
-        packet.b4 = 0;
-        packet.timestamp = 0;
-        if (!bgb_send(state->socket, &packet)) return false;
+        byte_cur = packet->b2;
+        timestamp_cur = packet->timestamp;
+        packet->cmd = BGB_CMD_SYNC2;
+        packet->b2 = state->byte;
+        packet->b3 = 0x80;
+        packet->b4 = 0;
+        packet->timestamp = 0;
+
+        // The emulator is waiting on this reply, send it right away
+        if (!bgb_queue(state, packet)) return false;
+        if (!bgb_flush(state)) return false;
+        if (state->timed) {
+            state->turnaround = timer_host_ns() - state->recv_time;
+        }
         if (state->callback_transfer) {
             state->byte = state->callback_transfer(state->user, byte_cur);
         }
@@ -148,9 +287,9 @@ bool bgb_loop(struct bgb_state *state)
         break;
 
     case BGB_CMD_SYNC3:
-        timestamp_cur = packet.timestamp;
-        if (packet.b2 != 0) break;
-        if (!bgb_send(state->socket, &packet)) return false;
+        timestamp_cur = packet->timestamp;
+        if (packet->b2 != 0) break;
+        if (!bgb_queue(state, packet)) return false;
         break;
 
     case BGB_CMD_STATUS:
@@ -158,12 +297,13 @@ bool bgb_loop(struct bgb_state *state)
         break;
 
     case BGB_CMD_WANTDISCONNECT:
-        // Ignore, the server is gonna disconnect for us anyway
+        // The server is gonna disconnect for us, don't reconnect after that
+        state->want_disconnect = true;
         break;
 
     default:
-        fprintf(stderr, "bgb_loop: Unknown command: %d (%02X %02X %02X) @ %d\n",
-            packet.cmd, packet.b2, packet.b3, packet.b4, packet.timestamp);
+        log_warn(NULL, "bgb_loop: Unknown command: %d (%02X %02X %02X) @ %d",
+            packet->cmd, packet->b2, packet->b3, packet->b4, packet->timestamp);
         return false;
     }
 
@@ -179,10 +319,11 @@ bool bgb_loop(struct bgb_state *state)
         //   such as the "break on ld d,d" option.
         uint32_t diff = (state->timestamp_last - timestamp_cur) & 0x7FFFFFFF;
         if (diff != 0 && diff <= 0x100) {
-            fprintf(stderr, "[BGB] Emulator went back in time? "
-                "old: 0x%08X; new: 0x%08X\n",
+            log_warn(NULL, "[BGB] Emulator went back in time? "
+                "old: 0x%08X; new: 0x%08X",
                 state->timestamp_last, timestamp_cur);
             timestamp_cur = state->timestamp_last;
+            __atomic_fetch_add(&state->stats.back_in_time, 1, __ATOMIC_RELAXED);
         }
 
         if (state->timestamp_last != timestamp_cur) {
@@ -194,6 +335,77 @@ bool bgb_loop(struct bgb_state *state)
     return true;
 }
 
+// Receive and handle a batch of packets
+static bool bgb_recv(struct bgb_state *state)
+{
+    unsigned space = sizeof(state->recv_buf) - state->recv_size;
+    if (state->shm) {
+        unsigned num = shmlink_recv(state->shm,
+            state->recv_buf + state->recv_size, space);
+        if (!num) {
+            state->shm_ready = false;
+            return true;
+        }
+        state->recv_size += num;
+        if (state->timed) state->recv_time = timer_host_ns();
+    } else {
+        // Read everything the kernel has buffered, after any partial packet
+        ssize_t num = recv(state->socket,
+            (char *)state->recv_buf + state->recv_size, space, 0);
+        if (num == -1) {
+            if (socket_geterror() == SOCKET_EWOULDBLOCK) {
+                state->ready = false;
+                return true;
+            }
+            log_socket_error(NULL, "bgb_recv");
+            return false;
+        }
+        if (num == 0) return false;
+        state->recv_size += num;
+        if (state->timed) state->recv_time = timer_host_ns();
+
+        // A short read means the socket has been drained
+        if ((unsigned)num < space) state->ready = false;
+    }
+
+    // Handle all the complete packets
+    unsigned offset = 0;
+    while (state->recv_size - offset >= sizeof(struct bgb_packet)) {
+        struct bgb_packet packet;
+        memcpy(&packet, state->recv_buf + offset, sizeof(packet));
+        offset += sizeof(packet);
+        if (state->record) record_write(state->record, RECORD_RECV, &packet);
+        unsigned index = bgb_stat_index(packet.cmd);
+        __atomic_fetch_add(&state->stats.packets_recv[index], 1,
+            __ATOMIC_RELAXED);
+        PROBE(bgb_recv, state, packet.cmd, packet.b2, packet.timestamp);
+        if (!bgb_handle(state, &packet)) return false;
+    }
+
+    // Keep the partial packet around until the rest arrives
+    state->recv_size -= offset;
+    memmove(state->recv_buf, state->recv_buf + offset, state->recv_size);
+    return true;
+}
+
+bool bgb_loop(struct bgb_state *state)
+{
+    if (state->shm) {
+        if (state->ready && !bgb_check_socket(state)) return false;
+
+        // The eventfd has been cleared, so the queue must be drained
+        while (state->shm_ready) {
+            if (!bgb_recv(state)) return false;
+        }
+    } else {
+        if (!state->ready) return true;
+        if (!bgb_recv(state)) return false;
+    }
+
+    // Send any replies that were queued up
+    return bgb_flush(state);
+}
+
 // Bad attmept at implementing link support with the VBA-M emulator.
 // This emulator doesn't implement link support for GBA's normal mode,
 //   and "game boy" link mode for GB/C (implemented here) randomly drops bytes.
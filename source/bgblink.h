@@ -4,8 +4,35 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "record.h"
+#include "shmlink.h"
 #include "socket.h"
 
+// Receive buffer size, must be a multiple of the packet size
+#define BGB_RECV_SIZE (8 * 64)
+// Send buffer size, replies queued up before flushing
+#define BGB_SEND_SIZE (8 * 64)
+
+// Time between attempts to send to an emulator that isn't reading, and the
+//   time after which it's given up on, in milliseconds
+#define BGB_SEND_RETRY 10
+#define BGB_SEND_TIMEOUT 5000
+
+// Packet types counted separately, see bgb_stat_name()
+#define BGB_STAT_CMDS 8
+
+struct bgb_stats {
+    uint64_t packets_recv[BGB_STAT_CMDS];
+    uint64_t packets_sent[BGB_STAT_CMDS];
+    uint64_t back_in_time;
+};
+
+enum bgb_stage {
+    BGB_STAGE_VERSION,
+    BGB_STAGE_STATUS,
+    BGB_STAGE_RUNNING
+};
+
 typedef unsigned char (*bgb_transfer_cb)(void *, unsigned char);
 typedef void (*bgb_timestamp_cb)(void *, uint32_t);
 
@@ -16,12 +43,29 @@ struct bgb_state {
     unsigned char byte;
     bgb_transfer_cb callback_transfer;
     bgb_timestamp_cb callback_timestamp;
+    bool ready;  // Set when the socket has data, see socket_poller_add()
+    struct record *record;  // Optional, set before bgb_init() to log packets
+    struct shmlink *shm;  // Optional, set before bgb_init() to skip the socket
+    bool shm_ready;  // Set when the shared memory link has packets
+    bool timed;  // Optional, set before bgb_init() to measure the turnaround
+    uint64_t turnaround;  // SYNC1 reply latency in ns, for callback_transfer
+    struct bgb_stats stats;  // Kept across links, cleared by the owner
+    bool want_disconnect;  // Set when the emulator asks to end the link
 
     // private
     uint32_t timestamp_last;
     bool timestamp_init;
+    enum bgb_stage stage;
+    unsigned recv_size;
+    uint64_t recv_time;
+    unsigned send_size;
+    uint64_t send_stall;  // Since when the emulator hasn't taken anything
+    unsigned char recv_buf[BGB_RECV_SIZE];
+    unsigned char send_buf[BGB_SEND_SIZE];
 };
 
 void socket_perror(const char *func);
 bool bgb_init(struct bgb_state *state, SOCKET socket, unsigned char init_byte, bgb_transfer_cb callback_transfer, bgb_timestamp_cb callback_timestamp, void *user);
 bool bgb_loop(struct bgb_state *state);
+bool bgb_pending(struct bgb_state *state);
+const char *bgb_stat_name(unsigned index);
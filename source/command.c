@@ -0,0 +1,205 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "command.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Packets start with two magic bytes, followed by a header holding the
+//   command and the size of the data, the data itself, a checksum of the
+//   header and the data, and two bytes acknowledging the packet.
+// Only the 8-bit serial mode is decoded, the one used by the BGB link.
+#define COMMAND_MAGIC1 0x99
+#define COMMAND_MAGIC2 0x66
+#define COMMAND_HEADER_SIZE 4
+#define COMMAND_FOOTER_SIZE 2
+
+enum command_stage {
+    COMMAND_STAGE_IDLE,
+    COMMAND_STAGE_MAGIC,
+    COMMAND_STAGE_HEADER,
+    COMMAND_STAGE_DATA,
+    COMMAND_STAGE_CHECKSUM,
+    COMMAND_STAGE_FOOTER,
+};
+
+static const char *command_names[COMMAND_COUNT] = {
+    [0x0F] = "null",
+    [0x10] = "begin_session",
+    [0x11] = "end_session",
+    [0x12] = "dial_telephone",
+    [0x13] = "hang_up_telephone",
+    [0x14] = "wait_for_telephone_call",
+    [0x15] = "transfer_data",
+    [0x16] = "reset",
+    [0x17] = "telephone_status",
+    [0x18] = "sio32_mode",
+    [0x19] = "read_configuration_data",
+    [0x1A] = "write_configuration_data",
+    [0x1F] = "transfer_data_end",
+    [0x21] = "isp_login",
+    [0x22] = "isp_logout",
+    [0x23] = "open_tcp_connection",
+    [0x24] = "close_tcp_connection",
+    [0x25] = "open_udp_connection",
+    [0x26] = "close_udp_connection",
+    [0x28] = "dns_request",
+    [0x3F] = "test_mode",
+};
+
+// Name of a command known to the adapter, or NULL
+const char *command_name(unsigned cmd)
+{
+    if (cmd >= COMMAND_COUNT) return NULL;
+    return command_names[cmd];
+}
+
+void command_decoder_init(struct command_decoder *decoder)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->request.stage = COMMAND_STAGE_IDLE;
+    decoder->reply.stage = COMMAND_STAGE_IDLE;
+    decoder->pending = -1;
+}
+
+// Advance a packet by one byte
+// Returns true once the whole packet has gone through, including the
+//   acknowledgement.
+static bool command_frame_byte(struct command_decoder *decoder, struct command_frame *frame, unsigned char b, uint64_t now)
+{
+    switch (frame->stage) {
+    case COMMAND_STAGE_IDLE:
+        if (b != COMMAND_MAGIC1) break;
+        frame->stage = COMMAND_STAGE_MAGIC;
+        frame->start = now;
+        break;
+
+    case COMMAND_STAGE_MAGIC:
+        if (b == COMMAND_MAGIC1) {
+            frame->start = now;
+            break;
+        }
+        if (b != COMMAND_MAGIC2) {
+            frame->stage = COMMAND_STAGE_IDLE;
+            break;
+        }
+        frame->stage = COMMAND_STAGE_HEADER;
+        frame->left = COMMAND_HEADER_SIZE;
+        frame->checksum = 0;
+        frame->size = 0;
+        break;
+
+    case COMMAND_STAGE_HEADER:
+        frame->checksum += b;
+        switch (COMMAND_HEADER_SIZE - frame->left--) {
+        case 0: frame->cmd = b; break;
+        case 2: frame->size = b << 8; break;
+        case 3: frame->size |= b; break;
+        }
+        if (frame->left) break;
+        if (frame->size) {
+            frame->stage = COMMAND_STAGE_DATA;
+            frame->left = frame->size;
+        } else {
+            frame->stage = COMMAND_STAGE_CHECKSUM;
+            frame->left = 2;
+        }
+        break;
+
+    case COMMAND_STAGE_DATA:
+        frame->checksum += b;
+        if (--frame->left) break;
+        frame->stage = COMMAND_STAGE_CHECKSUM;
+        frame->left = 2;
+        break;
+
+    case COMMAND_STAGE_CHECKSUM:
+        frame->checksum_recv = frame->checksum_recv << 8 | b;
+        if (--frame->left) break;
+
+        // Garbage that happened to start with the magic bytes is dropped
+        if (frame->checksum_recv != frame->checksum) {
+            decoder->bad_packets++;
+            frame->stage = COMMAND_STAGE_IDLE;
+            break;
+        }
+        frame->stage = COMMAND_STAGE_FOOTER;
+        frame->left = COMMAND_FOOTER_SIZE;
+        break;
+
+    case COMMAND_STAGE_FOOTER:
+        if (--frame->left) break;
+        frame->stage = COMMAND_STAGE_IDLE;
+        return true;
+    }
+    return false;
+}
+
+// Account for a serial transfer, c being the byte sent by the emulator and r
+//   the one the adapter replied with
+// Every request the emulator completes is paired with the next reply of the
+//   adapter, and the time between them split into the time spent
+//   transferring either packet, which is paced by the emulator, and the time
+//   spent waiting on the adapter.
+void command_decoder_transfer(struct command_decoder *decoder, unsigned char c, unsigned char r, uint64_t now)
+{
+    if (command_frame_byte(decoder, &decoder->request, c, now)) {
+        struct command_frame *frame = &decoder->request;
+        decoder->pending = frame->cmd < COMMAND_COUNT ? frame->cmd : -1;
+        decoder->pending_size = frame->size;
+        decoder->pending_start = frame->start;
+        decoder->pending_end = now;
+    }
+
+    if (!command_frame_byte(decoder, &decoder->reply, r, now)) return;
+    struct command_frame *frame = &decoder->reply;
+    int pending = decoder->pending;
+    if (pending < 0) return;
+    decoder->pending = -1;
+    bool error = frame->cmd == (COMMAND_ERROR | 0x80);
+    if (frame->cmd != (pending | 0x80) && !error) return;
+
+    struct command_stats *stats = &decoder->stats[pending];
+    uint64_t time = now - decoder->pending_start;
+    __atomic_fetch_add(&stats->count, 1, __ATOMIC_RELAXED);
+    if (error) __atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->request_bytes, decoder->pending_size,
+        __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->reply_bytes, frame->size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->time_ns, time, __ATOMIC_RELAXED);
+    if (frame->start > decoder->pending_end) {
+        __atomic_fetch_add(&stats->wait_ns, frame->start - decoder->pending_end,
+            __ATOMIC_RELAXED);
+    }
+    if (time > stats->max_ns) {
+        __atomic_store_n(&stats->max_ns, time, __ATOMIC_RELAXED);
+    }
+}
+
+// Print the accounting of every command that went through
+void command_decoder_print(FILE *stream, const char *scope, const struct command_decoder *decoder)
+{
+    for (unsigned i = 0; i < COMMAND_COUNT; i++) {
+        const struct command_stats *stats = &decoder->stats[i];
+        if (!stats->count) continue;
+        const char *name = command_name(i);
+        char unknown[0x10];
+        if (!name) {
+            snprintf(unknown, sizeof(unknown), "0x%02X", i);
+            name = unknown;
+        }
+        fprintf(stream, "[%s] command %s: count %llu, errors %llu, "
+            "avg_ns %llu, avg_wait_ns %llu, max_ns %llu, "
+            "request_bytes %llu, reply_bytes %llu\n", scope, name,
+            (unsigned long long)stats->count,
+            (unsigned long long)stats->errors,
+            (unsigned long long)(stats->time_ns / stats->count),
+            (unsigned long long)(stats->wait_ns / stats->count),
+            (unsigned long long)stats->max_ns,
+            (unsigned long long)stats->request_bytes,
+            (unsigned long long)stats->reply_bytes);
+    }
+    if (decoder->bad_packets) {
+        fprintf(stream, "[%s] command bad_packets: %llu\n", scope,
+            (unsigned long long)decoder->bad_packets);
+    }
+}
@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Commands are numbered below this, replies having the top bit set
+#define COMMAND_COUNT 0x40
+// Reply sent in place of any other when a command fails
+#define COMMAND_ERROR 0x6E
+
+// Accounting of each kind of command, see command_decoder_transfer()
+struct command_stats {
+    uint64_t count;
+    uint64_t errors;  // Replied to with COMMAND_ERROR
+    uint64_t request_bytes;
+    uint64_t reply_bytes;
+    uint64_t time_ns;  // From the first byte of the request to the last reply
+    uint64_t wait_ns;  // Part of it between the request and the reply
+    uint64_t max_ns;
+};
+
+// Position within a packet sent in one direction
+struct command_frame {
+    unsigned char stage;
+    unsigned char cmd;
+    unsigned size;
+    unsigned left;
+    uint16_t checksum;
+    uint16_t checksum_recv;
+    uint64_t start;
+};
+
+// Follows the packets exchanged over the serial port, pairing every request
+//   with its reply
+struct command_decoder {
+    struct command_frame request;
+    struct command_frame reply;
+    int pending;  // Command waiting on its reply, -1 if none
+    unsigned pending_size;
+    uint64_t pending_start;
+    uint64_t pending_end;
+    uint64_t bad_packets;
+    struct command_stats stats[COMMAND_COUNT];
+};
+
+const char *command_name(unsigned cmd);
+void command_decoder_init(struct command_decoder *decoder);
+void command_decoder_transfer(struct command_decoder *decoder, unsigned char c, unsigned char r, uint64_t now);
+void command_decoder_print(FILE *stream, const char *scope, const struct command_decoder *decoder);
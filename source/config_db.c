@@ -0,0 +1,345 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "config_db.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "thread.h"
+
+// File layout, all numbers being little endian:
+//   header: magic, version, slots, slot size
+//   index: one key per slot, empty if unused
+//   data: two copies per slot, each a sequence number, a CRC-32 of the
+//     config, and the config itself
+#define CONFIG_DB_MAGIC "MOBILEDB"
+#define CONFIG_DB_VERSION 1
+#define CONFIG_DB_HEADER_SIZE 0x40
+#define CONFIG_DB_COPY_HEADER 8
+
+static uint32_t get_u32(const unsigned char *buf)
+{
+    return (uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+        (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+static void put_u32(unsigned char *buf, uint32_t value)
+{
+    buf[0] = value;
+    buf[1] = value >> 8;
+    buf[2] = value >> 16;
+    buf[3] = value >> 24;
+}
+
+static uint32_t crc32(const unsigned char *data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (unsigned x = 0; x < 8; x++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static size_t config_db_size(unsigned slots, unsigned slot_size)
+{
+    return CONFIG_DB_HEADER_SIZE + (size_t)slots * CONFIG_DB_KEY_SIZE +
+        (size_t)slots * 2 * (CONFIG_DB_COPY_HEADER + slot_size);
+}
+
+static unsigned char *config_db_index(struct config_db *db, unsigned slot)
+{
+    return db->map + CONFIG_DB_HEADER_SIZE + (size_t)slot * CONFIG_DB_KEY_SIZE;
+}
+
+static unsigned char *config_db_copy(struct config_db *db, unsigned slot, unsigned copy)
+{
+    return db->map + CONFIG_DB_HEADER_SIZE +
+        (size_t)db->slots * CONFIG_DB_KEY_SIZE +
+        ((size_t)slot * 2 + copy) * (CONFIG_DB_COPY_HEADER + db->slot_size);
+}
+
+// Write a range of the mapping back to the file
+static bool config_db_sync(struct config_db *db, void *addr, size_t size)
+{
+#if defined(__unix__)
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(page - 1);
+    if (msync((void *)start, (uintptr_t)addr + size - start, MS_SYNC) == -1) {
+        perror("msync");
+        return false;
+    }
+    (void)db;
+    return true;
+#elif defined(_WIN32)
+    if (!FlushViewOfFile(addr, size) || !FlushFileBuffers(db->file)) {
+        fprintf(stderr, "FlushViewOfFile: Error %lu\n", GetLastError());
+        return false;
+    }
+    return true;
+#endif
+}
+
+// Create an empty database, with room for a fixed amount of configs
+bool config_db_create(const char *fname, unsigned slots, unsigned slot_size)
+{
+    unsigned char header[CONFIG_DB_HEADER_SIZE] = {0};
+    memcpy(header, CONFIG_DB_MAGIC, 8);
+    put_u32(header + 8, CONFIG_DB_VERSION);
+    put_u32(header + 12, slots);
+    put_u32(header + 16, slot_size);
+    size_t size = config_db_size(slots, slot_size);
+
+#if defined(__unix__)
+    int fd = open(fname, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd == -1) {
+        perror("open");
+        return false;
+    }
+
+    // Reserve the space up front, writes to the mapping can't fail later on
+    int rc = posix_fallocate(fd, 0, size);
+    if (rc == EINVAL || rc == EOPNOTSUPP) {
+        rc = ftruncate(fd, size) == -1 ? errno : 0;
+    }
+    bool ok = !rc;
+    if (ok) ok = pwrite(fd, header, sizeof(header), 0) == sizeof(header);
+    if (ok) ok = fsync(fd) == 0;
+    if (!ok) {
+        if (rc) errno = rc;
+        perror("config_db_create");
+        close(fd);
+        unlink(fname);
+        return false;
+    }
+    close(fd);
+    return true;
+#else
+    FILE *file = fopen(fname, "wb");
+    if (!file) {
+        perror("fopen");
+        return false;
+    }
+    bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+    for (size_t i = sizeof(header); ok && i < size; i++) {
+        ok = fputc(0, file) != EOF;
+    }
+    if (fclose(file) != 0) ok = false;
+    if (!ok) {
+        perror("config_db_create");
+        remove(fname);
+        return false;
+    }
+    return true;
+#endif
+}
+
+static void config_db_unmap(struct config_db *db)
+{
+#if defined(__unix__)
+    munmap(db->map, db->map_size);
+#elif defined(_WIN32)
+    UnmapViewOfFile(db->map);
+    CloseHandle(db->mapping);
+    CloseHandle(db->file);
+#endif
+}
+
+bool config_db_open(struct config_db *db, const char *fname)
+{
+    size_t size;
+
+#if defined(__unix__)
+    int fd = open(fname, O_RDWR);
+    if (fd == -1) {
+        perror("open");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return false;
+    }
+    size = st.st_size;
+    if (size < CONFIG_DB_HEADER_SIZE) {
+        fprintf(stderr, "%s: Not a config database\n", fname);
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+#elif defined(_WIN32)
+    db->file = CreateFileA(fname, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (db->file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "CreateFile: Error %lu\n", GetLastError());
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(db->file, &file_size) ||
+            file_size.QuadPart < CONFIG_DB_HEADER_SIZE) {
+        fprintf(stderr, "%s: Not a config database\n", fname);
+        CloseHandle(db->file);
+        return false;
+    }
+    size = (size_t)file_size.QuadPart;
+    db->mapping = CreateFileMappingA(db->file, NULL, PAGE_READWRITE, 0, 0,
+        NULL);
+    void *map = db->mapping ?
+        MapViewOfFile(db->mapping, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+    if (!map) {
+        fprintf(stderr, "MapViewOfFile: Error %lu\n", GetLastError());
+        if (db->mapping) CloseHandle(db->mapping);
+        CloseHandle(db->file);
+        return false;
+    }
+#endif
+
+    db->map = map;
+    db->map_size = size;
+    db->slots = get_u32(db->map + 12);
+    db->slot_size = get_u32(db->map + 16);
+    if (memcmp(db->map, CONFIG_DB_MAGIC, 8) != 0 ||
+            get_u32(db->map + 8) != CONFIG_DB_VERSION ||
+            size < config_db_size(db->slots, db->slot_size)) {
+        fprintf(stderr, "%s: Not a config database\n", fname);
+        config_db_unmap(db);
+        return false;
+    }
+    thread_mutex_init(&db->lock);
+    return true;
+}
+
+void config_db_close(struct config_db *db)
+{
+    config_db_unmap(db);
+    thread_mutex_destroy(&db->lock);
+}
+
+// Look up the slot holding a key, returns -1 if it doesn't exist
+int config_db_find(struct config_db *db, const char *key)
+{
+    int found = -1;
+    thread_mutex_lock(&db->lock);
+    for (unsigned i = 0; i < db->slots; i++) {
+        const char *entry = (const char *)config_db_index(db, i);
+        if (strncmp(entry, key, CONFIG_DB_KEY_SIZE) == 0) {
+            found = i;
+            break;
+        }
+    }
+    thread_mutex_unlock(&db->lock);
+    return found;
+}
+
+// Claim an empty slot for a key, with an empty config
+int config_db_add(struct config_db *db, const char *key)
+{
+    if (!*key || strlen(key) >= CONFIG_DB_KEY_SIZE) {
+        fprintf(stderr, "config_db_add: Invalid key: %s\n", key);
+        return -1;
+    }
+
+    int slot = -1;
+    thread_mutex_lock(&db->lock);
+    for (unsigned i = 0; i < db->slots; i++) {
+        if (*config_db_index(db, i)) continue;
+        slot = i;
+        break;
+    }
+    if (slot >= 0) {
+        // Both copies are cleared before the key is set, so a new slot never
+        //   shows the data of the one that was there before it.
+        size_t copy_size = CONFIG_DB_COPY_HEADER + db->slot_size;
+        memset(config_db_copy(db, slot, 0), 0, copy_size * 2);
+        config_db_sync(db, config_db_copy(db, slot, 0), copy_size * 2);
+
+        unsigned char *entry = config_db_index(db, slot);
+        memset(entry, 0, CONFIG_DB_KEY_SIZE);
+        strcpy((char *)entry, key);
+        config_db_sync(db, entry, CONFIG_DB_KEY_SIZE);
+    }
+    thread_mutex_unlock(&db->lock);
+
+    if (slot < 0) fprintf(stderr, "config_db_add: Database is full\n");
+    return slot;
+}
+
+void config_db_remove(struct config_db *db, unsigned slot)
+{
+    thread_mutex_lock(&db->lock);
+    unsigned char *entry = config_db_index(db, slot);
+    memset(entry, 0, CONFIG_DB_KEY_SIZE);
+    config_db_sync(db, entry, CONFIG_DB_KEY_SIZE);
+    thread_mutex_unlock(&db->lock);
+}
+
+// Key of a slot, or NULL if it's empty
+const char *config_db_key(struct config_db *db, unsigned slot)
+{
+    const char *entry = (const char *)config_db_index(db, slot);
+    return *entry ? entry : NULL;
+}
+
+// Find the newest intact copy of a slot's config, or -1 if there is none
+static int config_db_current(struct config_db *db, unsigned slot)
+{
+    int current = -1;
+    uint32_t current_seq = 0;
+    for (unsigned i = 0; i < 2; i++) {
+        const unsigned char *copy = config_db_copy(db, slot, i);
+        uint32_t seq = get_u32(copy);
+        if (crc32(copy + CONFIG_DB_COPY_HEADER, db->slot_size) !=
+                get_u32(copy + 4)) {
+            continue;
+        }
+        if (current < 0 || (int32_t)(seq - current_seq) > 0) {
+            current = i;
+            current_seq = seq;
+        }
+    }
+    return current;
+}
+
+// Read a slot's config, which is zeroed if it was never written
+// Slots must only be accessed by one session at a time.
+void config_db_load(struct config_db *db, unsigned slot, void *dest)
+{
+    int current = config_db_current(db, slot);
+    if (current < 0) {
+        memset(dest, 0, db->slot_size);
+        return;
+    }
+    memcpy(dest, config_db_copy(db, slot, current) + CONFIG_DB_COPY_HEADER,
+        db->slot_size);
+}
+
+// Write a slot's config over its older copy, and sync it to the disk
+bool config_db_store(struct config_db *db, unsigned slot, const void *src)
+{
+    int current = config_db_current(db, slot);
+    unsigned target = current == 0 ? 1 : 0;
+    uint32_t seq = 0;
+    if (current >= 0) seq = get_u32(config_db_copy(db, slot, current)) + 1;
+
+    unsigned char *copy = config_db_copy(db, slot, target);
+    memcpy(copy + CONFIG_DB_COPY_HEADER, src, db->slot_size);
+    put_u32(copy + 4, crc32(src, db->slot_size));
+    put_u32(copy, seq);
+    return config_db_sync(db, copy, CONFIG_DB_COPY_HEADER + db->slot_size);
+}
@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "thread.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+// Maximum length of a key, including the terminator
+#define CONFIG_DB_KEY_SIZE 0x40
+// Amount of configs a database holds when it's created without a size
+#define CONFIG_DB_SLOTS 1024
+
+// Many adapter configurations stored in a single preallocated file, indexed
+//   by name. Every slot holds two copies of its config, each with a sequence
+//   number and checksum, and writes always go to the older copy. The newest
+//   intact copy is the current one, so an interrupted write is harmless.
+struct config_db {
+    unsigned char *map;
+    size_t map_size;
+    unsigned slots;
+    unsigned slot_size;
+    thread_mutex_t lock;
+#if defined(_WIN32)
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+bool config_db_create(const char *fname, unsigned slots, unsigned slot_size);
+bool config_db_open(struct config_db *db, const char *fname);
+void config_db_close(struct config_db *db);
+int config_db_find(struct config_db *db, const char *key);
+int config_db_add(struct config_db *db, const char *key);
+void config_db_remove(struct config_db *db, unsigned slot);
+const char *config_db_key(struct config_db *db, unsigned slot);
+void config_db_load(struct config_db *db, unsigned slot, void *dest);
+bool config_db_store(struct config_db *db, unsigned slot, const void *src);
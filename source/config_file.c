@@ -0,0 +1,500 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "config_file.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#elif defined(_WIN32)
+#include <io.h>
+#include <windows.h>
+#endif
+
+#include "mpsc.h"
+#include "thread.h"
+#include "timer.h"
+
+// A copy of a configuration, waiting to be written
+struct config_file_snapshot {
+    char *fname;
+    unsigned char *data;
+    size_t size;
+    struct config_db *db;
+    int slot;
+};
+
+// The latest snapshot of a configuration that's waiting to be written
+struct config_file_pending {
+    char *fname;  // NULL if unused
+    struct config_db *db;
+    int slot;
+    size_t pos;  // Position of the snapshot in the ring
+};
+
+// Snapshots are queued by any thread, and written by the writer thread, so
+//   no event loop ever waits for the disk
+static struct {
+    struct mpsc ring;
+    bool running;
+    thread_t thread;
+    bool stop;
+    uint64_t written;  // Atomic, snapshots written so far, in ring order
+    thread_mutex_t pending_lock;
+    struct config_file_pending pending[CONFIG_FILE_WRITES];
+} config_writer;
+
+// Whether a snapshot has been written, with pending_lock held
+static bool config_file_pending_done(struct config_file_pending *pending)
+{
+    return !pending->fname ||
+        pending->pos < __atomic_load_n(&config_writer.written,
+            __ATOMIC_ACQUIRE);
+}
+
+// Look up the pending entry of a configuration, with pending_lock held
+static struct config_file_pending *config_file_pending_find(struct config_file *config)
+{
+    for (unsigned i = 0; i < CONFIG_FILE_WRITES; i++) {
+        struct config_file_pending *pending = &config_writer.pending[i];
+        if (config_file_pending_done(pending)) continue;
+        if (pending->db != config->db) continue;
+        if (config->db ? pending->slot == config->slot :
+                strcmp(pending->fname, config->fname) == 0) {
+            return pending;
+        }
+    }
+    return NULL;
+}
+
+// Remember the latest snapshot of a configuration, claimed at pos
+// There's never more unwritten snapshots than the ring holds, so a finished
+//   entry is always found for new configurations.
+static bool config_file_pending_set(struct config_file *config, size_t pos)
+{
+    thread_mutex_lock(&config_writer.pending_lock);
+    struct config_file_pending *pending = config_file_pending_find(config);
+    for (unsigned i = 0; !pending && i < CONFIG_FILE_WRITES; i++) {
+        if (!config_file_pending_done(&config_writer.pending[i])) continue;
+        pending = &config_writer.pending[i];
+
+        char *fname = realloc(pending->fname, strlen(config->fname) + 1);
+        if (!fname) {
+            perror("realloc");
+            thread_mutex_unlock(&config_writer.pending_lock);
+            return false;
+        }
+        strcpy(fname, config->fname);
+        pending->fname = fname;
+        pending->db = config->db;
+        pending->slot = config->slot;
+    }
+    pending->pos = pos;
+    thread_mutex_unlock(&config_writer.pending_lock);
+    return true;
+}
+
+// Wait for the snapshots of a configuration queued so far to be written
+// Reopening a configuration must not read what's about to be replaced, but
+//   doesn't need to wait on any snapshot queued after its own.
+static void config_file_writer_sync(struct config_file *config)
+{
+    if (!config_writer.running) return;
+    thread_mutex_lock(&config_writer.pending_lock);
+    struct config_file_pending *pending = config_file_pending_find(config);
+    uint64_t pos = pending ? pending->pos : 0;
+    thread_mutex_unlock(&config_writer.pending_lock);
+    if (!pending) return;
+
+    while (__atomic_load_n(&config_writer.written, __ATOMIC_ACQUIRE) <= pos) {
+        thread_sleep(1);
+    }
+}
+
+// Map the file into memory, creating it if necessary
+// The mapping is private, changes only reach the file through a flush.
+static bool config_file_map(struct config_file *config, size_t size)
+{
+#if defined(__unix__)
+    int fd = open(config->fname, O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        perror("open");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return false;
+    }
+    if ((size_t)st.st_size < size) {
+        // Any missing data reads as zeroes
+        if (ftruncate(fd, size) == -1) {
+            perror("ftruncate");
+            close(fd);
+            return false;
+        }
+    } else {
+        size = st.st_size;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    config->data = data;
+    config->size = size;
+    config->mapped = true;
+    return true;
+#else
+    // Read the file into memory instead, it's created on the first flush
+    FILE *file = fopen(config->fname, "rb");
+    long file_size = 0;
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        file_size = ftell(file);
+        rewind(file);
+        if (file_size > 0 && (size_t)file_size > size) size = file_size;
+    }
+
+    config->data = calloc(size, 1);
+    if (!config->data) {
+        perror("calloc");
+        if (file) fclose(file);
+        return false;
+    }
+    if (file) {
+        if (file_size > 0 && fread(config->data, 1, file_size, file) !=
+                (size_t)file_size) {
+            perror("fread");
+            fclose(file);
+            free(config->data);
+            return false;
+        }
+        fclose(file);
+    }
+    config->size = size;
+    config->mapped = false;
+    return true;
+#endif
+}
+
+// Open a configuration file, making sure it's at least the provided size
+bool config_file_open(struct config_file *config, const char *fname, size_t size)
+{
+    config->fname = malloc(strlen(fname) + 1);
+    if (!config->fname) {
+        perror("malloc");
+        return false;
+    }
+    strcpy(config->fname, fname);
+    config->db = NULL;
+    config->slot = -1;
+    config->dirty = false;
+    config->dirty_time = 0;
+
+    config_file_writer_sync(config);
+    if (!config_file_map(config, size)) {
+        free(config->fname);
+        return false;
+    }
+    return true;
+}
+
+// Open the configuration stored under a key in a database, adding it if needed
+bool config_file_open_db(struct config_file *config, struct config_db *db, const char *key, size_t size)
+{
+    if (db->slot_size < size) {
+        fprintf(stderr, "Config database slots are too small: %u < %zu\n",
+            db->slot_size, size);
+        return false;
+    }
+
+    config->fname = malloc(strlen(key) + 1);
+    config->data = malloc(db->slot_size);
+    if (!config->fname || !config->data) {
+        perror("malloc");
+        free(config->fname);
+        free(config->data);
+        return false;
+    }
+    strcpy(config->fname, key);
+    config->size = db->slot_size;
+    config->db = db;
+    config->mapped = false;
+    config->dirty = false;
+    config->dirty_time = 0;
+
+    config->slot = config_db_find(db, key);
+    if (config->slot < 0) config->slot = config_db_add(db, key);
+    if (config->slot < 0) {
+        free(config->fname);
+        free(config->data);
+        return false;
+    }
+    config_file_writer_sync(config);
+    config_db_load(db, config->slot, config->data);
+    return true;
+}
+
+void config_file_close(struct config_file *config)
+{
+    // The last changes must not be lost, wait for the writer to make room
+    while (config->dirty && !config_file_flush(config) &&
+            config_writer.running) {
+        thread_sleep(CONFIG_FILE_WRITE_INTERVAL);
+    }
+#if defined(__unix__)
+    if (config->mapped) munmap(config->data, config->size);
+#endif
+    if (!config->mapped) free(config->data);
+    free(config->fname);
+}
+
+bool config_file_read(struct config_file *config, void *dest, uintptr_t offset, size_t size)
+{
+    if (offset > config->size || size > config->size - offset) return false;
+    memcpy(dest, config->data + offset, size);
+    return true;
+}
+
+bool config_file_write(struct config_file *config, const void *src, uintptr_t offset, size_t size)
+{
+    if (offset > config->size || size > config->size - offset) return false;
+
+    // libmobile rewrites the whole configuration on every save
+    if (memcmp(config->data + offset, src, size) == 0) return true;
+    memcpy(config->data + offset, src, size);
+    if (!config->dirty) {
+        config->dirty = true;
+        config->dirty_time = timer_host_ns();
+    }
+    return true;
+}
+
+// Make sure the directory entry of a replaced file has hit the disk
+static void config_file_sync_dir(const char *fname)
+{
+#if defined(__unix__)
+    char *path = malloc(strlen(fname) + 1);
+    if (!path) return;
+    strcpy(path, fname);
+    int fd = open(dirname(path), O_RDONLY);
+    free(path);
+    if (fd == -1) return;
+    fsync(fd);
+    close(fd);
+#else
+    (void)fname;
+#endif
+}
+
+// Write a snapshot to a temporary file, and move it over the original
+// Database slots are written in place instead, see config_db_store().
+static bool config_file_store(struct config_db *db, int slot,
+    const char *fname, const unsigned char *data, size_t size)
+{
+    if (db) {
+        if (!config_db_store(db, slot, data)) {
+            fprintf(stderr, "Could not save config (%s)\n", fname);
+            return false;
+        }
+        return true;
+    }
+
+    size_t len = strlen(fname);
+    char *fname_tmp = malloc(len + sizeof(".tmp"));
+    if (!fname_tmp) {
+        perror("malloc");
+        return false;
+    }
+    memcpy(fname_tmp, fname, len);
+    memcpy(fname_tmp + len, ".tmp", sizeof(".tmp"));
+
+    FILE *file = fopen(fname_tmp, "wb");
+    if (!file) {
+        perror("fopen");
+        free(fname_tmp);
+        return false;
+    }
+    bool ok = fwrite(data, 1, size, file) == size && fflush(file) == 0;
+#if defined(__unix__)
+    ok = ok && fsync(fileno(file)) == 0;
+#elif defined(_WIN32)
+    ok = ok && _commit(_fileno(file)) == 0;
+#endif
+    if (fclose(file) != 0) ok = false;
+
+#if defined(_WIN32)
+    ok = ok && MoveFileExA(fname_tmp, fname,
+        MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    ok = ok && rename(fname_tmp, fname) == 0;
+#endif
+    if (!ok) {
+        fprintf(stderr, "Could not save config (%s): ", fname);
+        perror(NULL);
+        remove(fname_tmp);
+        free(fname_tmp);
+        return false;
+    }
+    free(fname_tmp);
+
+    config_file_sync_dir(fname);
+    return true;
+}
+
+// Write out every queued snapshot, in the order they were queued
+static void config_file_drain(void)
+{
+    struct config_file_snapshot *snap;
+    while ((snap = mpsc_peek(&config_writer.ring))) {
+        if (snap->data) {
+            config_file_store(snap->db, snap->slot, snap->fname, snap->data,
+                snap->size);
+        }
+        free(snap->fname);
+        free(snap->data);
+        mpsc_release(&config_writer.ring);
+        __atomic_add_fetch(&config_writer.written, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void config_file_writer_thread(void *arg)
+{
+    (void)arg;
+    while (!__atomic_load_n(&config_writer.stop, __ATOMIC_ACQUIRE)) {
+        config_file_drain();
+        thread_sleep(CONFIG_FILE_WRITE_INTERVAL);
+    }
+    config_file_drain();
+}
+
+// Start writing configurations from a thread of their own
+// Until then, they're written directly by whoever flushes them.
+bool config_file_writer_init(void)
+{
+    if (!mpsc_init(&config_writer.ring, CONFIG_FILE_WRITES,
+            sizeof(struct config_file_snapshot))) {
+        return false;
+    }
+    config_writer.written = 0;
+    config_writer.stop = false;
+    thread_mutex_init(&config_writer.pending_lock);
+    for (unsigned i = 0; i < CONFIG_FILE_WRITES; i++) {
+        config_writer.pending[i].fname = NULL;
+    }
+
+    config_writer.running = true;
+    if (!thread_create(&config_writer.thread, config_file_writer_thread,
+            NULL)) {
+        config_writer.running = false;
+        thread_mutex_destroy(&config_writer.pending_lock);
+        mpsc_deinit(&config_writer.ring);
+        return false;
+    }
+    return true;
+}
+
+// Write out the remaining snapshots and stop the writer thread
+// Every configuration must be closed by now, and any database still open.
+void config_file_writer_deinit(void)
+{
+    if (!config_writer.running) return;
+    __atomic_store_n(&config_writer.stop, true, __ATOMIC_RELEASE);
+    thread_join(config_writer.thread);
+    for (unsigned i = 0; i < CONFIG_FILE_WRITES; i++) {
+        free(config_writer.pending[i].fname);
+    }
+    thread_mutex_destroy(&config_writer.pending_lock);
+    mpsc_deinit(&config_writer.ring);
+    config_writer.running = false;
+}
+
+// Hand a copy of the configuration over to the writer thread
+// Fails when the queue is full, in which case nothing has been copied.
+static bool config_file_queue(struct config_file *config)
+{
+    size_t len = strlen(config->fname) + 1;
+    char *fname = malloc(len);
+    unsigned char *data = malloc(config->size);
+    if (!fname || !data) {
+        perror("malloc");
+        free(fname);
+        free(data);
+        return false;
+    }
+    memcpy(fname, config->fname, len);
+    memcpy(data, config->data, config->size);
+
+    size_t pos;
+    struct config_file_snapshot *snap = mpsc_claim(&config_writer.ring, &pos);
+    if (!snap) {
+        free(fname);
+        free(data);
+        return false;
+    }
+    snap->fname = fname;
+    snap->data = data;
+    snap->size = config->size;
+    snap->db = config->db;
+    snap->slot = config->slot;
+
+    // A claimed slot must be committed, with or without its data
+    bool ok = config_file_pending_set(config, pos);
+    if (!ok) {
+        free(snap->fname);
+        free(snap->data);
+        snap->fname = NULL;
+        snap->data = NULL;
+    }
+    mpsc_commit(&config_writer.ring, pos);
+    return ok;
+}
+
+// Save the configuration, from the writer thread if it's running
+// Snapshots of the same configuration are written in order, so a later one
+//   always wins.
+bool config_file_flush(struct config_file *config)
+{
+    if (config_writer.running) {
+        if (!config_file_queue(config)) return false;
+    } else if (!config_file_store(config->db, config->slot, config->fname,
+            config->data, config->size)) {
+        return false;
+    }
+    config->dirty = false;
+    return true;
+}
+
+// Write pending changes once they've been around for long enough
+void config_file_loop(struct config_file *config)
+{
+    if (!config->dirty) return;
+    if (timer_host_ns() - config->dirty_time <
+            (uint64_t)CONFIG_FILE_FLUSH_DELAY * 1000000) {
+        return;
+    }
+    if (!config_file_flush(config)) {
+        // Try again later
+        config->dirty_time = timer_host_ns();
+    }
+}
+
+// Calculate how long until pending changes are written, capped at the delay
+int config_file_delay(struct config_file *config, int delay)
+{
+    if (!config->dirty) return delay;
+    uint64_t elapsed = (timer_host_ns() - config->dirty_time) / 1000000;
+    if (elapsed >= CONFIG_FILE_FLUSH_DELAY) return 0;
+    int left = CONFIG_FILE_FLUSH_DELAY - (int)elapsed;
+    if (delay < 0 || left < delay) delay = left;
+    return delay;
+}
@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "config_db.h"
+
+// Maximum time changes are kept in memory before being written, in ms
+#define CONFIG_FILE_FLUSH_DELAY 1000
+// Amount of snapshots waiting to be written, a power of two
+#define CONFIG_FILE_WRITES 256
+// Time the writer thread sleeps between draining its queue, in milliseconds
+#define CONFIG_FILE_WRITE_INTERVAL 10
+
+// Adapter configuration, kept in memory and written back as a whole
+// The file is replaced atomically, so it's never left half-written.
+// Alternatively, the configuration lives in a slot of a config_db.
+struct config_file {
+    char *fname;
+    unsigned char *data;
+    size_t size;
+    struct config_db *db;
+    int slot;
+    bool mapped;
+    bool dirty;
+    uint64_t dirty_time;
+};
+
+bool config_file_writer_init(void);
+void config_file_writer_deinit(void);
+bool config_file_open(struct config_file *config, const char *fname, size_t size);
+bool config_file_open_db(struct config_file *config, struct config_db *db, const char *key, size_t size);
+void config_file_close(struct config_file *config);
+bool config_file_read(struct config_file *config, void *dest, uintptr_t offset, size_t size);
+bool config_file_write(struct config_file *config, const void *src, uintptr_t offset, size_t size);
+bool config_file_flush(struct config_file *config);
+void config_file_loop(struct config_file *config);
+int config_file_delay(struct config_file *config, int delay);
@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Management of the config databases used by the --config-db option.
+//   Configs are moved in and out of a database as the files a session would
+//   otherwise use, so existing setups can be converted in either direction.
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mobile.h>
+
+#include "config_db.h"
+
+static char *program_name;
+
+static void show_help(void)
+{
+    fprintf(stderr, "%s db command [args]\n"
+        "\n"
+        "create [slots]      Create an empty database, for %u configs by default\n"
+        "list                List the configs in the database\n"
+        "import key file     Copy a config file into the database\n"
+        "export key file     Copy a config from the database into a file\n"
+        "delete key          Remove a config from the database\n",
+        program_name, CONFIG_DB_SLOTS);
+    exit(EXIT_FAILURE);
+}
+
+static int configdb_find(struct config_db *db, const char *key)
+{
+    int slot = config_db_find(db, key);
+    if (slot < 0) fprintf(stderr, "Config not found: %s\n", key);
+    return slot;
+}
+
+static bool configdb_import(struct config_db *db, const char *key, const char *fname)
+{
+    FILE *file = fopen(fname, "rb");
+    if (!file) {
+        perror("fopen");
+        return false;
+    }
+    unsigned char *data = calloc(db->slot_size, 1);
+    if (!data) {
+        perror("calloc");
+        fclose(file);
+        return false;
+    }
+
+    // Shorter files are padded with zeroes, just like config files are
+    fread(data, 1, db->slot_size, file);
+    bool ok = !ferror(file);
+    if (!ok) perror("fread");
+    fclose(file);
+
+    int slot = -1;
+    if (ok) {
+        slot = config_db_find(db, key);
+        if (slot < 0) slot = config_db_add(db, key);
+        ok = slot >= 0;
+    }
+    if (ok) ok = config_db_store(db, slot, data);
+    free(data);
+    return ok;
+}
+
+static bool configdb_export(struct config_db *db, const char *key, const char *fname)
+{
+    int slot = configdb_find(db, key);
+    if (slot < 0) return false;
+
+    unsigned char *data = malloc(db->slot_size);
+    if (!data) {
+        perror("malloc");
+        return false;
+    }
+    config_db_load(db, slot, data);
+
+    FILE *file = fopen(fname, "wb");
+    if (!file) {
+        perror("fopen");
+        free(data);
+        return false;
+    }
+    bool ok = fwrite(data, 1, db->slot_size, file) == db->slot_size;
+    if (fclose(file) != 0) ok = false;
+    if (!ok) perror("fwrite");
+    free(data);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    program_name = argv[0];
+    if (argc < 3) show_help();
+    const char *fname = argv[1];
+    const char *command = argv[2];
+    char **args = argv + 3;
+    int args_count = argc - 3;
+
+    if (strcmp(command, "create") == 0) {
+        if (args_count > 1) show_help();
+        unsigned slots = CONFIG_DB_SLOTS;
+        if (args_count) {
+            char *endptr;
+            slots = strtoul(args[0], &endptr, 10);
+            if (!*args[0] || *endptr || !slots) {
+                fprintf(stderr, "Invalid amount of slots: %s\n", args[0]);
+                show_help();
+            }
+        }
+        if (!config_db_create(fname, slots, MOBILE_CONFIG_SIZE)) {
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    struct config_db db;
+    if (!config_db_open(&db, fname)) return EXIT_FAILURE;
+
+    bool ok = true;
+    if (strcmp(command, "list") == 0 && args_count == 0) {
+        for (unsigned i = 0; i < db.slots; i++) {
+            const char *key = config_db_key(&db, i);
+            if (key) printf("%s\n", key);
+        }
+    } else if (strcmp(command, "import") == 0 && args_count == 2) {
+        ok = configdb_import(&db, args[0], args[1]);
+    } else if (strcmp(command, "export") == 0 && args_count == 2) {
+        ok = configdb_export(&db, args[0], args[1]);
+    } else if (strcmp(command, "delete") == 0 && args_count == 1) {
+        int slot = configdb_find(&db, args[0]);
+        if (slot >= 0) {
+            config_db_remove(&db, slot);
+        } else {
+            ok = false;
+        }
+    } else {
+        config_db_close(&db);
+        show_help();
+    }
+
+    config_db_close(&db);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,410 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "dns.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <mobile_inet.h>
+
+#include "timer.h"
+
+#define DNS_HEADER_SIZE 12
+#define DNS_TYPE_A 1
+#define DNS_TYPE_AAAA 28
+#define DNS_TYPE_OPT 41
+#define DNS_CLASS_IN 1
+
+// Header flags
+#define DNS_QR 0x8000
+#define DNS_OPCODE 0x7800
+#define DNS_AA 0x0400
+#define DNS_TC 0x0200
+#define DNS_RD 0x0100
+#define DNS_RA 0x0080
+#define DNS_RCODE 0x000F
+
+static uint16_t get_u16(const unsigned char *buf)
+{
+    return buf[0] << 8 | buf[1];
+}
+
+static void put_u16(unsigned char *buf, uint16_t value)
+{
+    buf[0] = value >> 8;
+    buf[1] = value;
+}
+
+static uint32_t get_u32(const unsigned char *buf)
+{
+    return (uint32_t)get_u16(buf) << 16 | get_u16(buf + 2);
+}
+
+static void put_u32(unsigned char *buf, uint32_t value)
+{
+    put_u16(buf, value >> 16);
+    put_u16(buf + 2, value);
+}
+
+bool dns_init(struct dns *dns, bool cache)
+{
+    dns->statics = NULL;
+    dns->statics_count = 0;
+    dns->cache_enabled = cache;
+    dns->cache = NULL;
+    dns->hits = 0;
+    dns->misses = 0;
+    if (cache) {
+        dns->cache = calloc(DNS_CACHE_ENTRIES, sizeof(*dns->cache));
+        if (!dns->cache) {
+            perror("calloc");
+            return false;
+        }
+    }
+    thread_mutex_init(&dns->lock);
+    return true;
+}
+
+void dns_deinit(struct dns *dns)
+{
+    for (unsigned i = 0; i < dns->statics_count; i++) {
+        free(dns->statics[i].name);
+    }
+    free(dns->statics);
+    free(dns->cache);
+    thread_mutex_destroy(&dns->lock);
+}
+
+// Encode a dotted domain name into lowercase DNS labels
+static unsigned dns_encode_name(unsigned char *dest, const char *name)
+{
+    unsigned size = 0;
+    while (*name) {
+        size_t len = strcspn(name, ".");
+        if (!len || len > 63 || size + len + 2 > 255) return 0;
+        dest[size++] = len;
+        for (size_t i = 0; i < len; i++) dest[size++] = tolower(name[i]);
+        name += len;
+        if (*name) name++;
+    }
+    dest[size++] = 0;
+    return size;
+}
+
+// Load a table of fixed addresses, in the format of a hosts file
+// Every line holds an IPv4 or IPv6 address, followed by its names.
+bool dns_load_static(struct dns *dns, const char *fname)
+{
+    FILE *file = fopen(fname, "r");
+    if (!file) {
+        perror("fopen");
+        return false;
+    }
+
+    char line[0x400];
+    unsigned line_num = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        line_num++;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char *saveptr;
+        char *addr = strtok_r(line, " \t\r\n", &saveptr);
+        if (!addr) continue;
+        unsigned char ip[MOBILE_INET_PTON_MAXLEN];
+        int rc = mobile_inet_pton(MOBILE_INET_PTON_ANY, addr, ip);
+        if (rc != MOBILE_INET_PTON_IPV4 && rc != MOBILE_INET_PTON_IPV6) {
+            fprintf(stderr, "%s:%u: Invalid address: %s\n", fname, line_num,
+                addr);
+            ok = false;
+            break;
+        }
+
+        char *name;
+        while ((name = strtok_r(NULL, " \t\r\n", &saveptr))) {
+            unsigned char encoded[255];
+            unsigned size = dns_encode_name(encoded, name);
+            if (!size) {
+                fprintf(stderr, "%s:%u: Invalid name: %s\n", fname, line_num,
+                    name);
+                ok = false;
+                break;
+            }
+
+            struct dns_static_entry *statics = realloc(dns->statics,
+                sizeof(*statics) * (dns->statics_count + 1));
+            if (!statics) {
+                perror("realloc");
+                ok = false;
+                break;
+            }
+            dns->statics = statics;
+            struct dns_static_entry *entry = &statics[dns->statics_count];
+            entry->name = malloc(size);
+            if (!entry->name) {
+                perror("malloc");
+                ok = false;
+                break;
+            }
+            memcpy(entry->name, encoded, size);
+            entry->name_size = size;
+            if (rc == MOBILE_INET_PTON_IPV4) {
+                entry->type = DNS_TYPE_A;
+                memcpy(entry->addr, ip, 4);
+            } else {
+                entry->type = DNS_TYPE_AAAA;
+                memcpy(entry->addr, ip, 16);
+            }
+            dns->statics_count++;
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+// Read the question of a message, as its lowercase name, type and class
+// Returns the offset of the question's end, or 0 if it's malformed.
+static unsigned dns_question(const unsigned char *msg, unsigned size, unsigned char *key, unsigned *key_size)
+{
+    unsigned offset = DNS_HEADER_SIZE;
+    unsigned len = 0;
+    for (;;) {
+        if (offset >= size) return 0;
+        unsigned label = msg[offset];
+        if (label & 0xC0) return 0;
+        if (len + label + 1 > DNS_KEY_SIZE - 4) return 0;
+        if (offset + label + 1 > size) return 0;
+        key[len++] = label;
+        offset++;
+        for (unsigned i = 0; i < label; i++) {
+            key[len++] = tolower(msg[offset++]);
+        }
+        if (!label) break;
+    }
+    if (offset + 4 > size) return 0;
+    memcpy(key + len, msg + offset, 4);
+    *key_size = len + 4;
+    return offset + 4;
+}
+
+// Find the end of a possibly compressed name, or 0 if it's malformed
+static unsigned dns_skip_name(const unsigned char *msg, unsigned size, unsigned offset)
+{
+    while (offset < size) {
+        unsigned label = msg[offset];
+        if ((label & 0xC0) == 0xC0) return offset + 2 <= size ? offset + 2 : 0;
+        if (label & 0xC0) return 0;
+        offset += label + 1;
+        if (!label) return offset;
+    }
+    return 0;
+}
+
+// Go over the TTL of every record, finding the lowest one, and optionally
+//   lowering them by the time that has passed since they were received
+static bool dns_ttls(unsigned char *msg, unsigned size, uint32_t *min, uint32_t elapsed)
+{
+    unsigned offset = DNS_HEADER_SIZE;
+    unsigned questions = get_u16(msg + 4);
+    unsigned records = get_u16(msg + 6) + get_u16(msg + 8) +
+        get_u16(msg + 10);
+
+    for (unsigned i = 0; i < questions; i++) {
+        offset = dns_skip_name(msg, size, offset);
+        if (!offset || offset + 4 > size) return false;
+        offset += 4;
+    }
+
+    *min = DNS_CACHE_TTL_MAX;
+    for (unsigned i = 0; i < records; i++) {
+        offset = dns_skip_name(msg, size, offset);
+        if (!offset || offset + 10 > size) return false;
+        uint16_t type = get_u16(msg + offset);
+        uint32_t ttl = get_u32(msg + offset + 4);
+        unsigned rdlength = get_u16(msg + offset + 8);
+
+        // The TTL field of EDNS records holds flags instead
+        if (type != DNS_TYPE_OPT) {
+            ttl = ttl > elapsed ? ttl - elapsed : 0;
+            if (elapsed) put_u32(msg + offset + 4, ttl);
+            if (ttl < *min) *min = ttl;
+        }
+        offset += 10 + rdlength;
+        if (offset > size) return false;
+    }
+    return true;
+}
+
+// Answer a query from the static table
+static unsigned dns_answer_static(struct dns *dns, const unsigned char *query, unsigned question_end, const unsigned char *key, unsigned key_size, unsigned char *reply)
+{
+    unsigned name_size = key_size - 4;
+    uint16_t type = get_u16(key + name_size);
+    uint16_t class = get_u16(key + name_size + 2);
+
+    bool found = false;
+    unsigned answers = 0;
+    unsigned size = question_end;
+    memcpy(reply, query, question_end);
+    for (unsigned i = 0; i < dns->statics_count; i++) {
+        struct dns_static_entry *entry = &dns->statics[i];
+        if (entry->name_size != name_size) continue;
+        if (memcmp(entry->name, key, name_size) != 0) continue;
+        found = true;
+        if (entry->type != type || class != DNS_CLASS_IN) continue;
+
+        unsigned addr_size = entry->type == DNS_TYPE_A ? 4 : 16;
+        if (size + 12 + addr_size > DNS_MESSAGE_SIZE) break;
+
+        // Point back at the name in the question
+        put_u16(reply + size, 0xC000 | DNS_HEADER_SIZE);
+        put_u16(reply + size + 2, entry->type);
+        put_u16(reply + size + 4, DNS_CLASS_IN);
+        put_u32(reply + size + 6, DNS_STATIC_TTL);
+        put_u16(reply + size + 10, addr_size);
+        memcpy(reply + size + 12, entry->addr, addr_size);
+        size += 12 + addr_size;
+        answers++;
+    }
+    if (!found) return 0;
+
+    // A name without addresses of the requested type has no answers
+    uint16_t flags = get_u16(query + 2);
+    put_u16(reply + 2, DNS_QR | DNS_AA | (flags & DNS_RD) | DNS_RA);
+    put_u16(reply + 6, answers);
+    put_u16(reply + 8, 0);
+    put_u16(reply + 10, 0);
+    return size;
+}
+
+// Answer a query from the cache, with the lock held
+static unsigned dns_answer_cache(struct dns *dns, const unsigned char *query, const unsigned char *key, unsigned key_size, unsigned char *reply)
+{
+    uint64_t now = timer_host_ns();
+    for (unsigned i = 0; i < DNS_CACHE_ENTRIES; i++) {
+        struct dns_cache_entry *entry = &dns->cache[i];
+        if (!entry->reply_size || entry->expire <= now) continue;
+        if (entry->key_size != key_size) continue;
+        if (memcmp(entry->key, key, key_size) != 0) continue;
+
+        memcpy(reply, entry->reply, entry->reply_size);
+        memcpy(reply, query, 2);
+        uint32_t min;
+        uint32_t elapsed = (now - entry->time) / 1000000000;
+        dns_ttls(reply, entry->reply_size, &min, elapsed);
+        return entry->reply_size;
+    }
+    return 0;
+}
+
+// Answer a query without asking a server, if possible
+// Returns the size of the reply, which fits DNS_MESSAGE_SIZE, or 0 if the
+//   query must be sent to a server.
+unsigned dns_answer(struct dns *dns, const unsigned char *query, unsigned query_size, unsigned char *reply)
+{
+    if (query_size < DNS_HEADER_SIZE || query_size > DNS_MESSAGE_SIZE) {
+        return 0;
+    }
+    uint16_t flags = get_u16(query + 2);
+    if (flags & (DNS_QR | DNS_OPCODE)) return 0;
+    if (get_u16(query + 4) != 1) return 0;
+
+    unsigned char key[DNS_KEY_SIZE];
+    unsigned key_size;
+    unsigned question_end = dns_question(query, query_size, key, &key_size);
+    if (!question_end) return 0;
+
+    unsigned size = dns_answer_static(dns, query, question_end, key, key_size,
+        reply);
+    if (size || !dns->cache_enabled) return size;
+
+    thread_mutex_lock(&dns->lock);
+    size = dns_answer_cache(dns, query, key, key_size, reply);
+    if (size) {
+        dns->hits++;
+    } else {
+        dns->misses++;
+    }
+    thread_mutex_unlock(&dns->lock);
+    return size;
+}
+
+// Remember a query about to be sent to a server, so its reply can be cached
+// Returns false if the reply wouldn't be cached anyway.
+bool dns_query_init(struct dns *dns, struct dns_query *query, const unsigned char *msg, unsigned size)
+{
+    query->key_size = 0;
+    if (!dns->cache_enabled) return false;
+    if (size < DNS_HEADER_SIZE || size > DNS_MESSAGE_SIZE) return false;
+    uint16_t flags = get_u16(msg + 2);
+    if (flags & (DNS_QR | DNS_OPCODE)) return false;
+    if (get_u16(msg + 4) != 1) return false;
+
+    unsigned key_size;
+    if (!dns_question(msg, size, query->key, &key_size)) return false;
+    query->id = get_u16(msg);
+    query->key_size = key_size;
+    return true;
+}
+
+// Remember a server's reply to a query, for as long as its records may be
+//   kept
+// Returns false if it isn't a reply to the query, which is left alone.
+bool dns_store(struct dns *dns, const struct dns_query *query, const unsigned char *reply, unsigned reply_size)
+{
+    if (!query->key_size) return false;
+    if (reply_size < DNS_HEADER_SIZE || reply_size > DNS_MESSAGE_SIZE) {
+        return false;
+    }
+    if (get_u16(reply) != query->id) return false;
+    if (get_u16(reply + 4) != 1) return false;
+
+    // Anyone could send a datagram from the server's address, but only the
+    //   server knows the ID, and a reply must repeat the question
+    unsigned char key[DNS_KEY_SIZE];
+    unsigned key_size;
+    if (!dns_question(reply, reply_size, key, &key_size)) return false;
+    if (key_size != query->key_size ||
+            memcmp(key, query->key, key_size) != 0) {
+        return false;
+    }
+
+    // Only complete, successful answers are kept
+    uint16_t flags = get_u16(reply + 2);
+    if (!(flags & DNS_QR) || (flags & (DNS_OPCODE | DNS_TC | DNS_RCODE))) {
+        return true;
+    }
+    if (get_u16(reply + 6) == 0) return true;
+
+    unsigned char copy[DNS_MESSAGE_SIZE];
+    memcpy(copy, reply, reply_size);
+    uint32_t ttl;
+    if (!dns_ttls(copy, reply_size, &ttl, 0) || !ttl) return true;
+
+    thread_mutex_lock(&dns->lock);
+
+    // Replace the same question, or else the entry expiring the soonest
+    struct dns_cache_entry *target = &dns->cache[0];
+    for (unsigned i = 0; i < DNS_CACHE_ENTRIES; i++) {
+        struct dns_cache_entry *entry = &dns->cache[i];
+        if (entry->key_size == key_size &&
+                memcmp(entry->key, key, key_size) == 0) {
+            target = entry;
+            break;
+        }
+        if (entry->expire < target->expire) target = entry;
+    }
+
+    uint64_t now = timer_host_ns();
+    memcpy(target->key, key, key_size);
+    target->key_size = key_size;
+    memcpy(target->reply, copy, reply_size);
+    target->reply_size = reply_size;
+    target->time = now;
+    target->expire = now + (uint64_t)ttl * 1000000000;
+
+    thread_mutex_unlock(&dns->lock);
+    return true;
+}
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "thread.h"
+
+// Largest DNS message handled, the limit for plain UDP
+#define DNS_MESSAGE_SIZE 512
+// Longest encoded domain name, plus type and class
+#define DNS_KEY_SIZE (255 + 4)
+// Amount of answers kept in the cache
+#define DNS_CACHE_ENTRIES 256
+// Maximum time an answer is kept for, in seconds, regardless of its TTL
+#define DNS_CACHE_TTL_MAX 86400
+// TTL given to the answers from the static table, in seconds
+#define DNS_STATIC_TTL 60
+// Amount of queries a connection may be waiting on the reply of
+#define DNS_QUERIES 4
+
+struct dns_cache_entry {
+    unsigned char key[DNS_KEY_SIZE];
+    unsigned key_size;
+    unsigned char reply[DNS_MESSAGE_SIZE];
+    unsigned reply_size;
+    uint64_t time;
+    uint64_t expire;
+};
+
+struct dns_static_entry {
+    unsigned char *name;  // Encoded as lowercase labels
+    unsigned name_size;
+    uint16_t type;
+    unsigned char addr[16];
+};
+
+// A query sent to a server, only the reply to it may be cached
+struct dns_query {
+    uint16_t id;
+    unsigned char key[DNS_KEY_SIZE];
+    unsigned key_size;  // 0 if no reply is expected
+};
+
+// Answers the adapter's DNS queries without reaching out to the network,
+//   from a table of static addresses and a cache of the previous answers.
+// Shared between every session, the cache is protected by the lock.
+struct dns {
+    struct dns_static_entry *statics;
+    unsigned statics_count;
+
+    bool cache_enabled;
+    thread_mutex_t lock;
+    struct dns_cache_entry *cache;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+bool dns_init(struct dns *dns, bool cache);
+void dns_deinit(struct dns *dns);
+bool dns_load_static(struct dns *dns, const char *fname);
+unsigned dns_answer(struct dns *dns, const unsigned char *query, unsigned query_size, unsigned char *reply);
+bool dns_query_init(struct dns *dns, struct dns_query *query, const unsigned char *msg, unsigned size);
+bool dns_store(struct dns *dns, const struct dns_query *query, const unsigned char *reply, unsigned reply_size);
@@ -0,0 +1,534 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "engine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "log.h"
+#include "session.h"
+#include "socket.h"
+#include "thread.h"
+#include "timer.h"
+
+// Minimum difference in serial bytes per interval before load is rebalanced
+#define ENGINE_BALANCE_MIN_RATE 64
+
+static bool engine_wake_init(SOCKET wake[2], struct socket_poller *poller, bool *ready)
+{
+    if (!socket_wake_init(wake)) return false;
+    if (!socket_poller_add(poller, wake[1], ready)) {
+        socket_wake_deinit(wake);
+        return false;
+    }
+    *ready = false;
+    return true;
+}
+
+static void engine_wake_deinit(SOCKET wake[2], struct socket_poller *poller)
+{
+    socket_poller_del(poller, wake[1]);
+    socket_wake_deinit(wake);
+}
+
+static bool shard_push(struct shard_session **list, unsigned *count, unsigned *size, struct shard_session *entry)
+{
+    if (*count >= *size) {
+        unsigned new_size = *size ? *size * 2 : 8;
+        struct shard_session *new_list =
+            realloc(*list, sizeof(**list) * new_size);
+        if (!new_list) {
+            perror("realloc");
+            return false;
+        }
+        *list = new_list;
+        *size = new_size;
+    }
+    (*list)[(*count)++] = *entry;
+    return true;
+}
+
+// Hand a session over to a shard, to be picked up by its thread
+static bool shard_send(struct shard *shard, struct shard_session *entry)
+{
+    thread_mutex_lock(&shard->lock);
+    bool ok = shard_push(&shard->inbox, &shard->inbox_count,
+        &shard->inbox_size, entry);
+    if (ok) {
+        shard->load_sessions += 1;
+        shard->load_rate += entry->rate;
+    }
+    thread_mutex_unlock(&shard->lock);
+    if (ok) socket_wake(shard->wake);
+    return ok;
+}
+
+// Take a session's load off of a shard
+static void shard_unload(struct shard *shard, struct shard_session *entry)
+{
+    thread_mutex_lock(&shard->lock);
+    shard->load_sessions -= 1;
+    shard->load_rate -= entry->rate < shard->load_rate ?
+        entry->rate : shard->load_rate;
+    thread_mutex_unlock(&shard->lock);
+}
+
+// Start handling every session that was handed over to this shard
+static void shard_receive(struct shard *shard)
+{
+    // Swap the inbox out, to set the sessions up without holding the lock
+    thread_mutex_lock(&shard->lock);
+    struct shard_session *received = shard->inbox;
+    unsigned received_count = shard->inbox_count;
+    unsigned received_size = shard->inbox_size;
+    shard->inbox = shard->received;
+    shard->inbox_count = 0;
+    shard->inbox_size = shard->received_size;
+    thread_mutex_unlock(&shard->lock);
+    shard->received = received;
+    shard->received_size = received_size;
+
+    for (unsigned i = 0; i < received_count; i++) {
+        struct shard_session *entry = &received[i];
+        struct mobile_user *mobile = entry->mobile;
+        if (session_attach(mobile, &shard->poller) &&
+                shard_push(&shard->sessions, &shard->sessions_count,
+                    &shard->sessions_size, entry)) {
+            continue;
+        }
+        log_error(mobile->name, "Could not start session");
+        shard_unload(shard, entry);
+        engine_session_release(shard->engine, mobile->id);
+        session_free(mobile);
+    }
+}
+
+static void shard_close(struct shard *shard, unsigned index)
+{
+    struct shard_session *entry = &shard->sessions[index];
+    struct mobile_user *mobile = entry->mobile;
+    struct engine *engine = shard->engine;
+
+    shard_unload(shard, entry);
+    if (!__atomic_load_n(&engine->exit_on_close, __ATOMIC_RELAXED) &&
+            !__atomic_load_n(&engine->stop, __ATOMIC_ACQUIRE)) {
+        log_info(mobile->name, "Emulator disconnected");
+    }
+    engine_session_release(engine, mobile->id);
+    session_free(mobile);
+    shard->sessions[index] = shard->sessions[--shard->sessions_count];
+}
+
+// Move the session that best evens out the load between two shards
+static void shard_migrate(struct shard *shard, struct shard *target)
+{
+    thread_mutex_lock(&target->lock);
+    uint64_t target_rate = target->load_rate;
+    thread_mutex_unlock(&target->lock);
+
+    uint64_t rate = 0;
+    for (unsigned i = 0; i < shard->sessions_count; i++) {
+        rate += shard->sessions[i].rate;
+    }
+    uint64_t diff = rate > target_rate ? rate - target_rate : 0;
+    uint64_t want = diff / 2;
+
+    // Only sessions that sit between adapter actions may be moved
+    unsigned best = shard->sessions_count;
+    uint64_t best_diff = UINT64_MAX;
+    for (unsigned i = 0; i < shard->sessions_count; i++) {
+        struct shard_session *entry = &shard->sessions[i];
+        if (entry->mobile->action != MOBILE_ACTION_NONE) continue;
+
+        // Don't just move the imbalance over to the other shard
+        if (diff && entry->rate >= diff) continue;
+
+        uint64_t entry_diff = entry->rate > want ?
+            entry->rate - want : want - entry->rate;
+        if (entry_diff < best_diff) {
+            best = i;
+            best_diff = entry_diff;
+        }
+    }
+    if (best == shard->sessions_count) return;
+
+    struct shard_session entry = shard->sessions[best];
+    session_detach(entry.mobile);
+    shard->sessions[best] = shard->sessions[--shard->sessions_count];
+    shard_unload(shard, &entry);
+
+    if (!shard_send(target, &entry)) {
+        engine_session_release(shard->engine, entry.mobile->id);
+        session_free(entry.mobile);
+    }
+}
+
+// Print the histograms of the shard and its sessions, without interleaving
+//   them with the ones of other shards.
+static void shard_dump(struct shard *shard)
+{
+    char scope[0x20];
+    snprintf(scope, sizeof(scope), "shard %u", shard->index);
+
+    thread_mutex_lock(&shard->engine->lock);
+    histogram_print(stderr, scope, "wait_ns", &shard->hist_wait);
+    for (unsigned i = 0; i < shard->sessions_count; i++) {
+        session_dump(shard->sessions[i].mobile, stderr);
+    }
+    thread_mutex_unlock(&shard->engine->lock);
+}
+
+// Measure the load of every session, and publish it for the balancer
+static void shard_measure(struct shard *shard)
+{
+    struct engine *engine = shard->engine;
+
+    uint64_t now = timer_host_ns();
+    bool window = now - shard->window_start >=
+        (uint64_t)ENGINE_BALANCE_INTERVAL * 1000000;
+    uint64_t rate = 0;
+    if (window) {
+        for (unsigned i = 0; i < shard->sessions_count; i++) {
+            struct shard_session *entry = &shard->sessions[i];
+            entry->rate = entry->mobile->transfers - entry->transfers_mark;
+            entry->transfers_mark = entry->mobile->transfers;
+            rate += entry->rate;
+        }
+        shard->window_start = now;
+    }
+
+    thread_mutex_lock(&shard->lock);
+    if (window) shard->load_rate = rate;
+    int migrate_to = shard->migrate_to;
+    shard->migrate_to = -1;
+    bool dump = shard->dump;
+    shard->dump = false;
+    thread_mutex_unlock(&shard->lock);
+
+    if (migrate_to >= 0) shard_migrate(shard, &engine->shards[migrate_to]);
+    if (dump) shard_dump(shard);
+}
+
+static void shard_main(void *arg)
+{
+    struct shard *shard = arg;
+    struct engine *engine = shard->engine;
+
+    shard->window_start = timer_host_ns();
+    while (!__atomic_load_n(&engine->stop, __ATOMIC_ACQUIRE)) {
+        if (shard->wake_ready) {
+            socket_wake_drain(shard->wake, &shard->wake_ready);
+        }
+        shard_receive(shard);
+
+        // Wait for any of the sockets to do something, or until the next
+        //   timer libmobile is waiting on expires.
+        int delay = SESSION_WAIT_IDLE;
+        unsigned i = 0;
+        while (i < shard->sessions_count) {
+            struct mobile_user *mobile = shard->sessions[i].mobile;
+            if (!session_loop(mobile)) {
+                shard_close(shard, i);
+                continue;
+            }
+            delay = session_delay(mobile, delay);
+            i++;
+        }
+
+        shard_measure(shard);
+        uint64_t start = timer_host_ns();
+        socket_poller_wait(&shard->poller, delay);
+        histogram_record(&shard->hist_wait, timer_host_ns() - start);
+    }
+
+    // Stop every adapter and close all sockets
+    shard_receive(shard);
+    while (shard->sessions_count) shard_close(shard, 0);
+}
+
+static bool shard_init(struct shard *shard, struct engine *engine, unsigned index)
+{
+    shard->engine = engine;
+    shard->index = index;
+    shard->sessions = NULL;
+    shard->sessions_count = 0;
+    shard->sessions_size = 0;
+    shard->received = NULL;
+    shard->received_size = 0;
+    shard->window_start = 0;
+    histogram_init(&shard->hist_wait);
+    shard->inbox = NULL;
+    shard->inbox_count = 0;
+    shard->inbox_size = 0;
+    shard->load_sessions = 0;
+    shard->load_rate = 0;
+    shard->migrate_to = -1;
+    shard->dump = false;
+
+    if (!socket_poller_init(&shard->poller)) return false;
+    if (!engine_wake_init(shard->wake, &shard->poller, &shard->wake_ready)) {
+        socket_poller_deinit(&shard->poller);
+        return false;
+    }
+    thread_mutex_init(&shard->lock);
+    return true;
+}
+
+static void shard_deinit(struct shard *shard)
+{
+    thread_mutex_destroy(&shard->lock);
+    engine_wake_deinit(shard->wake, &shard->poller);
+    socket_poller_deinit(&shard->poller);
+    free(shard->sessions);
+    free(shard->received);
+    free(shard->inbox);
+}
+
+// Set up the shards, with the main thread waiting on the provided poller
+bool engine_init(struct engine *engine, unsigned threads, struct socket_poller *poller)
+{
+    engine->shards = NULL;
+    engine->shards_count = 0;
+    engine->exit_on_close = false;
+    engine->exit_on_empty = false;
+    engine->stop = false;
+    engine->balance_last = 0;
+    engine->ids = NULL;
+    engine->mobiles = NULL;
+    engine->ids_size = 0;
+    engine->sessions = 0;
+
+    if (!engine_wake_init(engine->wake, poller, &engine->wake_ready)) {
+        return false;
+    }
+    thread_mutex_init(&engine->lock);
+
+    engine->shards = malloc(sizeof(struct shard) * threads);
+    if (!engine->shards) {
+        perror("malloc");
+        engine_deinit(engine, poller);
+        return false;
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        if (!shard_init(&engine->shards[i], engine, i)) {
+            engine_deinit(engine, poller);
+            return false;
+        }
+        engine->shards_count += 1;
+    }
+    return true;
+}
+
+void engine_deinit(struct engine *engine, struct socket_poller *poller)
+{
+    for (unsigned i = 0; i < engine->shards_count; i++) {
+        shard_deinit(&engine->shards[i]);
+    }
+    free(engine->shards);
+    free(engine->ids);
+    free(engine->mobiles);
+    thread_mutex_destroy(&engine->lock);
+    engine_wake_deinit(engine->wake, poller);
+}
+
+// Spawn one thread per shard
+bool engine_start(struct engine *engine)
+{
+    unsigned started;
+    for (started = 0; started < engine->shards_count; started++) {
+        struct shard *shard = &engine->shards[started];
+        if (!thread_create(&shard->thread, shard_main, shard)) break;
+    }
+
+    if (started < engine->shards_count) {
+        __atomic_store_n(&engine->stop, true, __ATOMIC_RELEASE);
+        for (unsigned i = 0; i < started; i++) {
+            socket_wake(engine->shards[i].wake);
+            thread_join(engine->shards[i].thread);
+        }
+        return false;
+    }
+    return true;
+}
+
+// Stop every shard, closing all of their sessions
+void engine_stop(struct engine *engine)
+{
+    __atomic_store_n(&engine->stop, true, __ATOMIC_RELEASE);
+    for (unsigned i = 0; i < engine->shards_count; i++) {
+        socket_wake(engine->shards[i].wake);
+    }
+    for (unsigned i = 0; i < engine->shards_count; i++) {
+        thread_join(engine->shards[i].thread);
+    }
+}
+
+// Reserve the lowest session number that isn't in use
+bool engine_session_id(struct engine *engine, unsigned *id)
+{
+    thread_mutex_lock(&engine->lock);
+    unsigned i;
+    for (i = 0; i < engine->ids_size; i++) if (!engine->ids[i]) break;
+    if (i >= engine->ids_size) {
+        unsigned size = engine->ids_size ? engine->ids_size * 2 : 8;
+        bool *ids = realloc(engine->ids, sizeof(*ids) * size);
+        if (ids) engine->ids = ids;
+        struct mobile_user **mobiles = realloc(engine->mobiles,
+            sizeof(*mobiles) * size);
+        if (mobiles) engine->mobiles = mobiles;
+        if (!ids || !mobiles) {
+            thread_mutex_unlock(&engine->lock);
+            perror("realloc");
+            return false;
+        }
+        for (unsigned x = engine->ids_size; x < size; x++) {
+            ids[x] = false;
+            mobiles[x] = NULL;
+        }
+        engine->ids_size = size;
+    }
+    engine->ids[i] = true;
+    engine->sessions += 1;
+    thread_mutex_unlock(&engine->lock);
+
+    *id = i;
+    return true;
+}
+
+// Release a session number, stopping the engine if it was the last one
+// Sessions added to the engine must be released before being freed.
+void engine_session_release(struct engine *engine, unsigned id)
+{
+    thread_mutex_lock(&engine->lock);
+    engine->ids[id] = false;
+    engine->mobiles[id] = NULL;
+    engine->sessions -= 1;
+    bool stop = __atomic_load_n(&engine->exit_on_close, __ATOMIC_RELAXED) ||
+        (__atomic_load_n(&engine->exit_on_empty, __ATOMIC_RELAXED) &&
+            !engine->sessions);
+    thread_mutex_unlock(&engine->lock);
+
+    if (stop && !__atomic_exchange_n(&engine->stop, true, __ATOMIC_ACQ_REL)) {
+        socket_wake(engine->wake);
+    }
+}
+
+// Place a new session on the least loaded shard
+// The session must have a number reserved through engine_session_id.
+bool engine_add(struct engine *engine, struct mobile_user *mobile)
+{
+    struct shard *best = NULL;
+    uint64_t best_rate = 0;
+    unsigned best_sessions = 0;
+    for (unsigned i = 0; i < engine->shards_count; i++) {
+        struct shard *shard = &engine->shards[i];
+        thread_mutex_lock(&shard->lock);
+        uint64_t rate = shard->load_rate;
+        unsigned sessions = shard->load_sessions;
+        thread_mutex_unlock(&shard->lock);
+
+        if (best && (rate > best_rate ||
+                (rate == best_rate && sessions >= best_sessions))) {
+            continue;
+        }
+        best = shard;
+        best_rate = rate;
+        best_sessions = sessions;
+    }
+
+    thread_mutex_lock(&engine->lock);
+    engine->mobiles[mobile->id] = mobile;
+    thread_mutex_unlock(&engine->lock);
+
+    struct shard_session entry = {
+        .mobile = mobile,
+        .transfers_mark = mobile->transfers,
+        .rate = 0
+    };
+    if (!shard_send(best, &entry)) {
+        thread_mutex_lock(&engine->lock);
+        engine->mobiles[mobile->id] = NULL;
+        thread_mutex_unlock(&engine->lock);
+        return false;
+    }
+    return true;
+}
+
+// Housekeeping done by the main thread whenever it wakes up
+void engine_loop(struct engine *engine)
+{
+    if (engine->wake_ready) {
+        socket_wake_drain(engine->wake, &engine->wake_ready);
+    }
+
+    uint64_t now = timer_host_ns();
+    if (now - engine->balance_last <
+            (uint64_t)ENGINE_BALANCE_INTERVAL * 1000000) {
+        return;
+    }
+    engine->balance_last = now;
+    if (engine->shards_count < 2) return;
+
+    // Take a snapshot of the load of every shard
+    struct shard *busy = NULL, *idle = NULL;
+    struct shard *full = NULL, *empty = NULL;
+    uint64_t busy_rate = 0, idle_rate = 0;
+    unsigned busy_sessions = 0, full_sessions = 0, empty_sessions = 0;
+    for (unsigned i = 0; i < engine->shards_count; i++) {
+        struct shard *shard = &engine->shards[i];
+        thread_mutex_lock(&shard->lock);
+        uint64_t rate = shard->load_rate;
+        unsigned sessions = shard->load_sessions;
+        thread_mutex_unlock(&shard->lock);
+
+        if (!busy || rate > busy_rate) {
+            busy = shard;
+            busy_rate = rate;
+            busy_sessions = sessions;
+        }
+        if (!idle || rate < idle_rate) {
+            idle = shard;
+            idle_rate = rate;
+        }
+        if (!full || sessions > full_sessions) {
+            full = shard;
+            full_sessions = sessions;
+        }
+        if (!empty || sessions < empty_sessions) {
+            empty = shard;
+            empty_sessions = sessions;
+        }
+    }
+
+    // Move work away from overloaded shards first, and otherwise even out
+    //   the amount of sessions on each shard.
+    struct shard *from = NULL, *to = NULL;
+    if (busy != idle && busy_sessions >= 2 &&
+            busy_rate > idle_rate + ENGINE_BALANCE_MIN_RATE &&
+            busy_rate > idle_rate + idle_rate / 4) {
+        from = busy;
+        to = idle;
+    } else if (full_sessions > empty_sessions + 1) {
+        from = full;
+        to = empty;
+    }
+    if (!from) return;
+
+    thread_mutex_lock(&from->lock);
+    from->migrate_to = (int)to->index;
+    thread_mutex_unlock(&from->lock);
+    socket_wake(from->wake);
+}
+
+// Have every shard print its histograms
+void engine_dump(struct engine *engine)
+{
+    for (unsigned i = 0; i < engine->shards_count; i++) {
+        struct shard *shard = &engine->shards[i];
+        thread_mutex_lock(&shard->lock);
+        shard->dump = true;
+        thread_mutex_unlock(&shard->lock);
+        socket_wake(shard->wake);
+    }
+}
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "histogram.h"
+#include "session.h"
+#include "socket.h"
+#include "thread.h"
+
+// How often the load of each shard is measured, in milliseconds
+#define ENGINE_BALANCE_INTERVAL 1000
+
+struct engine;
+
+struct shard_session {
+    struct mobile_user *mobile;
+    uint64_t transfers_mark;
+    uint64_t rate;
+};
+
+// A worker thread with its own event loop, handling a subset of the sessions
+struct shard {
+    struct engine *engine;
+    unsigned index;
+    thread_t thread;
+    struct socket_poller poller;
+    SOCKET wake[2];
+    bool wake_ready;
+
+    // Only touched by the shard's own thread
+    struct shard_session *sessions;
+    unsigned sessions_count;
+    unsigned sessions_size;
+    struct shard_session *received;  // Swapped with the inbox
+    unsigned received_size;
+    uint64_t window_start;
+    struct histogram hist_wait;
+
+    // Shared with the other threads, protected by the lock
+    thread_mutex_t lock;
+    struct shard_session *inbox;
+    unsigned inbox_count;
+    unsigned inbox_size;
+    unsigned load_sessions;
+    uint64_t load_rate;
+    int migrate_to;
+    bool dump;
+};
+
+struct engine {
+    struct shard *shards;
+    unsigned shards_count;
+    bool exit_on_close;  // Atomic
+    bool exit_on_empty;  // Atomic
+    bool stop;  // Atomic
+    SOCKET wake[2];
+    bool wake_ready;
+    uint64_t balance_last;
+
+    // Session numbers in use, and the sessions added to the engine under
+    //   them, protected by the lock. The lock also keeps the sessions from
+    //   being freed, see engine_session_release().
+    thread_mutex_t lock;
+    bool *ids;
+    struct mobile_user **mobiles;
+    unsigned ids_size;
+    unsigned sessions;
+};
+
+bool engine_init(struct engine *engine, unsigned threads, struct socket_poller *poller);
+void engine_deinit(struct engine *engine, struct socket_poller *poller);
+bool engine_start(struct engine *engine);
+void engine_stop(struct engine *engine);
+bool engine_session_id(struct engine *engine, unsigned *id);
+void engine_session_release(struct engine *engine, unsigned id);
+bool engine_add(struct engine *engine, struct mobile_user *mobile);
+void engine_loop(struct engine *engine);
+void engine_dump(struct engine *engine);
@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "histogram.h"
+
+#include <string.h>
+
+void histogram_init(struct histogram *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
+
+// Highest value that falls into a bucket
+static uint64_t histogram_bucket_max(unsigned index)
+{
+    if (index < HISTOGRAM_SUB * 2) return index;
+    unsigned shift = index / HISTOGRAM_SUB - 1;
+    uint64_t base = (uint64_t)(index % HISTOGRAM_SUB + HISTOGRAM_SUB) << shift;
+    return base + (((uint64_t)1 << shift) - 1);
+}
+
+// Value below which the given fraction of samples lies, in thousandths
+uint64_t histogram_percentile(const struct histogram *hist, unsigned permille)
+{
+    // Samples may still be coming in, rely on a single read of the count
+    uint64_t count = hist->count;
+    if (!count) return 0;
+    uint64_t want = (count * permille + 999) / 1000;
+    if (!want) want = 1;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= want) {
+            uint64_t value = histogram_bucket_max(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void histogram_print(FILE *stream, const char *scope, const char *name, const struct histogram *hist)
+{
+    if (!hist->count) return;
+    fprintf(stream, "[%s] %s: count %llu, p50 %llu, p90 %llu, p99 %llu, "
+        "p999 %llu, max %llu\n", scope, name,
+        (unsigned long long)hist->count,
+        (unsigned long long)histogram_percentile(hist, 500),
+        (unsigned long long)histogram_percentile(hist, 900),
+        (unsigned long long)histogram_percentile(hist, 990),
+        (unsigned long long)histogram_percentile(hist, 999),
+        (unsigned long long)hist->max);
+}
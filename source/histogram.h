@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Values are sorted into buckets by their highest bit, each split into
+//   2^HISTOGRAM_SUB_BITS linear sub-buckets. This keeps every bucket within
+//   6.25% of the values it holds, over the full 64-bit range.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+struct histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+static inline unsigned histogram_msb(uint64_t value)
+{
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(value);
+#elif defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return index;
+#else
+    unsigned msb = 0;
+    while (value >>= 1) msb++;
+    return msb;
+#endif
+}
+
+// Add a sample, cheap enough to be done on every serial transfer
+static inline void histogram_record(struct histogram *hist, uint64_t value)
+{
+    unsigned index = (unsigned)value;
+    if (value >= HISTOGRAM_SUB) {
+        unsigned shift = histogram_msb(value) - HISTOGRAM_SUB_BITS;
+        index = shift * HISTOGRAM_SUB + (unsigned)(value >> shift);
+    }
+    hist->buckets[index]++;
+    hist->count++;
+    if (value > hist->max) hist->max = value;
+}
+
+void histogram_init(struct histogram *hist);
+uint64_t histogram_percentile(const struct histogram *hist, unsigned permille);
+void histogram_print(FILE *stream, const char *scope, const char *name, const struct histogram *hist);
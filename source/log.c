@@ -0,0 +1,244 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "log.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__unix__)
+#include <syslog.h>
+#endif
+
+#include "mpsc.h"
+#include "socket.h"
+#include "thread.h"
+#include "timer.h"
+
+// A line waiting to be written
+struct log_line {
+    int level;
+    uint64_t time;
+    char text[LOG_LINE_SIZE];
+};
+
+// Lines are written to the ring by any thread, and read by the writer thread
+static struct {
+    struct mpsc ring;
+    bool running;
+    uint64_t dropped;
+
+    FILE *file;
+    bool syslog;
+    thread_t thread;
+    bool stop;
+} log_state;
+
+int log_level = LOG_LEVEL_DEBUG;
+
+static const char *log_level_names[] = {
+    [LOG_LEVEL_ERROR] = "error",
+    [LOG_LEVEL_WARN] = "warn",
+    [LOG_LEVEL_INFO] = "info",
+    [LOG_LEVEL_DEBUG] = "debug",
+};
+
+bool log_parse_level(const char *str, int *level)
+{
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; i++) {
+        if (strcmp(str, log_level_names[i]) != 0) continue;
+        *level = i;
+        return true;
+    }
+    return false;
+}
+
+// Format a line into the provided buffer, prefixed with the session's name
+static void log_format(char *text, const char *name, const char *format, va_list ap)
+{
+    int len = 0;
+    if (name && name[0]) {
+        len = snprintf(text, LOG_LINE_SIZE, "[%s] ", name);
+        if (len < 0 || len >= LOG_LINE_SIZE) len = 0;
+    }
+    vsnprintf(text + len, LOG_LINE_SIZE - len, format, ap);
+}
+
+static void log_output(int level, uint64_t time, const char *text)
+{
+#if defined(__unix__)
+    if (log_state.syslog) {
+        static const int priorities[] = {
+            [LOG_LEVEL_ERROR] = LOG_ERR,
+            [LOG_LEVEL_WARN] = LOG_WARNING,
+            [LOG_LEVEL_INFO] = LOG_INFO,
+            [LOG_LEVEL_DEBUG] = LOG_DEBUG,
+        };
+        syslog(priorities[level], "%s", text);
+        return;
+    }
+#endif
+    if (!log_state.file) {
+        fprintf(stderr, "%s\n", text);
+        return;
+    }
+
+    time_t secs = time / 1000000000;
+    struct tm tm;
+#if defined(__unix__)
+    localtime_r(&secs, &tm);
+#elif defined(_WIN32)
+    localtime_s(&tm, &secs);
+#endif
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(log_state.file, "%s.%06u %-5s %s\n", date,
+        (unsigned)(time / 1000 % 1000000), log_level_names[level], text);
+}
+
+// Write out every completed line, in the order they were claimed
+static void log_drain(void)
+{
+    unsigned count = 0;
+    struct log_line *line;
+    while ((line = mpsc_peek(&log_state.ring))) {
+        log_output(line->level, line->time, line->text);
+        mpsc_release(&log_state.ring);
+        count++;
+    }
+    if (count && log_state.file) fflush(log_state.file);
+}
+
+static void log_thread(void *arg)
+{
+    (void)arg;
+    while (!__atomic_load_n(&log_state.stop, __ATOMIC_ACQUIRE)) {
+        log_drain();
+        thread_sleep(LOG_FLUSH_INTERVAL);
+    }
+    log_drain();
+}
+
+// Start writing lines from a thread of their own, to a file if provided, or
+//   to syslog if requested, and otherwise to stderr
+// Until then, lines are written directly to stderr by whoever logs them.
+bool log_init(const char *fname, bool use_syslog)
+{
+#if !defined(__unix__)
+    if (use_syslog) {
+        fprintf(stderr, "log: syslog is not supported on this platform\n");
+        return false;
+    }
+#endif
+
+    if (!mpsc_init(&log_state.ring, LOG_SLOTS, sizeof(struct log_line))) {
+        return false;
+    }
+
+    FILE *file = NULL;
+    if (fname) {
+        file = fopen(fname, "a");
+        if (!file) {
+            perror("fopen");
+            goto error_ring;
+        }
+    }
+
+    log_state.dropped = 0;
+    log_state.file = file;
+    log_state.syslog = use_syslog;
+    log_state.stop = false;
+#if defined(__unix__)
+    if (use_syslog) openlog("mobile", LOG_PID, LOG_DAEMON);
+#endif
+
+    // The ring is used once the writer thread is ready to drain it
+    log_state.running = true;
+    if (!thread_create(&log_state.thread, log_thread, NULL)) {
+        log_state.running = false;
+        goto error_file;
+    }
+    return true;
+
+error_file:
+#if defined(__unix__)
+    if (use_syslog) closelog();
+#endif
+    if (file) fclose(file);
+error_ring:
+    mpsc_deinit(&log_state.ring);
+    return false;
+}
+
+// Write out the remaining lines and stop the writer thread
+// Nothing may be logged from other threads past this point.
+void log_deinit(void)
+{
+    if (!log_state.running) return;
+    __atomic_store_n(&log_state.stop, true, __ATOMIC_RELEASE);
+    thread_join(log_state.thread);
+
+#if defined(__unix__)
+    if (log_state.syslog) closelog();
+#endif
+    if (log_state.file) fclose(log_state.file);
+    log_state.file = NULL;
+    log_state.syslog = false;
+    mpsc_deinit(&log_state.ring);
+    log_state.running = false;
+
+    if (log_state.dropped) {
+        fprintf(stderr, "log: %llu lines dropped\n",
+            (unsigned long long)log_state.dropped);
+    }
+}
+
+// Amount of lines dropped because the ring was full
+uint64_t log_dropped(void)
+{
+    return __atomic_load_n(&log_state.dropped, __ATOMIC_RELAXED);
+}
+
+static void log_vwrite(int level, const char *name, const char *format, va_list ap)
+{
+    if (!log_state.running) {
+        char text[LOG_LINE_SIZE];
+        log_format(text, name, format, ap);
+        fprintf(stderr, "%s\n", text);
+        return;
+    }
+
+    size_t pos;
+    struct log_line *line = mpsc_claim(&log_state.ring, &pos);
+    if (!line) {
+        __atomic_add_fetch(&log_state.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // The line is formatted in place, as the arguments may not outlive the
+    //   call, and handed over to the writer
+    line->level = level;
+    line->time = timer_real_ns();
+    log_format(line->text, name, format, ap);
+    mpsc_commit(&log_state.ring, pos);
+}
+
+void log_write(int level, const char *name, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    log_vwrite(level, name, format, ap);
+    va_end(ap);
+}
+
+void log_write_socket_error(const char *name, const char *func)
+{
+    char error[0x100];
+    socket_strerror(error, sizeof(error));
+    if (func) {
+        log_write(LOG_LEVEL_ERROR, name, "%s: %s", func, error);
+    } else {
+        log_write(LOG_LEVEL_ERROR, name, "%s", error);
+    }
+}
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+// Most verbose level compiled in, anything above it is stripped
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif
+
+// Longest line kept in the ring, longer ones are truncated
+#define LOG_LINE_SIZE 0x200
+// Amount of lines the ring holds, a power of two
+#define LOG_SLOTS 512
+// Time the writer thread sleeps between draining the ring, in milliseconds
+#define LOG_FLUSH_INTERVAL 10
+
+// Most verbose level written, selected at runtime
+extern int log_level;
+
+#define log_enabled(level) \
+    ((level) <= LOG_LEVEL_MAX && (level) <= log_level)
+
+#define log_at(level, ...) do { \
+    if (log_enabled(level)) log_write(level, __VA_ARGS__); \
+} while (0)
+
+// Each of these takes a session name, which may be NULL, and a format
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// Log the last socket-related error, like socket_perror()
+#define log_socket_error(name, func) do { \
+    if (log_enabled(LOG_LEVEL_ERROR)) log_write_socket_error(name, func); \
+} while (0)
+
+bool log_parse_level(const char *str, int *level);
+bool log_init(const char *fname, bool use_syslog);
+void log_deinit(void);
+uint64_t log_dropped(void);
+
+#if defined(__GNUC__)
+__attribute__((format(printf, 3, 4)))
+#endif
+void log_write(int level, const char *name, const char *format, ...);
+void log_write_socket_error(const char *name, const char *func);
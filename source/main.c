@@ -2,156 +2,23 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <assert.h>
 #include <locale.h>
 #include <signal.h>
-#include <wchar.h>
 
 #include <mobile.h>
 #include <mobile_inet.h>
 
-#include "bgblink.h"
+#include "config_db.h"
+#include "config_file.h"
+#include "dns.h"
+#include "engine.h"
+#include "log.h"
+#include "metrics.h"
+#include "pcap.h"
+#include "replay.h"
+#include "session.h"
+#include "shmlink.h"
 #include "socket.h"
-#include "socket_impl.h"
-
-struct mobile_user {
-    struct mobile_adapter *adapter;
-    struct socket_impl socket;
-    enum mobile_action action;
-    FILE *config;
-    volatile bool reset;
-    volatile uint32_t bgb_clock;
-    bool bgb_clock_init;
-    uint32_t bgb_clock_latch[MOBILE_MAX_TIMERS];
-    char number_user[MOBILE_MAX_NUMBER_SIZE + 1];
-    char number_peer[MOBILE_MAX_NUMBER_SIZE + 1];
-};
-
-static void impl_debug_log(void *user, const char *line)
-{
-    (void)user;
-    fprintf(stderr, "%s\n", line);
-}
-
-static bool impl_config_read(void *user, void *dest, const uintptr_t offset, const size_t size)
-{
-    struct mobile_user *mobile = user;
-    fseek(mobile->config, (long)offset, SEEK_SET);
-    return fread(dest, 1, size, mobile->config) == size;
-}
-
-static bool impl_config_write(void *user, const void *src, const uintptr_t offset, const size_t size)
-{
-    struct mobile_user *mobile = user;
-    fseek(mobile->config, (long)offset, SEEK_SET);
-    return fwrite(src, 1, size, mobile->config) == size;
-}
-
-static void impl_time_latch(void *user, unsigned timer)
-{
-    struct mobile_user *mobile = user;
-    mobile->bgb_clock_latch[timer] = mobile->bgb_clock;
-}
-
-static bool impl_time_check_ms(void *user, unsigned timer, unsigned ms)
-{
-    struct mobile_user *mobile = user;
-    return
-        ((mobile->bgb_clock - mobile->bgb_clock_latch[timer]) & 0x7FFFFFFF) >=
-        (uint32_t)((double)ms * (1 << 21) / 1000);
-}
-
-static bool impl_sock_open(void *user, unsigned conn, enum mobile_socktype type, enum mobile_addrtype addrtype, unsigned bindport)
-{
-    struct mobile_user *mobile = user;
-    return socket_impl_open(&mobile->socket, conn, type, addrtype, bindport);
-}
-
-static void impl_sock_close(void *user, unsigned conn)
-{
-    struct mobile_user *mobile = user;
-    socket_impl_close(&mobile->socket, conn);
-}
-
-static int impl_sock_connect(void *user, unsigned conn, const struct mobile_addr *addr)
-{
-    struct mobile_user *mobile = user;
-    return socket_impl_connect(&mobile->socket, conn, addr);
-}
-
-static bool impl_sock_listen(void *user, unsigned conn)
-{
-    struct mobile_user *mobile = user;
-    return socket_impl_listen(&mobile->socket, conn);
-}
-
-static bool impl_sock_accept(void *user, unsigned conn)
-{
-    struct mobile_user *mobile = user;
-    return socket_impl_accept(&mobile->socket, conn);
-}
-
-static int impl_sock_send(void *user, unsigned conn, const void *data, unsigned size, const struct mobile_addr *addr)
-{
-    struct mobile_user *mobile = user;
-    return socket_impl_send(&mobile->socket, conn, data, size, addr);
-}
-
-static int impl_sock_recv(void *user, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
-{
-    struct mobile_user *mobile = user;
-    return socket_impl_recv(&mobile->socket, conn, data, size, addr);
-}
-
-static void update_title(struct mobile_user *mobile)
-{
-    wchar_t title[0x100];
-    size_t i = 0;
-
-    i += swprintf(title + i, (sizeof(title) / sizeof(*title)) - i,
-        L"Mobile Adapter - ");
-
-    if (mobile->number_peer[0]) {
-        i += swprintf(title + i, (sizeof(title) / sizeof(*title)) - i,
-            L"Call: %hs", mobile->number_peer);
-    } else {
-        i += swprintf(title + i, (sizeof(title) / sizeof(*title)) - i,
-            L"Disconnected");
-    }
-
-    if (mobile->number_user[0]) {
-        i += swprintf(title + i, (sizeof(title) / sizeof(*title)) - i,
-            L" (Your number: %hs)", mobile->number_user);
-    }
-
-#if defined(__unix__)
-    printf("\e]0;%ls\a", title);
-    fflush(stdout);
-#elif defined(_WIN32)
-    SetConsoleTitleW(title);
-#endif
-}
-
-static void impl_update_number(void *user, enum mobile_number type, const char *number)
-{
-    struct mobile_user *mobile = user;
-
-    char *dest = NULL;
-    switch (type) {
-        case MOBILE_NUMBER_USER: dest = mobile->number_user; break;
-        case MOBILE_NUMBER_PEER: dest = mobile->number_peer; break;
-        default: assert(false); return;
-    }
-
-    if (number) {
-        strncpy(dest, number, MOBILE_MAX_NUMBER_SIZE);
-        dest[MOBILE_MAX_NUMBER_SIZE] = '\0';
-    } else {
-        dest[0] = '\0';
-    }
-
-    update_title(mobile);
-}
 
 static volatile bool signal_int_trig = false;
 static void signal_int(int signo)
@@ -159,6 +26,14 @@ static void signal_int(int signo)
     (void)signo;
     signal_int_trig = true;
 }
+#if defined(__unix__)
+static volatile bool signal_usr1_trig = false;
+static void signal_usr1(int signo)
+{
+    (void)signo;
+    signal_usr1_trig = true;
+}
+#endif
 #ifdef _WIN32
 static BOOL WINAPI CtrlHandler(DWORD fdwCtrlType)
 {
@@ -171,70 +46,6 @@ static BOOL WINAPI CtrlHandler(DWORD fdwCtrlType)
 }
 #endif
 
-static enum mobile_action filter_actions(enum mobile_action actions)
-{
-    // Filter out the actions that aren't relevant to this emulator
-    return actions & ~MOBILE_ACTION_RESET_SERIAL;
-}
-
-static bool mobile_handle_loop(struct mobile_user *mobile)
-{
-    // Reset the adapter if requested
-    if (mobile->reset) {
-        mobile_stop(mobile->adapter);
-        mobile_start(mobile->adapter);
-        mobile->reset = false;
-    }
-
-    // Fetch action if none exists
-    if (mobile->action == MOBILE_ACTION_NONE) {
-        mobile->action =
-            filter_actions(mobile_actions_get(mobile->adapter));
-    }
-
-    // Process action
-    if (mobile->action != MOBILE_ACTION_NONE) {
-        mobile_actions_process(mobile->adapter, mobile->action);
-
-        // Fetch next action
-        mobile->action =
-            filter_actions(mobile_actions_get(mobile->adapter));
-    }
-    return true;
-}
-
-static unsigned char bgb_loop_transfer(void *user, unsigned char c)
-{
-    // Transfer a byte over the serial port
-    struct mobile_user *mobile = user;
-    c = mobile_transfer(mobile->adapter, c);
-    return c;
-}
-
-static void bgb_loop_timestamp(void *user, uint32_t t)
-{
-    // Update the timestamp sent by the emulator
-    struct mobile_user *mobile = user;
-
-    // Bail if the time difference is too big. This happens whenever the
-    //   emulator is reset, a new game is loaded, or a save state is loaded.
-    uint32_t diff = (t - mobile->bgb_clock) & 0x7FFFFFFF;
-    if (diff > 0x1000) {
-        fprintf(stderr, "[BGB] Emulator reset detected! Resetting adapter\n");
-        mobile->reset = true;
-    }
-
-    mobile->bgb_clock = t;
-}
-
-static void bgb_loop_timestamp_init(void *user, uint32_t t)
-{
-    // Initialize the clock
-    struct mobile_user *mobile = user;
-    mobile->bgb_clock = t;
-    mobile->bgb_clock_init = true;
-}
-
 static char *program_name;
 
 static void show_help(void)
@@ -249,6 +60,9 @@ static void show_help_full(void)
     fprintf(stderr, "%s [-h] [-c config] [options] [bgb_host [bgb_port]]\n",
         program_name);
     fprintf(stderr, "\n"
+        "bgb_host may also be unix:path or shm:path to connect over a Unix\n"
+        "socket, the latter exchanging packets through shared memory\n"
+        "\n"
         "-h|--help           Show this help\n"
         "-c|--config config  Config file path\n"
         "--device device     Adapter to emulate\n"
@@ -256,9 +70,38 @@ static void show_help_full(void)
         "--dns1 addr         Set DNS1 address override\n"
         "--dns2 addr         Set DNS2 address override\n"
         "--dns_port port     Set DNS port for address overrides\n"
+        "--dns-cache         Answer repeated DNS queries from a shared cache\n"
+        "--dns-static file   Answer DNS queries for the names in a hosts file\n"
         "--p2p_port port     Port to use for relay-less P2P communications\n"
         "--relay addr        Set relay server for P2P communications\n"
         "--relay-token hex   Set relay token (or empty to clear)\n"
+        "--relay-pool        Keep a connection to the relay ready for calls\n"
+        "--buffer-sends      Gather TCP sends of each loop iteration into one\n"
+        "--reconnect         Keep the adapter running and reconnect whenever\n"
+        "                    the connection to the emulator drops\n"
+        "--link-thread       Answer the emulator from a thread of its own, so\n"
+        "                    the adapter's work never delays its replies\n"
+        "--record file       Log the emulator link to a file\n"
+        "--replay file       Replay a logged emulator link and check the replies\n"
+        "--replay-realtime   Replay at the original pace instead of full speed\n"
+        "\n"
+        "Server mode, hosting one adapter per emulator:\n"
+        "--sessions file     Connect to every emulator listed in a file, one\n"
+        "                    \"config bgb_host [bgb_port]\" per line\n"
+        "--listen port       Accept connections from emulators on a port, or\n"
+        "                    on a Unix socket given as unix:path\n"
+        "--config-dir dir    Directory for the configs of accepted emulators\n"
+        "--config-db file    Keep every config in a single database, created\n"
+        "                    with mobile-configdb, instead of separate files\n"
+        "--threads count     Amount of threads to spread the sessions over\n"
+        "\n"
+        "Monitoring:\n"
+        "--metrics addr:port Serve counters in the Prometheus format over HTTP\n"
+        "--log-level level   Most verbose messages to log: error, warn, info\n"
+        "                    or debug (default)\n"
+        "--log-file file     Append timestamped messages to a file\n"
+        "--log-syslog        Send messages to syslog\n"
+        "--pcap file         Capture the traffic of every session to a file\n"
     );
     exit(EXIT_SUCCESS);
 }
@@ -309,6 +152,35 @@ static void main_set_port(struct mobile_addr *dest, unsigned port)
     }
 }
 
+// Split an "addr:port" parameter, the address being optional
+static void main_parse_hostport(char **host, char **port, char *argv[])
+{
+    char *str = argv[1];
+    char *sep = strrchr(str, ':');
+    *host = NULL;
+    *port = str;
+    if (sep) {
+        *sep = '\0';
+        *port = sep + 1;
+        if (*str) *host = str;
+    }
+
+    // IPv6 addresses are written in brackets
+    if (*host && **host == '[') {
+        char *end = strchr(*host, ']');
+        if (!end || end[1]) {
+            fprintf(stderr, "Invalid parameter for %s\n", argv[0]);
+            show_help();
+        }
+        *end = '\0';
+        *host += 1;
+    }
+    if (!**port) {
+        fprintf(stderr, "Invalid parameter for %s\n", argv[0]);
+        show_help();
+    }
+}
+
 static bool main_parse_hex(unsigned char *buf, char *str, unsigned size)
 {
     unsigned char x = 0;
@@ -330,6 +202,141 @@ static bool main_parse_hex(unsigned char *buf, char *str, unsigned size)
     return true;
 }
 
+// Pick the host an emulator is linked through
+// Shared memory links are requested over the emulator's Unix socket
+// Returns the host to connect to, which may be stored in the buffer.
+static const char *main_link_host(const char *host, char *buf, size_t size, bool *shm)
+{
+    size_t prefix = strlen(SHMLINK_PREFIX);
+    *shm = strncmp(host, SHMLINK_PREFIX, prefix) == 0;
+    if (!*shm) return host;
+    snprintf(buf, size, "%s%s", SOCKET_UNIX_PREFIX, host + prefix);
+    return buf;
+}
+
+// Create a session, connected to an emulator through the provided socket
+// The host and port are used to reconnect, if enabled, and may be NULL.
+static struct mobile_user *main_session_start(struct engine *engine, const char *fname_config, const char *name, unsigned id, SOCKET sock, const char *host, const char *port, bool shm, const struct session_options *options)
+{
+    struct mobile_user *mobile = session_new(fname_config, options);
+    if (!mobile) {
+        socket_close(sock);
+        engine_session_release(engine, id);
+        return NULL;
+    }
+    snprintf(mobile->name, sizeof(mobile->name), "%s", name);
+    mobile->id = id;
+    mobile->shm = shm;
+    if (options->reconnect && host &&
+            !session_reconnect(mobile, host, port)) {
+        socket_close(sock);
+        session_free(mobile);
+        engine_session_release(engine, id);
+        return NULL;
+    }
+    if (!session_link(mobile, sock)) {
+        session_free(mobile);
+        engine_session_release(engine, id);
+        return NULL;
+    }
+    return mobile;
+}
+
+// Connect to every emulator listed in a sessions file
+static bool main_sessions_load(struct engine *engine, const char *fname, const struct session_options *options)
+{
+    FILE *file = fopen(fname, "r");
+    if (!file) {
+        perror("fopen");
+        return false;
+    }
+
+    char line[0x1000];
+    bool ok = true;
+    while (fgets(line, sizeof(line), file)) {
+        char config[0x400];
+        char host[0x100];
+        char port[0x20] = "8765";
+        int count = sscanf(line, "%1023s %255s %31s", config, host, port);
+        if (count < 1 || config[0] == '#') continue;
+        if (count < 2) {
+            fprintf(stderr, "%s: Missing emulator host for %s\n",
+                fname, config);
+            ok = false;
+            break;
+        }
+
+        char link_buf[0x110];
+        bool shm;
+        const char *link = main_link_host(host, link_buf, sizeof(link_buf),
+            &shm);
+        SOCKET sock = socket_connect(link, port);
+        if (sock == INVALID_SOCKET) {
+            fprintf(stderr, "Could not connect (%s:%s): ", host, port);
+            socket_perror(NULL);
+            ok = false;
+            break;
+        }
+        unsigned id;
+        if (!engine_session_id(engine, &id)) {
+            socket_close(sock);
+            ok = false;
+            break;
+        }
+        struct mobile_user *mobile =
+            main_session_start(engine, config, config, id, sock, link, port,
+                shm, options);
+        if (!mobile || !engine_add(engine, mobile)) {
+            if (mobile) {
+                session_free(mobile);
+                engine_session_release(engine, id);
+            }
+            ok = false;
+            break;
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+// Accept every pending emulator connection
+static void main_sessions_accept(struct engine *engine, SOCKET listener, const char *config_dir, const struct session_options *options)
+{
+    for (;;) {
+        SOCKET sock = accept(listener, NULL, NULL);
+        if (sock == INVALID_SOCKET) {
+            if (socket_geterror() != SOCKET_EWOULDBLOCK) {
+                socket_perror("accept");
+            }
+            return;
+        }
+
+        unsigned id;
+        if (!engine_session_id(engine, &id)) {
+            socket_close(sock);
+            continue;
+        }
+        char fname_config[0x1000];
+        char name[SESSION_NAME_SIZE];
+        if (options->config_db) {
+            snprintf(fname_config, sizeof(fname_config), "config_%u", id);
+        } else {
+            snprintf(fname_config, sizeof(fname_config), "%s/config_%u.bin",
+                config_dir, id);
+        }
+        snprintf(name, sizeof(name), "%u", id);
+        struct mobile_user *mobile = main_session_start(engine, fname_config,
+            name, id, sock, NULL, NULL, false, options);
+        if (!mobile) continue;
+        if (!engine_add(engine, mobile)) {
+            session_free(mobile);
+            engine_session_release(engine, id);
+            continue;
+        }
+        log_info(name, "Emulator connected");
+    }
+}
+
 int main(int argc, char *argv[])
 {
     program_name = argv[0];
@@ -344,11 +351,31 @@ int main(int argc, char *argv[])
     struct mobile_addr dns1 = {0};
     struct mobile_addr dns2 = {0};
     unsigned dns_port = MOBILE_DNS_PORT;
+    bool dns_cache = false;
+    char *fname_dns_static = NULL;
     unsigned p2p_port = MOBILE_DEFAULT_P2P_PORT;
     struct mobile_addr relay = {0};
     bool relay_token_update = false;
     unsigned char *relay_token = NULL;
     unsigned char relay_token_buf[MOBILE_RELAY_TOKEN_SIZE];
+    bool send_buffering = false;
+    bool relay_pool = false;
+    bool reconnect = false;
+    bool link_thread = false;
+
+    char *fname_sessions = NULL;
+    char *fname_record = NULL;
+    char *metrics_host = NULL;
+    char *metrics_port = NULL;
+    char *fname_replay = NULL;
+    bool replay_realtime = false;
+    char *listen_port = NULL;
+    char *config_dir = ".";
+    char *fname_config_db = NULL;
+    unsigned threads = 1;
+    char *fname_log = NULL;
+    bool log_syslog = false;
+    char *fname_pcap = NULL;
 
     (void)argc;
     while (*++argv) {
@@ -387,6 +414,12 @@ int main(int argc, char *argv[])
                 show_help();
             }
             argv += 1;
+        } else if (strcmp(*argv, "--dns-cache") == 0) {
+            dns_cache = true;
+        } else if (strcmp(*argv, "--dns-static") == 0) {
+            main_checkparam(argv);
+            fname_dns_static = argv[1];
+            argv += 1;
         } else if (strcmp(*argv, "--p2p_port") == 0) {
             main_checkparam(argv);
             p2p_port = strtol(argv[1], NULL, 0);
@@ -414,6 +447,72 @@ int main(int argc, char *argv[])
                 show_help();
             }
             argv += 1;
+        } else if (strcmp(*argv, "--relay-pool") == 0) {
+            relay_pool = true;
+        } else if (strcmp(*argv, "--buffer-sends") == 0) {
+            send_buffering = true;
+        } else if (strcmp(*argv, "--reconnect") == 0) {
+            reconnect = true;
+        } else if (strcmp(*argv, "--link-thread") == 0) {
+            link_thread = true;
+        } else if (strcmp(*argv, "--record") == 0) {
+            main_checkparam(argv);
+            fname_record = argv[1];
+            argv += 1;
+        } else if (strcmp(*argv, "--replay") == 0) {
+            main_checkparam(argv);
+            fname_replay = argv[1];
+            argv += 1;
+        } else if (strcmp(*argv, "--replay-realtime") == 0) {
+            replay_realtime = true;
+        } else if (strcmp(*argv, "--sessions") == 0) {
+            main_checkparam(argv);
+            fname_sessions = argv[1];
+            argv += 1;
+        } else if (strcmp(*argv, "--listen") == 0) {
+            main_checkparam(argv);
+            listen_port = argv[1];
+            argv += 1;
+        } else if (strcmp(*argv, "--config-dir") == 0) {
+            main_checkparam(argv);
+            config_dir = argv[1];
+            argv += 1;
+        } else if (strcmp(*argv, "--config-db") == 0) {
+            main_checkparam(argv);
+            fname_config_db = argv[1];
+            argv += 1;
+        } else if (strcmp(*argv, "--metrics") == 0) {
+            main_checkparam(argv);
+            main_parse_hostport(&metrics_host, &metrics_port, argv);
+            argv += 1;
+        } else if (strcmp(*argv, "--log-level") == 0) {
+            main_checkparam(argv);
+            if (!log_parse_level(argv[1], &log_level)) {
+                fprintf(stderr, "Invalid parameter for --log-level: %s\n",
+                    argv[1]);
+                show_help();
+            }
+            argv += 1;
+        } else if (strcmp(*argv, "--log-file") == 0) {
+            main_checkparam(argv);
+            fname_log = argv[1];
+            argv += 1;
+        } else if (strcmp(*argv, "--log-syslog") == 0) {
+            log_syslog = true;
+        } else if (strcmp(*argv, "--pcap") == 0) {
+            main_checkparam(argv);
+            fname_pcap = argv[1];
+            argv += 1;
+        } else if (strcmp(*argv, "--threads") == 0) {
+            main_checkparam(argv);
+            char *endptr;
+            threads = strtol(argv[1], &endptr, 10);
+            if (!*argv[1] || *endptr || !threads) {
+                fprintf(stderr, "Invalid parameter for --threads: %s\n",
+                    argv[1]);
+                show_help();
+            }
+            argv += 1;
         } else {
             fprintf(stderr, "Unknown option: %s\n", *argv);
             show_help();
@@ -423,71 +522,52 @@ int main(int argc, char *argv[])
     if (*argv) host = *argv++;
     if (*argv) port = *argv;
 
+    if (fname_record && (fname_sessions || listen_port)) {
+        fprintf(stderr, "--record can't be used in server mode\n");
+        show_help();
+    }
+
     // OS resources
-    FILE *config = NULL;
-    struct mobile_user *mobile = NULL;
+    struct socket_poller poller;
+    bool poller_init = false;
+    struct engine engine;
+    bool engine_init_done = false;
+    bool engine_started = false;
+    SOCKET listener = INVALID_SOCKET;
+    bool listener_ready = false;
+    struct metrics metrics;
+    bool metrics_init_done = false;
+    struct config_db config_db;
+    bool config_db_open_done = false;
+    struct dns dns;
+    bool dns_init_done = false;
+    bool log_init_done = false;
+    bool config_writer_done = false;
+    struct pcap pcap;
+    bool pcap_open_done = false;
+    int rc = EXIT_FAILURE;
 
     // Set the DNS ports
     main_set_port(&dns1, dns_port);
     main_set_port(&dns2, dns_port);
 
-    // Open or create configuration
-    config = fopen(fname_config, "r+b");
-    if (!config) config = fopen(fname_config, "w+b");
-    if (!config) {
-        perror("fopen");
-        goto error;
-    }
-
-    // Make sure config file is at least CONFIG_SIZE bytes big
-    fseek(config, 0, SEEK_END);
-    for (long i = ftell(config); i < MOBILE_CONFIG_SIZE; i++) {
-        fputc(0, config);
-    }
-    rewind(config);
-
-    // Initialize main data structure
-    mobile = malloc(sizeof(struct mobile_user));
-    if (!mobile) {
-        perror("malloc");
-        goto error;
-    }
-    mobile->action = MOBILE_ACTION_NONE;
-    mobile->config = config;
-    mobile->reset = false;
-    mobile->bgb_clock = 0;
-    mobile->bgb_clock_init = false;
-    for (int i = 0; i < MOBILE_MAX_TIMERS; i++) mobile->bgb_clock_latch[i] = 0;
-    mobile->number_user[0] = '\0';
-    mobile->number_peer[0] = '\0';
-    socket_impl_init(&mobile->socket);
-
-    // Initialize mobile library
-    mobile->adapter = mobile_new(mobile);
-    mobile_def_debug_log(mobile->adapter, impl_debug_log);
-    mobile_def_config_read(mobile->adapter, impl_config_read);
-    mobile_def_config_write(mobile->adapter, impl_config_write);
-    mobile_def_time_latch(mobile->adapter, impl_time_latch);
-    mobile_def_time_check_ms(mobile->adapter, impl_time_check_ms);
-    mobile_def_sock_open(mobile->adapter, impl_sock_open);
-    mobile_def_sock_close(mobile->adapter, impl_sock_close);
-    mobile_def_sock_connect(mobile->adapter, impl_sock_connect);
-    mobile_def_sock_listen(mobile->adapter, impl_sock_listen);
-    mobile_def_sock_accept(mobile->adapter, impl_sock_accept);
-    mobile_def_sock_send(mobile->adapter, impl_sock_send);
-    mobile_def_sock_recv(mobile->adapter, impl_sock_recv);
-    mobile_def_update_number(mobile->adapter, impl_update_number);
-
-    mobile_config_load(mobile->adapter);
-    mobile_config_set_device(mobile->adapter, device, device_unmetered);
-    mobile_config_set_dns(mobile->adapter, &dns1, MOBILE_DNS1);
-    mobile_config_set_dns(mobile->adapter, &dns2, MOBILE_DNS2);
-    mobile_config_set_p2p_port(mobile->adapter, p2p_port);
-    mobile_config_set_relay(mobile->adapter, &relay);
-    if (relay_token_update) {
-        mobile_config_set_relay_token(mobile->adapter, relay_token);
-    }
-    mobile_config_save(mobile->adapter);
+    struct session_options options = {
+        .device = device,
+        .device_unmetered = device_unmetered,
+        .dns1 = dns1,
+        .dns2 = dns2,
+        .p2p_port = p2p_port,
+        .relay = relay,
+        .relay_token_update = relay_token_update,
+        .relay_token = relay_token,
+        .config_db = NULL,
+        .dns = NULL,
+        .send_buffering = send_buffering,
+        .relay_pool = relay_pool,
+        .reconnect = reconnect,
+        .link_thread = link_thread,
+        .pcap = NULL,
+    };
 
     // Initialize windows sockets
 #ifdef _WIN32
@@ -495,23 +575,133 @@ int main(int argc, char *argv[])
     int wsa_err = WSAStartup(MAKEWORD(2, 2), &wsaData);
     if (wsa_err != NO_ERROR) {
         fprintf(stderr, "WSAStartup failed with error: %d\n", wsa_err);
-        goto error;
+        return EXIT_FAILURE;
     }
 #endif
 
-    // Connect to the emulator
-    SOCKET bgb_sock = socket_connect(host, port);
-    if (bgb_sock == INVALID_SOCKET) {
-        fprintf(stderr, "Could not connect (%s:%s): ", host, port);
-        socket_perror(NULL);
-        goto error;
+    // Messages are written out by a thread of their own from here on
+    if (!log_init(fname_log, log_syslog)) goto error;
+    log_init_done = true;
+
+    // Same goes for configurations, so saving one never stalls a session
+    if (!config_file_writer_init()) goto error;
+    config_writer_done = true;
+
+    if (fname_pcap) {
+        if (!pcap_open(&pcap, fname_pcap)) goto error;
+        pcap_open_done = true;
+        options.pcap = &pcap;
+    }
+
+    if (fname_config_db) {
+        if (!config_db_open(&config_db, fname_config_db)) goto error;
+        config_db_open_done = true;
+        options.config_db = &config_db;
     }
-    if (setsockopt(bgb_sock, IPPROTO_TCP, TCP_NODELAY,
-            (void *)&(int){1}, sizeof(int)) == SOCKET_ERROR) {
-        socket_perror("setsockopt");
+
+    if (dns_cache || fname_dns_static) {
+        if (!dns_init(&dns, dns_cache)) goto error;
+        dns_init_done = true;
+        if (fname_dns_static && !dns_load_static(&dns, fname_dns_static)) {
+            goto error;
+        }
+        options.dns = &dns;
+    }
+
+    if (fname_replay) {
+        if (replay_run(fname_replay, fname_config, &options, replay_realtime)) {
+            rc = EXIT_SUCCESS;
+        }
         goto error;
     }
 
+    // Set up the sockets we'll be waiting on, and the threads handling them
+    if (!socket_poller_init(&poller)) goto error;
+    poller_init = true;
+    if (!engine_init(&engine, threads, &poller)) goto error;
+    engine_init_done = true;
+    if (!engine_start(&engine)) goto error;
+    engine_started = true;
+
+    if (!fname_sessions && !listen_port) {
+        // Outside of server mode, the process ends with the session
+        __atomic_store_n(&engine.exit_on_close, true, __ATOMIC_RELAXED);
+
+        // Initialize the adapter
+        unsigned id;
+        if (!engine_session_id(&engine, &id)) goto error;
+        struct mobile_user *mobile = session_new(fname_config, &options);
+        if (!mobile) {
+            engine_session_release(&engine, id);
+            goto error;
+        }
+        mobile->id = id;
+        mobile->title = true;
+        char link_buf[0x110];
+        const char *link = main_link_host(host, link_buf, sizeof(link_buf),
+            &mobile->shm);
+        if (reconnect && !session_reconnect(mobile, link, port)) {
+            session_free(mobile);
+            engine_session_release(&engine, id);
+            goto error;
+        }
+        if (fname_record && !session_record(mobile, fname_record)) {
+            session_free(mobile);
+            engine_session_release(&engine, id);
+            goto error;
+        }
+
+        // Connect to the emulator
+        SOCKET bgb_sock = socket_connect(link, port);
+        if (bgb_sock == INVALID_SOCKET) {
+            fprintf(stderr, "Could not connect (%s:%s): ", host, port);
+            socket_perror(NULL);
+            session_free(mobile);
+            engine_session_release(&engine, id);
+            goto error;
+        }
+        if (!session_link(mobile, bgb_sock) || !engine_add(&engine, mobile)) {
+            session_free(mobile);
+            engine_session_release(&engine, id);
+            goto error;
+        }
+    } else {
+        // Without a listener, the process ends along with the last session
+        __atomic_store_n(&engine.exit_on_empty, !listen_port,
+            __ATOMIC_RELAXED);
+
+        if (fname_sessions && !main_sessions_load(&engine, fname_sessions,
+                &options)) {
+            goto error;
+        }
+        if (listen_port) {
+            // A Unix socket path may be given in place of the port
+            const char *listen_host = NULL;
+            if (strncmp(listen_port, SOCKET_UNIX_PREFIX,
+                    strlen(SOCKET_UNIX_PREFIX)) == 0) {
+                listen_host = listen_port;
+            }
+            listener = socket_listen(listen_host, listen_port);
+            if (listener == INVALID_SOCKET) {
+                fprintf(stderr, "Could not listen (%s): ", listen_port);
+                socket_perror(NULL);
+                goto error;
+            }
+            if (!socket_poller_add(&poller, listener, &listener_ready)) {
+                goto error;
+            }
+        }
+    }
+
+    if (metrics_port) {
+        if (!metrics_init(&metrics, metrics_host, metrics_port, &poller,
+                &engine)) {
+            goto error;
+        }
+        metrics_init_done = true;
+        metrics.dns = options.dns;
+    }
+
     // Set up CTRL+C signal handler
 #if defined(__unix__)
     if (sigaction(SIGINT, &(struct sigaction){.sa_handler = signal_int},
@@ -519,68 +709,60 @@ int main(int argc, char *argv[])
         perror("sigaction");
         goto error;
     }
+
+    // Print the latency histograms on SIGUSR1
+    if (sigaction(SIGUSR1, &(struct sigaction){.sa_handler = signal_usr1},
+            NULL) == -1) {
+        perror("sigaction");
+        goto error;
+    }
 #elif defined(_WIN32)
     if (!SetConsoleCtrlHandler(CtrlHandler, TRUE)) {
         fprintf(stderr, "SetConsoleCtrlHandler failed\n");
         goto error;
     }
 #endif
-    update_title(mobile);
 
-    // Connect to the emulator
-    struct bgb_state bgb_state;
-    if (!bgb_init(&bgb_state, bgb_sock, MOBILE_SERIAL_IDLE_BYTE,
-            bgb_loop_transfer, bgb_loop_timestamp, mobile)) {
-        goto error;
-    }
-
-    // Wait for the timestamp to be initialized
-    bgb_state.callback_timestamp = bgb_loop_timestamp_init;
-    while (!mobile->bgb_clock_init) if (!bgb_loop(&bgb_state)) goto error;
-    bgb_state.callback_timestamp = bgb_loop_timestamp;
-
-    // Start main mobile thread
-    mobile_start(mobile->adapter);
-
-    while (!signal_int_trig) {
-        if (!bgb_loop(&bgb_state)) break;
-        if (!mobile_handle_loop(mobile)) break;
-
-        // Wait for any of the sockets to do something
-        // Time out after 100ms
-        SOCKET sockets[1 + MOBILE_MAX_CONNECTIONS];
-        unsigned socket_count = 0;
-        sockets[socket_count++] = bgb_sock;
-        for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
-            SOCKET fd = mobile->socket.sockets[i];
-            if (fd == INVALID_SOCKET) continue;
-            sockets[socket_count++] = fd;
+    while (!signal_int_trig &&
+            !__atomic_load_n(&engine.stop, __ATOMIC_ACQUIRE)) {
+        if (listener_ready) {
+            main_sessions_accept(&engine, listener, config_dir, &options);
+            listener_ready = false;
         }
-        socket_wait(sockets, socket_count, 100);
+#if defined(__unix__)
+        if (signal_usr1_trig) {
+            signal_usr1_trig = false;
+            engine_dump(&engine);
+        }
+#endif
+        if (metrics_init_done) metrics_loop(&metrics);
+        engine_loop(&engine);
+
+        // The sessions are handled by the engine's threads, the main thread
+        //   only needs to wake up to accept new ones and balance the load.
+        socket_poller_wait(&poller, ENGINE_BALANCE_INTERVAL);
     }
     signal_int_trig = true;
+    rc = EXIT_SUCCESS;
 
-    // Wait for the mobile thread to finish
-    mobile_stop(mobile->adapter);
-
-    // Close all sockets
-    socket_impl_stop(&mobile->socket);
-    socket_close(bgb_sock);
+error:
+    // Stop every adapter and close all sockets
+    if (metrics_init_done) metrics_deinit(&metrics);
+    if (engine_started) engine_stop(&engine);
+    if (engine_init_done) engine_deinit(&engine, &poller);
+    if (listener != INVALID_SOCKET) {
+        socket_poller_del(&poller, listener);
+        socket_close(listener);
+    }
+    if (poller_init) socket_poller_deinit(&poller);
+    if (config_writer_done) config_file_writer_deinit();
+    if (config_db_open_done) config_db_close(&config_db);
+    if (dns_init_done) dns_deinit(&dns);
+    if (pcap_open_done) pcap_close(&pcap);
+    if (log_init_done) log_deinit();
 
 #ifdef _WIN32
     WSACleanup();
 #endif
-    free(mobile->adapter);
-    free(mobile);
-    fclose(config);
-
-    return EXIT_SUCCESS;
-
-error:
-    if (mobile) {
-        free(mobile->adapter);
-        free(mobile);
-    }
-    if (config) fclose(config);
-    return EXIT_FAILURE;
+    return rc;
 }
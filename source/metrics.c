@@ -0,0 +1,414 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <mobile.h>
+
+#include "bgblink.h"
+#include "command.h"
+#include "engine.h"
+#include "log.h"
+#include "session.h"
+#include "socket.h"
+#include "socket_impl.h"
+#include "thread.h"
+
+bool metrics_init(struct metrics *metrics, const char *host, const char *port, struct socket_poller *poller, struct engine *engine)
+{
+    metrics->poller = poller;
+    metrics->engine = engine;
+    metrics->dns = NULL;
+    metrics->listener_ready = false;
+    metrics->buf = NULL;
+    metrics->buf_size = 0;
+    metrics->buf_len = 0;
+    for (unsigned i = 0; i < METRICS_CLIENTS; i++) {
+        metrics->clients[i].socket = INVALID_SOCKET;
+    }
+
+    metrics->listener = socket_listen(host, port);
+    if (metrics->listener == INVALID_SOCKET) {
+        fprintf(stderr, "Could not listen (%s:%s): ", host ? host : "", port);
+        socket_perror(NULL);
+        return false;
+    }
+    if (!socket_poller_add(poller, metrics->listener,
+            &metrics->listener_ready)) {
+        socket_close(metrics->listener);
+        return false;
+    }
+    return true;
+}
+
+static void metrics_client_close(struct metrics *metrics, struct metrics_client *client)
+{
+    socket_poller_del(metrics->poller, client->socket);
+    socket_close(client->socket);
+    client->socket = INVALID_SOCKET;
+}
+
+void metrics_deinit(struct metrics *metrics)
+{
+    for (unsigned i = 0; i < METRICS_CLIENTS; i++) {
+        struct metrics_client *client = &metrics->clients[i];
+        if (client->socket != INVALID_SOCKET) {
+            metrics_client_close(metrics, client);
+        }
+    }
+    socket_poller_del(metrics->poller, metrics->listener);
+    socket_close(metrics->listener);
+    free(metrics->buf);
+}
+
+// Append to the response, growing the buffer as needed
+static bool metrics_printf(struct metrics *metrics, const char *format, ...)
+{
+    for (;;) {
+        size_t space = metrics->buf_size - metrics->buf_len;
+        va_list ap;
+        va_start(ap, format);
+        int len = vsnprintf(metrics->buf + metrics->buf_len, space, format,
+            ap);
+        va_end(ap);
+        if (len < 0) return false;
+        if ((size_t)len < space) {
+            metrics->buf_len += len;
+            return true;
+        }
+
+        size_t size = metrics->buf_size ? metrics->buf_size * 2 : 0x4000;
+        while (size - metrics->buf_len <= (size_t)len) size *= 2;
+        char *buf = realloc(metrics->buf, size);
+        if (!buf) {
+            perror("realloc");
+            return false;
+        }
+        metrics->buf = buf;
+        metrics->buf_size = size;
+    }
+}
+
+static void metrics_header(struct metrics *metrics, const char *name, const char *type, const char *help)
+{
+    metrics_printf(metrics, "# HELP %s %s\n# TYPE %s %s\n",
+        name, help, name, type);
+}
+
+// Label identifying a session, escaped as the text format requires
+static void metrics_label(char *dest, unsigned size, struct mobile_user *mobile)
+{
+    const char *name = mobile->name;
+    char id[0x10];
+    if (!name[0]) {
+        snprintf(id, sizeof(id), "%u", mobile->id);
+        name = id;
+    }
+
+    unsigned len = 0;
+    for (; *name && len + 3 < size; name++) {
+        if (*name == '\\' || *name == '"') {
+            dest[len++] = '\\';
+            dest[len++] = *name;
+        } else if (*name == '\n') {
+            dest[len++] = '\\';
+            dest[len++] = 'n';
+        } else {
+            dest[len++] = *name;
+        }
+    }
+    dest[len] = '\0';
+}
+
+// Counter kept by every session, at an offset into struct mobile_user
+// The counters are updated atomically by the threads handling the sessions,
+//   so they can't be read torn, even where 64-bit stores take two steps.
+static uint64_t metrics_counter(struct mobile_user *mobile, size_t offset)
+{
+    return __atomic_load_n((uint64_t *)((char *)mobile + offset),
+        __ATOMIC_RELAXED);
+}
+
+static void metrics_render_session(struct metrics *metrics, const char *name, const char *help, size_t offset)
+{
+    struct engine *engine = metrics->engine;
+    char label[SESSION_NAME_SIZE * 2];
+
+    metrics_header(metrics, name, "counter", help);
+    for (unsigned i = 0; i < engine->ids_size; i++) {
+        struct mobile_user *mobile = engine->mobiles[i];
+        if (!mobile) continue;
+        metrics_label(label, sizeof(label), mobile);
+        metrics_printf(metrics, "%s{session=\"%s\"} %llu\n", name, label,
+            (unsigned long long)metrics_counter(mobile, offset));
+    }
+}
+
+static void metrics_render_packets(struct metrics *metrics, const char *name, const char *help, size_t offset)
+{
+    struct engine *engine = metrics->engine;
+    char label[SESSION_NAME_SIZE * 2];
+
+    metrics_header(metrics, name, "counter", help);
+    for (unsigned i = 0; i < engine->ids_size; i++) {
+        struct mobile_user *mobile = engine->mobiles[i];
+        if (!mobile) continue;
+        metrics_label(label, sizeof(label), mobile);
+        for (unsigned x = 0; x < BGB_STAT_CMDS; x++) {
+            metrics_printf(metrics, "%s{session=\"%s\",cmd=\"%s\"} %llu\n",
+                name, label, bgb_stat_name(x), (unsigned long long)
+                metrics_counter(mobile, offset + sizeof(uint64_t) * x));
+        }
+    }
+}
+
+static void metrics_render_sockets(struct metrics *metrics, const char *name, const char *help, size_t offset)
+{
+    struct engine *engine = metrics->engine;
+    char label[SESSION_NAME_SIZE * 2];
+
+    metrics_header(metrics, name, "counter", help);
+    for (unsigned i = 0; i < engine->ids_size; i++) {
+        struct mobile_user *mobile = engine->mobiles[i];
+        if (!mobile) continue;
+        metrics_label(label, sizeof(label), mobile);
+        for (unsigned x = 0; x < MOBILE_MAX_CONNECTIONS; x++) {
+            metrics_printf(metrics, "%s{session=\"%s\",slot=\"%u\"} %llu\n",
+                name, label, x, (unsigned long long)metrics_counter(mobile,
+                    offsetof(struct mobile_user, socket.stats) +
+                    sizeof(struct socket_impl_stats) * x + offset));
+        }
+    }
+}
+
+// Counter kept for every known adapter command, in seconds if it's a time
+static void metrics_render_commands(struct metrics *metrics, const char *name, const char *help, size_t offset, bool seconds)
+{
+    struct engine *engine = metrics->engine;
+    char label[SESSION_NAME_SIZE * 2];
+
+    metrics_header(metrics, name, "counter", help);
+    for (unsigned i = 0; i < engine->ids_size; i++) {
+        struct mobile_user *mobile = engine->mobiles[i];
+        if (!mobile) continue;
+        metrics_label(label, sizeof(label), mobile);
+        for (unsigned x = 0; x < COMMAND_COUNT; x++) {
+            if (!command_name(x)) continue;
+            uint64_t value = metrics_counter(mobile,
+                offsetof(struct mobile_user, commands.stats) +
+                sizeof(struct command_stats) * x + offset);
+            if (seconds) {
+                metrics_printf(metrics,
+                    "%s{session=\"%s\",command=\"%s\"} %.9f\n",
+                    name, label, command_name(x), value / 1e9);
+            } else {
+                metrics_printf(metrics,
+                    "%s{session=\"%s\",command=\"%s\"} %llu\n",
+                    name, label, command_name(x), (unsigned long long)value);
+            }
+        }
+    }
+}
+
+// Render the counters of every session
+// The counters are read while the sessions' threads keep updating them, see
+//   metrics_counter(). Holding the engine's lock keeps the sessions from being
+//   freed in the meantime.
+static void metrics_render(struct metrics *metrics)
+{
+    struct engine *engine = metrics->engine;
+
+    metrics->buf_len = 0;
+    thread_mutex_lock(&engine->lock);
+
+    metrics_header(metrics, "mobile_sessions", "gauge",
+        "Amount of emulators being served.");
+    metrics_printf(metrics, "mobile_sessions %u\n", engine->sessions);
+
+    metrics_render_packets(metrics, "mobile_bgb_packets_received_total",
+        "Link packets received from the emulator.",
+        offsetof(struct mobile_user, bgb.stats.packets_recv));
+    metrics_render_packets(metrics, "mobile_bgb_packets_sent_total",
+        "Link packets sent to the emulator.",
+        offsetof(struct mobile_user, bgb.stats.packets_sent));
+    metrics_render_session(metrics, "mobile_serial_bytes_total",
+        "Bytes transferred over the serial port.",
+        offsetof(struct mobile_user, transfers));
+    metrics_render_session(metrics, "mobile_emulator_resets_total",
+        "Emulator resets that caused the adapter to be reset.",
+        offsetof(struct mobile_user, resets));
+    metrics_render_session(metrics, "mobile_emulator_reconnects_total",
+        "Times the link to the emulator was reestablished.",
+        offsetof(struct mobile_user, reconnects));
+    metrics_render_session(metrics, "mobile_bgb_clock_corrections_total",
+        "Times the emulator clock went back in time and was ignored.",
+        offsetof(struct mobile_user, bgb.stats.back_in_time));
+    metrics_render_session(metrics, "mobile_relay_pool_hits_total",
+        "Calls that used a relay connection kept ready in advance.",
+        offsetof(struct mobile_user, socket.relay.hits));
+
+    metrics_render_sockets(metrics, "mobile_socket_opens_total",
+        "Sockets opened by the adapter.",
+        offsetof(struct socket_impl_stats, opens));
+    metrics_render_sockets(metrics, "mobile_socket_connects_total",
+        "Connections established by the adapter.",
+        offsetof(struct socket_impl_stats, connects));
+    metrics_render_sockets(metrics, "mobile_socket_failures_total",
+        "Socket operations of the adapter that failed.",
+        offsetof(struct socket_impl_stats, failures));
+    metrics_render_sockets(metrics, "mobile_socket_sent_bytes_total",
+        "Bytes sent by the adapter.",
+        offsetof(struct socket_impl_stats, bytes_sent));
+    metrics_render_sockets(metrics, "mobile_socket_received_bytes_total",
+        "Bytes received by the adapter.",
+        offsetof(struct socket_impl_stats, bytes_recv));
+
+    metrics_render_commands(metrics, "mobile_commands_total",
+        "Commands sent to the adapter and replied to.",
+        offsetof(struct command_stats, count), false);
+    metrics_render_commands(metrics, "mobile_command_errors_total",
+        "Commands the adapter replied to with an error.",
+        offsetof(struct command_stats, errors), false);
+    metrics_render_commands(metrics, "mobile_command_request_bytes_total",
+        "Data bytes in the requests of the commands.",
+        offsetof(struct command_stats, request_bytes), false);
+    metrics_render_commands(metrics, "mobile_command_reply_bytes_total",
+        "Data bytes in the replies to the commands.",
+        offsetof(struct command_stats, reply_bytes), false);
+    metrics_render_commands(metrics, "mobile_command_seconds_total",
+        "Time from the first byte of each request to the last of its reply.",
+        offsetof(struct command_stats, time_ns), true);
+    metrics_render_commands(metrics, "mobile_command_wait_seconds_total",
+        "Part of the command time spent waiting on the adapter's reply.",
+        offsetof(struct command_stats, wait_ns), true);
+
+    thread_mutex_unlock(&engine->lock);
+
+    if (metrics->dns) {
+        struct dns *dns = metrics->dns;
+        thread_mutex_lock(&dns->lock);
+        metrics_header(metrics, "mobile_dns_cache_hits_total", "counter",
+            "DNS queries answered from the cache.");
+        metrics_printf(metrics, "mobile_dns_cache_hits_total %llu\n",
+            (unsigned long long)dns->hits);
+        metrics_header(metrics, "mobile_dns_cache_misses_total", "counter",
+            "DNS queries sent on to a server.");
+        metrics_printf(metrics, "mobile_dns_cache_misses_total %llu\n",
+            (unsigned long long)dns->misses);
+        thread_mutex_unlock(&dns->lock);
+    }
+
+    metrics_header(metrics, "mobile_log_dropped_total", "counter",
+        "Log messages dropped because the log ring was full.");
+    metrics_printf(metrics, "mobile_log_dropped_total %llu\n",
+        (unsigned long long)log_dropped());
+}
+
+static bool metrics_send(SOCKET sock, const char *data, size_t size)
+{
+    size_t offset = 0;
+    while (offset < size) {
+        ssize_t num = send(sock, data + offset, (int)(size - offset), 0);
+        if (num == -1) {
+            if (socket_geterror() == SOCKET_EWOULDBLOCK &&
+                    socket_waitwrite(sock, METRICS_SEND_TIMEOUT) > 0) {
+                continue;
+            }
+            return false;
+        }
+        offset += num;
+    }
+    return true;
+}
+
+static void metrics_respond(struct metrics *metrics, struct metrics_client *client)
+{
+    char header[0x100];
+
+    bool found = strncmp(client->request, "GET /metrics ", 13) == 0 ||
+        strncmp(client->request, "GET / ", 6) == 0;
+    if (!found) {
+        static const char response[] = "HTTP/1.0 404 Not Found\r\n"
+            "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        metrics_send(client->socket, response, sizeof(response) - 1);
+        return;
+    }
+
+    metrics_render(metrics);
+    int len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %llu\r\nConnection: close\r\n\r\n",
+        (unsigned long long)metrics->buf_len);
+    if (!metrics_send(client->socket, header, len)) return;
+    metrics_send(client->socket, metrics->buf, metrics->buf_len);
+}
+
+static void metrics_accept(struct metrics *metrics)
+{
+    for (;;) {
+        SOCKET sock = accept(metrics->listener, NULL, NULL);
+        if (sock == INVALID_SOCKET) {
+            if (socket_geterror() != SOCKET_EWOULDBLOCK) {
+                socket_perror("accept");
+            }
+            metrics->listener_ready = false;
+            return;
+        }
+
+        struct metrics_client *client = NULL;
+        for (unsigned i = 0; i < METRICS_CLIENTS; i++) {
+            if (metrics->clients[i].socket != INVALID_SOCKET) continue;
+            client = &metrics->clients[i];
+            break;
+        }
+        if (!client || socket_setblocking(sock, 0) == -1) {
+            socket_close(sock);
+            continue;
+        }
+        client->socket = sock;
+        client->size = 0;
+        if (!socket_poller_add(metrics->poller, sock, &client->ready)) {
+            socket_close(sock);
+            client->socket = INVALID_SOCKET;
+            continue;
+        }
+        client->ready = true;
+    }
+}
+
+// Accept scrapes and answer the ones whose request arrived in full
+void metrics_loop(struct metrics *metrics)
+{
+    if (metrics->listener_ready) metrics_accept(metrics);
+
+    for (unsigned i = 0; i < METRICS_CLIENTS; i++) {
+        struct metrics_client *client = &metrics->clients[i];
+        if (client->socket == INVALID_SOCKET || !client->ready) continue;
+
+        ssize_t num = recv(client->socket, client->request + client->size,
+            sizeof(client->request) - 1 - client->size, 0);
+        if (num == -1 && socket_geterror() == SOCKET_EWOULDBLOCK) {
+            client->ready = false;
+            continue;
+        }
+        if (num <= 0) {
+            metrics_client_close(metrics, client);
+            continue;
+        }
+        client->size += num;
+        client->request[client->size] = '\0';
+
+        // Only the request line matters, respond once the headers are done
+        if (!strstr(client->request, "\r\n\r\n") &&
+                !strstr(client->request, "\n\n") &&
+                client->size < sizeof(client->request) - 1) {
+            continue;
+        }
+        metrics_respond(metrics, client);
+        metrics_client_close(metrics, client);
+    }
+}
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "dns.h"
+#include "engine.h"
+#include "socket.h"
+
+// Maximum amount of scrapes being handled at once
+#define METRICS_CLIENTS 4
+// Maximum size of a request, anything beyond it is ignored
+#define METRICS_REQUEST_SIZE 0x400
+// Maximum time to wait on a client to accept the response, in milliseconds
+#define METRICS_SEND_TIMEOUT 1000
+
+struct metrics_client {
+    SOCKET socket;
+    bool ready;
+    unsigned size;
+    char request[METRICS_REQUEST_SIZE];
+};
+
+// HTTP listener serving the counters of every session in the Prometheus
+//   text format. It's handled by the main thread, leaving the sessions be.
+struct metrics {
+    struct socket_poller *poller;
+    struct engine *engine;
+    struct dns *dns;  // Set when DNS queries are answered locally
+    SOCKET listener;
+    bool listener_ready;
+    struct metrics_client clients[METRICS_CLIENTS];
+    char *buf;
+    size_t buf_size;
+    size_t buf_len;
+};
+
+bool metrics_init(struct metrics *metrics, const char *host, const char *port, struct socket_poller *poller, struct engine *engine);
+void metrics_deinit(struct metrics *metrics);
+void metrics_loop(struct metrics *metrics);
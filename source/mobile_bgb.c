@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "mobile_bgb.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mobile.h>
+#include <mobile_inet.h>
+
+#include "session.h"
+#include "socket.h"
+
+// A session without an emulator link, waiting on its own sockets
+struct mobile_bgb {
+    struct mobile_user *mobile;
+    struct socket_poller poller;
+};
+
+_Static_assert(MOBILE_BGB_RELAY_TOKEN_SIZE == MOBILE_RELAY_TOKEN_SIZE,
+    "relay token size mismatch");
+
+void mobile_bgb_options_init(struct mobile_bgb_options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->device = MOBILE_ADAPTER_BLUE;
+    options->dns_port = MOBILE_DNS_PORT;
+    options->p2p_port = MOBILE_DEFAULT_P2P_PORT;
+}
+
+// Convert an address given in text form, leaving it unset if it's NULL
+static bool mobile_bgb_parse_addr(struct mobile_addr *dest, const char *str, unsigned port)
+{
+    dest->type = MOBILE_ADDRTYPE_NONE;
+    if (!str) return true;
+
+    unsigned char ip[MOBILE_INET_PTON_MAXLEN];
+    int rc = mobile_inet_pton(MOBILE_INET_PTON_ANY, str, ip);
+    struct mobile_addr4 *dest4 = (struct mobile_addr4 *)dest;
+    struct mobile_addr6 *dest6 = (struct mobile_addr6 *)dest;
+    switch (rc) {
+    case MOBILE_INET_PTON_IPV4:
+        dest4->type = MOBILE_ADDRTYPE_IPV4;
+        dest4->port = port;
+        memcpy(dest4->host, ip, sizeof(dest4->host));
+        return true;
+    case MOBILE_INET_PTON_IPV6:
+        dest6->type = MOBILE_ADDRTYPE_IPV6;
+        dest6->port = port;
+        memcpy(dest6->host, ip, sizeof(dest6->host));
+        return true;
+    default:
+        fprintf(stderr, "Invalid address: %s\n", str);
+        return false;
+    }
+}
+
+// Create an adapter, backed by the provided configuration file
+// The options may be NULL, to use the defaults. The adapter starts along with
+//   the clock, on the first call to mobile_bgb_clock() or
+//   mobile_bgb_transfer().
+struct mobile_bgb *mobile_bgb_new(const char *fname_config, const struct mobile_bgb_options *options)
+{
+    struct mobile_bgb_options defaults;
+    if (!options) {
+        mobile_bgb_options_init(&defaults);
+        options = &defaults;
+    }
+
+    struct session_options session_options = {
+        .device = options->device,
+        .device_unmetered = options->device_unmetered,
+        .p2p_port = options->p2p_port,
+        .relay_token_update = options->relay_token_update,
+        .relay_token = NULL,
+        .config_db = NULL,
+        .dns = NULL,
+        .send_buffering = options->send_buffering,
+        .relay_pool = options->relay_pool,
+        .reconnect = false,
+        .link_thread = false,
+        .pcap = NULL,
+    };
+    if (!mobile_bgb_parse_addr(&session_options.dns1, options->dns1,
+                options->dns_port) ||
+            !mobile_bgb_parse_addr(&session_options.dns2, options->dns2,
+                options->dns_port) ||
+            !mobile_bgb_parse_addr(&session_options.relay, options->relay,
+                MOBILE_DEFAULT_RELAY_PORT)) {
+        return NULL;
+    }
+    unsigned char relay_token[MOBILE_RELAY_TOKEN_SIZE];
+    if (options->relay_token) {
+        memcpy(relay_token, options->relay_token, sizeof(relay_token));
+        session_options.relay_token = relay_token;
+    }
+
+    struct mobile_bgb *bgb = malloc(sizeof(struct mobile_bgb));
+    if (!bgb) {
+        perror("malloc");
+        return NULL;
+    }
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    int wsa_err = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (wsa_err != NO_ERROR) {
+        fprintf(stderr, "WSAStartup failed with error: %d\n", wsa_err);
+        free(bgb);
+        return NULL;
+    }
+#endif
+
+    bgb->mobile = session_new(fname_config, &session_options);
+    if (!bgb->mobile) goto error;
+    if (!socket_poller_init(&bgb->poller)) {
+        session_free(bgb->mobile);
+        goto error;
+    }
+    if (!session_attach(bgb->mobile, &bgb->poller)) {
+        session_free(bgb->mobile);
+        socket_poller_deinit(&bgb->poller);
+        goto error;
+    }
+    return bgb;
+
+error:
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    free(bgb);
+    return NULL;
+}
+
+void mobile_bgb_free(struct mobile_bgb *bgb)
+{
+    session_free(bgb->mobile);
+    socket_poller_deinit(&bgb->poller);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    free(bgb);
+}
+
+// Update the emulator's clock, which drives the adapter's timers
+void mobile_bgb_clock(struct mobile_bgb *bgb, uint32_t timestamp)
+{
+    session_clock(bgb->mobile, timestamp);
+}
+
+// Reset the adapter, whenever the emulator is reset or loads a save state
+void mobile_bgb_reset(struct mobile_bgb *bgb)
+{
+    session_reset(bgb->mobile);
+}
+
+// Transfer a byte over the serial port, returning the adapter's reply
+unsigned char mobile_bgb_transfer(struct mobile_bgb *bgb, unsigned char c, uint32_t timestamp)
+{
+    session_clock(bgb->mobile, timestamp);
+    return session_transfer(bgb->mobile, c);
+}
+
+// Process the adapter's actions and sockets, waiting on them for at most the
+//   provided time in milliseconds, or not at all if 0
+// Returns false if the adapter failed and must be freed.
+bool mobile_bgb_poll(struct mobile_bgb *bgb, int timeout)
+{
+    int delay = session_delay(bgb->mobile, timeout);
+    socket_poller_wait(&bgb->poller, delay);
+    return session_loop(bgb->mobile);
+}
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// In-process interface to the adapter, for emulators linking libmobile-bgb
+//   directly instead of connecting to the mobile program over the BGB link
+//   protocol. Every function of a session must be called from the same thread.
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Only these functions are exported by the shared library
+#if defined(_WIN32) && defined(MOBILE_BGB_EXPORTS)
+#define MOBILE_BGB_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define MOBILE_BGB_API __attribute__((visibility("default")))
+#else
+#define MOBILE_BGB_API
+#endif
+
+// Rate at which the timestamps given to the adapter tick, the same as the
+//   ones in the BGB link protocol
+#define MOBILE_BGB_CLOCK_RATE (1 << 21)
+// Size of a relay token, in bytes
+#define MOBILE_BGB_RELAY_TOKEN_SIZE 0x10
+
+struct mobile_bgb;
+
+// Adapter settings, filled with their defaults by mobile_bgb_options_init()
+// Addresses are IPv4 or IPv6 addresses in text form, or NULL if unset.
+struct mobile_bgb_options {
+    unsigned device;  // Adapter model, as numbered by libmobile
+    bool device_unmetered;
+    const char *dns1;
+    const char *dns2;
+    unsigned dns_port;
+    unsigned p2p_port;
+    const char *relay;
+    bool relay_token_update;  // Set to replace the token, NULL clearing it
+    const unsigned char *relay_token;
+    bool relay_pool;
+    bool send_buffering;
+};
+
+MOBILE_BGB_API void mobile_bgb_options_init(struct mobile_bgb_options *options);
+MOBILE_BGB_API struct mobile_bgb *mobile_bgb_new(const char *fname_config, const struct mobile_bgb_options *options);
+MOBILE_BGB_API void mobile_bgb_free(struct mobile_bgb *bgb);
+MOBILE_BGB_API void mobile_bgb_clock(struct mobile_bgb *bgb, uint32_t timestamp);
+MOBILE_BGB_API void mobile_bgb_reset(struct mobile_bgb *bgb);
+MOBILE_BGB_API unsigned char mobile_bgb_transfer(struct mobile_bgb *bgb, unsigned char c, uint32_t timestamp);
+MOBILE_BGB_API bool mobile_bgb_poll(struct mobile_bgb *bgb, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "mpsc.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+bool mpsc_init(struct mpsc *ring, size_t count, size_t item_size)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->seqs = malloc(count * sizeof(size_t));
+    ring->items = malloc(count * item_size);
+    if (!ring->seqs || !ring->items) {
+        perror("malloc");
+        free(ring->seqs);
+        free(ring->items);
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) ring->seqs[i] = i;
+    ring->count = count;
+    ring->item_size = item_size;
+    return true;
+}
+
+void mpsc_deinit(struct mpsc *ring)
+{
+    free(ring->seqs);
+    free(ring->items);
+    ring->seqs = NULL;
+    ring->items = NULL;
+}
+
+// Claim the next free slot to be filled, returns NULL if the ring is full
+// The slot must be handed to the consumer with mpsc_commit() along with the
+//   position stored in pos.
+void *mpsc_claim(struct mpsc *ring, size_t *pos)
+{
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    for (;;) {
+        size_t index = head & (ring->count - 1);
+        size_t seq = __atomic_load_n(&ring->seqs[index], __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)(seq - head);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &head, head + 1,
+                    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos = head;
+                return ring->items + index * ring->item_size;
+            }
+        } else if (diff < 0) {
+            // The consumer is a whole lap behind
+            return NULL;
+        } else {
+            head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void mpsc_commit(struct mpsc *ring, size_t pos)
+{
+    __atomic_store_n(&ring->seqs[pos & (ring->count - 1)], pos + 1,
+        __ATOMIC_RELEASE);
+}
+
+// Look at the oldest item, returns NULL if it's not complete yet
+// Items are completed in the order they were claimed.
+void *mpsc_peek(struct mpsc *ring)
+{
+    size_t index = ring->tail & (ring->count - 1);
+    size_t seq = __atomic_load_n(&ring->seqs[index], __ATOMIC_ACQUIRE);
+    if (seq != ring->tail + 1) return NULL;
+    return ring->items + index * ring->item_size;
+}
+
+// Hand the oldest item's slot back to the producers
+void mpsc_release(struct mpsc *ring)
+{
+    __atomic_store_n(&ring->seqs[ring->tail & (ring->count - 1)],
+        ring->tail + ring->count, __ATOMIC_RELEASE);
+    ring->tail++;
+}
@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Bounded lock-free ring of fixed-size items, filled in place by any amount
+//   of threads and drained by a single one
+// Every slot carries a sequence number telling whose turn it is: it equals
+//   the position a producer may claim the slot at, and is one past it once
+//   the item is complete. The consumer hands it back for the next lap.
+struct mpsc {
+    size_t head;  // Claimed by producers
+    size_t pad_head[15];
+    size_t tail;  // Only used by the consumer
+    size_t pad_tail[15];
+    size_t count;  // A power of two
+    size_t item_size;
+    size_t *seqs;
+    unsigned char *items;
+};
+
+bool mpsc_init(struct mpsc *ring, size_t count, size_t item_size);
+void mpsc_deinit(struct mpsc *ring);
+void *mpsc_claim(struct mpsc *ring, size_t *pos);
+void mpsc_commit(struct mpsc *ring, size_t pos);
+void *mpsc_peek(struct mpsc *ring);
+void mpsc_release(struct mpsc *ring);
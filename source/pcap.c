@@ -0,0 +1,353 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "pcap.h"
+
+#include <string.h>
+
+#include "log.h"
+#include "timer.h"
+
+// The capture holds bare IP packets, with nanosecond timestamps
+#define PCAP_MAGIC 0xA1B23C4D
+#define PCAP_LINKTYPE_RAW 101
+
+#define PCAP_TCP_FIN 0x01
+#define PCAP_TCP_SYN 0x02
+#define PCAP_TCP_PSH 0x08
+#define PCAP_TCP_ACK 0x10
+
+// Largest IP and transport headers made up for a packet
+#define PCAP_HEADER_SIZE (40 + 20)
+
+// A packet waiting to be written, its headers made up by the writer thread
+struct pcap_packet {
+    uint64_t time;
+    bool ipv6;
+    unsigned char proto;
+    unsigned char flags;
+    unsigned char src[16];
+    unsigned char dst[16];
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint32_t seq;
+    uint32_t ack;
+    unsigned size;  // Before truncation to PCAP_SNAPLEN
+    unsigned char data[PCAP_SNAPLEN];
+};
+
+static void pcap_put16(unsigned char *dest, uint16_t value)
+{
+    dest[0] = value >> 8;
+    dest[1] = value;
+}
+
+static void pcap_put32(unsigned char *dest, uint32_t value)
+{
+    pcap_put16(dest, value >> 16);
+    pcap_put16(dest + 2, value);
+}
+
+// Add up big-endian 16-bit words, as the internet checksum does
+static uint32_t pcap_sum(uint32_t sum, const unsigned char *data, unsigned size)
+{
+    for (unsigned i = 0; i + 1 < size; i += 2) sum += data[i] << 8 | data[i + 1];
+    if (size & 1) sum += data[size - 1] << 8;
+    return sum;
+}
+
+static uint16_t pcap_checksum(uint32_t sum)
+{
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+static void pcap_write_packet(struct pcap *pcap, const struct pcap_packet *packet)
+{
+    unsigned char header[PCAP_HEADER_SIZE] = {0};
+    unsigned ip_size = packet->ipv6 ? 40 : 20;
+    unsigned transport_size = packet->proto == IPPROTO_TCP ? 20 : 8;
+    unsigned header_size = ip_size + transport_size;
+    unsigned addr_size = packet->ipv6 ? 16 : 4;
+    unsigned caplen = packet->size;
+    if (caplen > PCAP_SNAPLEN) caplen = PCAP_SNAPLEN;
+
+    unsigned char *transport = header + ip_size;
+    unsigned char *checksum;
+    pcap_put16(transport + 0, packet->src_port);
+    pcap_put16(transport + 2, packet->dst_port);
+    if (packet->proto == IPPROTO_TCP) {
+        pcap_put32(transport + 4, packet->seq);
+        pcap_put32(transport + 8, packet->ack);
+        transport[12] = 5 << 4;
+        transport[13] = packet->flags;
+        pcap_put16(transport + 14, 0xFFFF);
+        checksum = transport + 16;
+    } else {
+        pcap_put16(transport + 4, transport_size + packet->size);
+        checksum = transport + 6;
+    }
+
+    // The checksum covers a pseudo-header of the addresses, the transport
+    //   header and the payload, and is left out of truncated packets
+    if (caplen == packet->size) {
+        uint32_t sum = pcap_sum(0, packet->src, addr_size);
+        sum = pcap_sum(sum, packet->dst, addr_size);
+        sum += packet->proto + transport_size + packet->size;
+        sum = pcap_sum(sum, transport, transport_size);
+        sum = pcap_sum(sum, packet->data, packet->size);
+        uint16_t value = pcap_checksum(sum);
+        if (!value && packet->proto == IPPROTO_UDP) value = 0xFFFF;
+        pcap_put16(checksum, value);
+    }
+
+    if (packet->ipv6) {
+        header[0] = 0x60;
+        pcap_put16(header + 4, transport_size + packet->size);
+        header[6] = packet->proto;
+        header[7] = 64;
+        memcpy(header + 8, packet->src, 16);
+        memcpy(header + 24, packet->dst, 16);
+    } else {
+        header[0] = 0x45;
+        pcap_put16(header + 2, header_size + packet->size);
+        pcap_put16(header + 6, 0x4000);  // Don't fragment
+        header[8] = 64;
+        header[9] = packet->proto;
+        memcpy(header + 12, packet->src, 4);
+        memcpy(header + 16, packet->dst, 4);
+        pcap_put16(header + 10, pcap_checksum(pcap_sum(0, header, 20)));
+    }
+
+    uint32_t record[4] = {
+        (uint32_t)(packet->time / 1000000000),
+        (uint32_t)(packet->time % 1000000000),
+        header_size + caplen,
+        header_size + packet->size,
+    };
+    fwrite(record, sizeof(record), 1, pcap->file);
+    fwrite(header, header_size, 1, pcap->file);
+    fwrite(packet->data, caplen, 1, pcap->file);
+}
+
+static void pcap_drain(struct pcap *pcap)
+{
+    unsigned count = 0;
+    struct pcap_packet *packet;
+    while ((packet = mpsc_peek(&pcap->ring))) {
+        pcap_write_packet(pcap, packet);
+        mpsc_release(&pcap->ring);
+        count++;
+    }
+    if (count) fflush(pcap->file);
+}
+
+static void pcap_thread(void *arg)
+{
+    struct pcap *pcap = arg;
+    while (!__atomic_load_n(&pcap->stop, __ATOMIC_ACQUIRE)) {
+        pcap_drain(pcap);
+        thread_sleep(PCAP_FLUSH_INTERVAL);
+    }
+    pcap_drain(pcap);
+}
+
+// Start capturing to a file, written out by a thread of its own
+bool pcap_open(struct pcap *pcap, const char *fname)
+{
+    if (!mpsc_init(&pcap->ring, PCAP_SLOTS, sizeof(struct pcap_packet))) {
+        return false;
+    }
+    pcap->file = fopen(fname, "wb");
+    if (!pcap->file) {
+        perror("fopen");
+        goto error_ring;
+    }
+    pcap->stop = false;
+    pcap->dropped = 0;
+
+    struct {
+        uint32_t magic;
+        uint16_t version_major;
+        uint16_t version_minor;
+        int32_t thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t linktype;
+    } header = {
+        PCAP_MAGIC, 2, 4, 0, 0,
+        PCAP_HEADER_SIZE + PCAP_SNAPLEN, PCAP_LINKTYPE_RAW
+    };
+    if (fwrite(&header, sizeof(header), 1, pcap->file) != 1) {
+        perror("fwrite");
+        goto error_file;
+    }
+
+    if (!thread_create(&pcap->thread, pcap_thread, pcap)) goto error_file;
+    return true;
+
+error_file:
+    fclose(pcap->file);
+error_ring:
+    mpsc_deinit(&pcap->ring);
+    return false;
+}
+
+// Write out the remaining packets and stop the writer thread
+// Nothing may be captured from other threads past this point.
+void pcap_close(struct pcap *pcap)
+{
+    __atomic_store_n(&pcap->stop, true, __ATOMIC_RELEASE);
+    thread_join(pcap->thread);
+    fclose(pcap->file);
+    mpsc_deinit(&pcap->ring);
+    if (pcap->dropped) {
+        log_warn(NULL, "pcap: %llu packets dropped",
+            (unsigned long long)pcap->dropped);
+    }
+}
+
+// Take the address and port out of a sockaddr
+static bool pcap_endpoint(const struct sockaddr_storage *addr, unsigned char host[16], uint16_t *port)
+{
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+        memcpy(host, &addr4->sin_addr, 4);
+        *port = ntohs(addr4->sin_port);
+        return true;
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+        memcpy(host, &addr6->sin6_addr, 16);
+        *port = ntohs(addr6->sin6_port);
+        return true;
+    }
+    return false;
+}
+
+// Queue up a packet going from one endpoint to another
+static void pcap_push(struct pcap *pcap, const struct sockaddr_storage *src, const struct sockaddr_storage *dst, unsigned char proto, unsigned char flags, uint32_t seq, uint32_t ack, const void *data, unsigned size)
+{
+    if (src->ss_family != dst->ss_family) return;
+
+    size_t pos;
+    struct pcap_packet *packet = mpsc_claim(&pcap->ring, &pos);
+    if (!packet) {
+        __atomic_add_fetch(&pcap->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    packet->time = timer_real_ns();
+    packet->ipv6 = src->ss_family == AF_INET6;
+    packet->proto = proto;
+    packet->flags = flags;
+    pcap_endpoint(src, packet->src, &packet->src_port);
+    pcap_endpoint(dst, packet->dst, &packet->dst_port);
+    packet->seq = seq;
+    packet->ack = ack;
+    packet->size = size;
+    if (size) {
+        memcpy(packet->data, data, size < PCAP_SNAPLEN ? size : PCAP_SNAPLEN);
+    }
+    mpsc_commit(&pcap->ring, pos);
+}
+
+// Start a TCP stream, made up of a handshake once the connection is
+//   established, either by connecting or accepting it
+void pcap_tcp_open(struct pcap *pcap, struct pcap_flow *flow, SOCKET sock, bool active)
+{
+    socklen_t local_len = sizeof(flow->local);
+    socklen_t remote_len = sizeof(flow->remote);
+    flow->known =
+        getsockname(sock, (struct sockaddr *)&flow->local, &local_len) == 0 &&
+        getpeername(sock, (struct sockaddr *)&flow->remote, &remote_len) == 0;
+    if (!flow->known) return;
+
+    const struct sockaddr_storage *client = active ? &flow->local : &flow->remote;
+    const struct sockaddr_storage *server = active ? &flow->remote : &flow->local;
+    pcap_push(pcap, client, server, IPPROTO_TCP, PCAP_TCP_SYN, 0, 0, NULL, 0);
+    pcap_push(pcap, server, client, IPPROTO_TCP, PCAP_TCP_SYN | PCAP_TCP_ACK,
+        0, 1, NULL, 0);
+    pcap_push(pcap, client, server, IPPROTO_TCP, PCAP_TCP_ACK, 1, 1, NULL, 0);
+    flow->seq_local = 1;
+    flow->seq_remote = 1;
+}
+
+// End either side of a TCP stream, the stream being forgotten once the
+//   adapter closes it
+void pcap_tcp_close(struct pcap *pcap, struct pcap_flow *flow, bool local)
+{
+    if (!flow->known) return;
+    if (local) {
+        pcap_push(pcap, &flow->local, &flow->remote, IPPROTO_TCP,
+            PCAP_TCP_FIN | PCAP_TCP_ACK, flow->seq_local++, flow->seq_remote,
+            NULL, 0);
+        flow->known = false;
+    } else {
+        pcap_push(pcap, &flow->remote, &flow->local, IPPROTO_TCP,
+            PCAP_TCP_FIN | PCAP_TCP_ACK, flow->seq_remote++, flow->seq_local,
+            NULL, 0);
+    }
+}
+
+void pcap_tcp_data(struct pcap *pcap, struct pcap_flow *flow, bool sent, const void *data, unsigned size)
+{
+    if (!flow->known) return;
+    if (sent) {
+        pcap_push(pcap, &flow->local, &flow->remote, IPPROTO_TCP,
+            PCAP_TCP_PSH | PCAP_TCP_ACK, flow->seq_local, flow->seq_remote,
+            data, size);
+        flow->seq_local += size;
+    } else {
+        pcap_push(pcap, &flow->remote, &flow->local, IPPROTO_TCP,
+            PCAP_TCP_PSH | PCAP_TCP_ACK, flow->seq_remote, flow->seq_local,
+            data, size);
+        flow->seq_remote += size;
+    }
+}
+
+// Find the address datagrams to a remote are sent from, by connecting a
+//   throwaway socket to it, which doesn't send anything
+static void pcap_udp_route(struct sockaddr_storage *local, const struct sockaddr_storage *remote)
+{
+    SOCKET sock = socket(remote->ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) return;
+    socklen_t remote_len = remote->ss_family == AF_INET6 ?
+        sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    struct sockaddr_storage route;
+    socklen_t route_len = sizeof(route);
+    if (connect(sock, (struct sockaddr *)remote, remote_len) == 0 &&
+            getsockname(sock, (struct sockaddr *)&route, &route_len) == 0 &&
+            route.ss_family == local->ss_family) {
+        if (local->ss_family == AF_INET6) {
+            ((struct sockaddr_in6 *)local)->sin6_addr =
+                ((struct sockaddr_in6 *)&route)->sin6_addr;
+        } else {
+            ((struct sockaddr_in *)local)->sin_addr =
+                ((struct sockaddr_in *)&route)->sin_addr;
+        }
+    }
+    socket_close(sock);
+}
+
+// Capture a datagram, the socket's own address being looked up only once
+// Sockets are bound to any address, so the one they're actually seen from is
+//   taken from the route to the first remote.
+void pcap_udp_data(struct pcap *pcap, struct pcap_flow *flow, SOCKET sock, const struct sockaddr *remote, bool sent, const void *data, unsigned size)
+{
+    if (!remote) return;
+    struct sockaddr_storage addr = {0};
+    memcpy(&addr, remote, remote->sa_family == AF_INET6 ?
+        sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+
+    if (!flow->known) {
+        socklen_t local_len = sizeof(flow->local);
+        if (getsockname(sock, (struct sockaddr *)&flow->local,
+                &local_len) != 0) {
+            return;
+        }
+        pcap_udp_route(&flow->local, &addr);
+        flow->known = true;
+    }
+    if (sent) {
+        pcap_push(pcap, &flow->local, &addr, IPPROTO_UDP, 0, 0, 0, data, size);
+    } else {
+        pcap_push(pcap, &addr, &flow->local, IPPROTO_UDP, 0, 0, 0, data, size);
+    }
+}
@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mpsc.h"
+#include "socket.h"
+#include "thread.h"
+
+// Largest payload captured per packet, anything beyond it is truncated
+#define PCAP_SNAPLEN 0x1000
+// Amount of packets the ring holds, a power of two
+#define PCAP_SLOTS 256
+// Time the writer thread sleeps between draining the ring, in milliseconds
+#define PCAP_FLUSH_INTERVAL 10
+
+// Capture file the traffic of every session is written to, in the order the
+//   packets were captured
+struct pcap {
+    struct mpsc ring;
+    FILE *file;
+    thread_t thread;
+    bool stop;  // Atomic
+    uint64_t dropped;  // Atomic, packets that didn't fit in the ring
+};
+
+// Endpoints of a connection slot, and the state of the TCP stream made up
+//   for it, so captures can be followed as regular connections
+struct pcap_flow {
+    bool known;
+    struct sockaddr_storage local;
+    struct sockaddr_storage remote;
+    uint32_t seq_local;
+    uint32_t seq_remote;
+};
+
+bool pcap_open(struct pcap *pcap, const char *fname);
+void pcap_close(struct pcap *pcap);
+void pcap_tcp_open(struct pcap *pcap, struct pcap_flow *flow, SOCKET sock, bool active);
+void pcap_tcp_close(struct pcap *pcap, struct pcap_flow *flow, bool local);
+void pcap_tcp_data(struct pcap *pcap, struct pcap_flow *flow, bool sent, const void *data, unsigned size);
+void pcap_udp_data(struct pcap *pcap, struct pcap_flow *flow, SOCKET sock, const struct sockaddr *remote, bool sent, const void *data, unsigned size);
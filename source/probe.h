@@ -0,0 +1,12 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// USDT probes of the "mobile" provider, for bpftrace and perf
+// Built with WITH_USDT, each probe is a nop recorded in an ELF note, and
+//   otherwise compiles to nothing, its arguments not even being evaluated.
+#pragma once
+
+#if defined(WITH_USDT)
+#include <sys/sdt.h>
+#define PROBE(...) STAP_PROBEV(mobile, __VA_ARGS__)
+#else
+#define PROBE(...) do {} while (0)
+#endif
@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "record.h"
+
+#include <string.h>
+
+#include "timer.h"
+
+static unsigned record_size(enum record_type type)
+{
+    switch (type) {
+    case RECORD_RECV:
+    case RECORD_SEND:
+        return 8;
+    case RECORD_TRANSFER:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+// Open a recording, creating it anew when writing
+bool record_open(struct record *record, const char *fname, bool write)
+{
+    record->file = fopen(fname, write ? "wb" : "rb");
+    if (!record->file) {
+        perror("fopen");
+        return false;
+    }
+    record->last = timer_host_ns();
+
+    char magic[RECORD_MAGIC_SIZE];
+    if (write) {
+        if (fwrite(RECORD_MAGIC, RECORD_MAGIC_SIZE, 1, record->file) != 1) {
+            perror("fwrite");
+            fclose(record->file);
+            return false;
+        }
+    } else if (fread(magic, RECORD_MAGIC_SIZE, 1, record->file) != 1 ||
+            memcmp(magic, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "%s: Not a link recording\n", fname);
+        fclose(record->file);
+        return false;
+    }
+    return true;
+}
+
+void record_close(struct record *record)
+{
+    fclose(record->file);
+}
+
+// Append an entry, timestamped with the current time
+void record_write(struct record *record, enum record_type type, const void *data)
+{
+    unsigned char buf[1 + 10 + 8];
+    unsigned size = 0;
+
+    uint64_t now = timer_host_ns();
+    uint64_t delta = now - record->last;
+    record->last = now;
+
+    buf[size++] = type;
+    do {
+        buf[size] = delta & 0x7F;
+        delta >>= 7;
+        if (delta) buf[size] |= 0x80;
+        size++;
+    } while (delta);
+    memcpy(buf + size, data, record_size(type));
+    size += record_size(type);
+
+    // Errors are checked when the file is closed, the link can't wait on it
+    fwrite(buf, size, 1, record->file);
+}
+
+// Read the next entry, returning 0 at the end of the file and -1 on errors
+int record_read(struct record *record, struct record_entry *entry)
+{
+    int c = getc(record->file);
+    if (c == EOF) return 0;
+    entry->type = c;
+    unsigned size = record_size(entry->type);
+    if (!size) {
+        fprintf(stderr, "record_read: Unknown entry type: %d\n", c);
+        return -1;
+    }
+
+    entry->time = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        c = getc(record->file);
+        if (c == EOF || shift >= 64) {
+            fprintf(stderr, "record_read: Truncated entry\n");
+            return -1;
+        }
+        entry->time |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) break;
+    }
+
+    if (fread(entry->data, size, 1, record->file) != 1) {
+        fprintf(stderr, "record_read: Truncated entry\n");
+        return -1;
+    }
+    return 1;
+}
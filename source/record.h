@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Recordings of the emulator link start with this magic, followed by a list
+//   of entries. Each entry consists of its type byte, the time passed since
+//   the previous entry in nanoseconds as an unsigned LEB128 number, and the
+//   data, whose size depends on the type.
+#define RECORD_MAGIC "BGBREC\x00\x01"
+#define RECORD_MAGIC_SIZE 8
+
+enum record_type {
+    RECORD_RECV,  // Packet received from the emulator (8 bytes)
+    RECORD_SEND,  // Packet sent to the emulator (8 bytes)
+    RECORD_TRANSFER  // Serial byte received and byte replied (2 bytes)
+};
+
+struct record_entry {
+    enum record_type type;
+    uint64_t time;
+    unsigned char data[8];
+};
+
+struct record {
+    FILE *file;
+    uint64_t last;
+};
+
+bool record_open(struct record *record, const char *fname, bool write);
+void record_close(struct record *record);
+void record_write(struct record *record, enum record_type type, const void *data);
+int record_read(struct record *record, struct record_entry *entry);
@@ -0,0 +1,318 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "relay.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#include "timer.h"
+
+static const unsigned char relay_magic[7] = {0, 'M', 'O', 'B', 'I', 'L', 'E'};
+
+void relay_pool_init(struct relay_pool *pool, const struct mobile_addr *addr, const unsigned char *token)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->addr.type = MOBILE_ADDRTYPE_NONE;
+    if (addr) memcpy(&pool->addr, addr, sizeof(pool->addr));
+    pool->state = RELAY_POOL_IDLE;
+    pool->sock = INVALID_SOCKET;
+    pool->retry_delay = RELAY_RETRY_MIN;
+    pool->claimed = -1;
+    pool->taken = -1;
+
+    // The token given on the command line is the one the adapter will use
+    if (token) {
+        memcpy(pool->handshake, relay_magic, sizeof(relay_magic));
+        pool->handshake[7] = 1;
+        memcpy(pool->handshake + 8, token, MOBILE_RELAY_TOKEN_SIZE);
+        pool->handshake_known = true;
+    }
+}
+
+static void relay_pool_close(struct relay_pool *pool, struct socket_poller *poller)
+{
+    if (pool->sock != INVALID_SOCKET) {
+        if (poller) socket_poller_del(poller, pool->sock);
+        socket_close(pool->sock);
+    }
+    pool->sock = INVALID_SOCKET;
+    pool->ready = false;
+    pool->reply_size = 0;
+    pool->state = RELAY_POOL_IDLE;
+}
+
+void relay_pool_stop(struct relay_pool *pool, struct socket_poller *poller)
+{
+    relay_pool_close(pool, poller);
+    pool->claimed = -1;
+    pool->taken = -1;
+}
+
+// Start waiting on the connection being warmed up through a different poller
+bool relay_pool_attach(struct relay_pool *pool, struct socket_poller *poller)
+{
+    if (pool->sock == INVALID_SOCKET) return true;
+    return socket_poller_add(poller, pool->sock, &pool->ready);
+}
+
+void relay_pool_detach(struct relay_pool *pool, struct socket_poller *poller)
+{
+    if (pool->sock == INVALID_SOCKET) return;
+    socket_poller_del(poller, pool->sock);
+}
+
+// Give up on the current connection, and try again after a while
+static void relay_pool_fail(struct relay_pool *pool, struct socket_poller *poller, uint64_t now)
+{
+    relay_pool_close(pool, poller);
+    pool->time = now + (uint64_t)pool->retry_delay * 1000000;
+    pool->retry_delay *= 2;
+    if (pool->retry_delay > RELAY_RETRY_MAX) {
+        pool->retry_delay = RELAY_RETRY_MAX;
+    }
+}
+
+static bool relay_pool_connect(struct relay_pool *pool, struct socket_poller *poller)
+{
+    union {
+        struct sockaddr addr;
+        struct sockaddr_in addr4;
+        struct sockaddr_in6 addr6;
+    } u_addr;
+    socklen_t addrlen;
+    memset(&u_addr, 0, sizeof(u_addr));
+    if (pool->addr.type == MOBILE_ADDRTYPE_IPV4) {
+        struct mobile_addr4 *addr4 = (struct mobile_addr4 *)&pool->addr;
+        u_addr.addr4.sin_family = AF_INET;
+        u_addr.addr4.sin_port = htons(addr4->port);
+        memcpy(&u_addr.addr4.sin_addr.s_addr, addr4->host,
+            sizeof(addr4->host));
+        addrlen = sizeof(u_addr.addr4);
+    } else {
+        struct mobile_addr6 *addr6 = (struct mobile_addr6 *)&pool->addr;
+        u_addr.addr6.sin6_family = AF_INET6;
+        u_addr.addr6.sin6_port = htons(addr6->port);
+        memcpy(&u_addr.addr6.sin6_addr.s6_addr, addr6->host,
+            sizeof(addr6->host));
+        addrlen = sizeof(u_addr.addr6);
+    }
+
+    SOCKET sock = socket(u_addr.addr.sa_family, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        socket_perror("socket");
+        return false;
+    }
+    if (socket_setblocking(sock, 0) == -1) {
+        socket_close(sock);
+        return false;
+    }
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+            (char *)&(int){1}, sizeof(int)) == SOCKET_ERROR) {
+        socket_perror("setsockopt");
+        socket_close(sock);
+        return false;
+    }
+    if (connect(sock, &u_addr.addr, addrlen) == SOCKET_ERROR) {
+        int err = socket_geterror();
+        if (err != SOCKET_EWOULDBLOCK && err != SOCKET_EINPROGRESS) {
+            socket_close(sock);
+            return false;
+        }
+    }
+    if (!socket_poller_add(poller, sock, &pool->ready)) {
+        socket_close(sock);
+        return false;
+    }
+    pool->sock = sock;
+    pool->ready = false;
+    pool->reply_size = 0;
+    return true;
+}
+
+// Read the relay's reply to the handshake, which only carries a token if it
+//   assigned a new one
+static int relay_pool_recv_reply(struct relay_pool *pool)
+{
+    while (pool->ready) {
+        unsigned size = 8;
+        if (pool->reply_size >= 8 && pool->reply[7] == 1) {
+            size = RELAY_HANDSHAKE_SIZE;
+        }
+        if (pool->reply_size >= size) return 1;
+
+        ssize_t len = recv(pool->sock, (char *)pool->reply + pool->reply_size,
+            size - pool->reply_size, 0);
+        if (len == SOCKET_ERROR) {
+            if (socket_geterror() == SOCKET_EWOULDBLOCK) {
+                pool->ready = false;
+                return 0;
+            }
+            return -1;
+        }
+        if (len == 0) return -1;
+        pool->reply_size += len;
+        if (pool->reply_size >= sizeof(relay_magic) &&
+                memcmp(pool->reply, relay_magic, sizeof(relay_magic)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Advance the connection being warmed up, once per loop iteration
+void relay_pool_loop(struct relay_pool *pool, struct socket_poller *poller)
+{
+    if (pool->addr.type == MOBILE_ADDRTYPE_NONE) return;
+    if (!pool->handshake_known || pool->taken >= 0) return;
+
+    uint64_t now = timer_host_ns();
+    uint64_t elapsed = now - pool->time;
+    int rc;
+    switch (pool->state) {
+    case RELAY_POOL_IDLE:
+        if (now < pool->time) return;
+        if (!relay_pool_connect(pool, poller)) {
+            relay_pool_fail(pool, poller, now);
+            return;
+        }
+        pool->state = RELAY_POOL_CONNECTING;
+        pool->time = now;
+        return;
+
+    case RELAY_POOL_CONNECTING:
+        rc = socket_isconnected(pool->sock);
+        if (rc == 0 && elapsed < (uint64_t)SOCKET_CONNECT_TIMEOUT * 1000000) {
+            return;
+        }
+        if (rc <= 0 || send(pool->sock, (char *)pool->handshake,
+                sizeof(pool->handshake), 0) != sizeof(pool->handshake)) {
+            relay_pool_fail(pool, poller, now);
+            return;
+        }
+        pool->state = RELAY_POOL_HANDSHAKE;
+        return;
+
+    case RELAY_POOL_HANDSHAKE:
+        rc = relay_pool_recv_reply(pool);
+        if (rc == 0 && elapsed < (uint64_t)SOCKET_CONNECT_TIMEOUT * 1000000) {
+            return;
+        }
+        if (rc <= 0) {
+            relay_pool_fail(pool, poller, now);
+            return;
+        }
+        pool->state = RELAY_POOL_WARM;
+        pool->time = now;
+        pool->retry_delay = RELAY_RETRY_MIN;
+        return;
+
+    case RELAY_POOL_WARM:
+        // The relay shouldn't send anything before a call is made, so the
+        //   connection has likely been closed. Replace it, as well as any
+        //   connection the relay may be about to time out.
+        if (pool->ready || elapsed >= (uint64_t)RELAY_MAX_AGE * 1000000) {
+            relay_pool_close(pool, poller);
+            pool->time = now;
+        }
+        return;
+    }
+}
+
+// Check if the connection must be advanced sooner than the poller would tell
+bool relay_pool_busy(struct relay_pool *pool)
+{
+    return pool->state == RELAY_POOL_CONNECTING;
+}
+
+// Check if an address is the relay server's
+bool relay_pool_match(struct relay_pool *pool, const struct mobile_addr *addr)
+{
+    if (!addr || addr->type != pool->addr.type) return false;
+    if (addr->type == MOBILE_ADDRTYPE_IPV4) {
+        const struct mobile_addr4 *a = (struct mobile_addr4 *)addr;
+        const struct mobile_addr4 *b = (struct mobile_addr4 *)&pool->addr;
+        return a->port == b->port &&
+            memcmp(a->host, b->host, sizeof(a->host)) == 0;
+    } else if (addr->type == MOBILE_ADDRTYPE_IPV6) {
+        const struct mobile_addr6 *a = (struct mobile_addr6 *)addr;
+        const struct mobile_addr6 *b = (struct mobile_addr6 *)&pool->addr;
+        return a->port == b->port &&
+            memcmp(a->host, b->host, sizeof(a->host)) == 0;
+    }
+    return false;
+}
+
+// Hand out the warm connection to a connection slot, if there's one
+// The socket is removed from the poller, and the pool stays idle until the
+//   connection slot is closed, see relay_pool_release().
+SOCKET relay_pool_take(struct relay_pool *pool, struct socket_poller *poller, unsigned conn)
+{
+    if (pool->state != RELAY_POOL_WARM || pool->claimed >= 0) {
+        return INVALID_SOCKET;
+    }
+    SOCKET sock = pool->sock;
+    socket_poller_del(poller, sock);
+    pool->sock = INVALID_SOCKET;
+    pool->ready = false;
+    pool->state = RELAY_POOL_IDLE;
+    pool->time = 0;
+    pool->claimed = conn;
+    pool->matched = 0;
+    pool->taken = conn;
+    __atomic_fetch_add(&pool->hits, 1, __ATOMIC_RELAXED);
+    return sock;
+}
+
+// Let the pool warm up the next connection once a slot holding the last one
+//   is closed
+void relay_pool_release(struct relay_pool *pool, unsigned conn)
+{
+    if (pool->claimed == (int)conn) pool->claimed = -1;
+    if (pool->taken == (int)conn) pool->taken = -1;
+}
+
+// Check data sent on a claimed connection against the handshake already sent
+// Returns 1 once the whole handshake matched, at which point the reply is
+//   ready to be received, 0 if more is expected, and -1 on a mismatch.
+int relay_pool_check(struct relay_pool *pool, const void *data, unsigned size)
+{
+    unsigned left = sizeof(pool->handshake) - pool->matched;
+    if (size > left ||
+            memcmp(pool->handshake + pool->matched, data, size) != 0) {
+        pool->claimed = -1;
+        return -1;
+    }
+    pool->matched += size;
+    if (pool->matched < sizeof(pool->handshake)) return 0;
+
+    pool->claimed = -1;
+    relay_pool_learn_reply(pool, pool->reply, pool->reply_size);
+    return 1;
+}
+
+// Remember the handshake the adapter sent on a connection of its own
+// Returns true if it carried no token, meaning one will be assigned in the
+//   reply.
+bool relay_pool_learn_handshake(struct relay_pool *pool, const void *data, unsigned size)
+{
+    const unsigned char *handshake = data;
+    if (size < 8 || memcmp(handshake, relay_magic, sizeof(relay_magic)) != 0) {
+        return false;
+    }
+    if (handshake[7] == 0) return true;
+    if (handshake[7] == 1 && size == RELAY_HANDSHAKE_SIZE) {
+        memcpy(pool->handshake, handshake, RELAY_HANDSHAKE_SIZE);
+        pool->handshake_known = true;
+    }
+    return false;
+}
+
+// Remember the token assigned by the relay, as the next handshake will carry
+//   it. The reply is laid out exactly like such a handshake.
+void relay_pool_learn_reply(struct relay_pool *pool, const void *data, unsigned size)
+{
+    const unsigned char *reply = data;
+    if (size < RELAY_HANDSHAKE_SIZE || reply[7] != 1) return;
+    if (memcmp(reply, relay_magic, sizeof(relay_magic)) != 0) return;
+    memcpy(pool->handshake, reply, RELAY_HANDSHAKE_SIZE);
+    pool->handshake_known = true;
+}
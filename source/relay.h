@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <mobile.h>
+
+#include "socket.h"
+
+// Size of the relay handshake carrying a token, and of the reply handing out
+//   a new one
+#define RELAY_HANDSHAKE_SIZE (8 + MOBILE_RELAY_TOKEN_SIZE)
+// Time between attempts at warming up a connection, in milliseconds
+#define RELAY_RETRY_MIN 1000
+#define RELAY_RETRY_MAX 60000
+// Time an unused connection is kept before it's replaced, in milliseconds
+#define RELAY_MAX_AGE 60000
+
+enum relay_pool_state {
+    RELAY_POOL_IDLE,
+    RELAY_POOL_CONNECTING,
+    RELAY_POOL_HANDSHAKE,
+    RELAY_POOL_WARM,
+};
+
+// Keeps a connection to the relay server open and authenticated ahead of
+//   time, to be handed to the adapter when it connects to the relay.
+// The handshake is the one the adapter sent last, so the connection is made
+//   with the same token it'd use, and the adapter's own handshake is checked
+//   against it and swallowed, the reply being served from the pool instead.
+// Only one connection is warmed up per call: once handed out, no other is
+//   made until the connection slot holding it has been closed.
+struct relay_pool {
+    struct mobile_addr addr;
+    enum relay_pool_state state;
+    SOCKET sock;
+    bool ready;
+    bool handshake_known;
+    unsigned char handshake[RELAY_HANDSHAKE_SIZE];
+    unsigned char reply[RELAY_HANDSHAKE_SIZE];
+    unsigned reply_size;
+    uint64_t time;
+    unsigned retry_delay;
+
+    // Connection slot the warm connection has been handed to, until the
+    //   adapter's handshake has been checked
+    int claimed;
+    unsigned matched;
+    // Connection slot holding the connection handed out last, until closed
+    int taken;
+
+    uint64_t hits;
+};
+
+void relay_pool_init(struct relay_pool *pool, const struct mobile_addr *addr, const unsigned char *token);
+void relay_pool_stop(struct relay_pool *pool, struct socket_poller *poller);
+bool relay_pool_attach(struct relay_pool *pool, struct socket_poller *poller);
+void relay_pool_detach(struct relay_pool *pool, struct socket_poller *poller);
+void relay_pool_loop(struct relay_pool *pool, struct socket_poller *poller);
+bool relay_pool_busy(struct relay_pool *pool);
+bool relay_pool_match(struct relay_pool *pool, const struct mobile_addr *addr);
+SOCKET relay_pool_take(struct relay_pool *pool, struct socket_poller *poller, unsigned conn);
+void relay_pool_release(struct relay_pool *pool, unsigned conn);
+int relay_pool_check(struct relay_pool *pool, const void *data, unsigned size);
+bool relay_pool_learn_handshake(struct relay_pool *pool, const void *data, unsigned size);
+void relay_pool_learn_reply(struct relay_pool *pool, const void *data, unsigned size);
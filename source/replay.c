@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "replay.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "record.h"
+#include "session.h"
+#include "socket.h"
+#include "timer.h"
+
+// Maximum amount of loop iterations spent letting the adapter catch up after
+//   every packet, when not replaying in real time.
+#define REPLAY_PUMP_MAX 0x100
+
+// Amount of mismatched packets that are printed before going quiet
+#define REPLAY_REPORT_MAX 10
+
+struct replay_state {
+    struct mobile_user *mobile;
+    struct socket_poller poller;
+    SOCKET sock;
+    bool realtime;
+    uint64_t start;
+    unsigned packets_recv;
+    unsigned packets_sent;
+    unsigned mismatches;
+    unsigned transfers;
+};
+
+static bool replay_step(struct replay_state *state, int delay)
+{
+    socket_poller_wait(&state->poller,
+        session_delay(state->mobile, delay));
+    return session_loop(state->mobile);
+}
+
+// Run the session until the provided point in time, or until it's idle
+static bool replay_pump(struct replay_state *state, uint64_t time)
+{
+    if (!state->realtime) {
+        // Give the adapter the chance to finish what it would've done in
+        //   between packets, without waiting on it.
+        if (!replay_step(state, 0)) return false;
+        for (unsigned i = 0; i < REPLAY_PUMP_MAX; i++) {
+            if (state->mobile->action == MOBILE_ACTION_NONE) break;
+            if (!replay_step(state, 0)) return false;
+        }
+        return true;
+    }
+
+    for (;;) {
+        uint64_t now = timer_host_ns() - state->start;
+        if (now >= time) break;
+        int delay = (time - now + 999999) / 1000000;
+        if (!replay_step(state, delay)) return false;
+    }
+    return replay_step(state, 0);
+}
+
+// Read the next packet the link sent, and compare it to the recorded one
+static bool replay_expect(struct replay_state *state, const unsigned char *data, uint64_t time)
+{
+    unsigned char buf[8];
+    unsigned size = 0;
+    bool retried = false;
+
+    while (size < sizeof(buf)) {
+        ssize_t num = recv(state->sock, (char *)buf + size,
+            sizeof(buf) - size, 0);
+        if (num == -1 && socket_geterror() == SOCKET_EWOULDBLOCK) {
+            if (retried) {
+                fprintf(stderr, "replay: Packet %u was never sent\n",
+                    state->packets_sent);
+                return false;
+            }
+            if (!replay_pump(state, time)) return false;
+            retried = true;
+            continue;
+        }
+        if (num <= 0) {
+            socket_perror("replay_expect");
+            return false;
+        }
+        size += num;
+    }
+
+    if (memcmp(buf, data, sizeof(buf)) != 0) {
+        if (state->mismatches++ < REPLAY_REPORT_MAX) {
+            fprintf(stderr, "replay: Packet %u mismatch: "
+                "expected %02X %02X %02X %02X; got %02X %02X %02X %02X\n",
+                state->packets_sent, data[0], data[1], data[2], data[3],
+                buf[0], buf[1], buf[2], buf[3]);
+        }
+    }
+    state->packets_sent++;
+    return true;
+}
+
+static bool replay_send(struct replay_state *state, const unsigned char *data, uint64_t time)
+{
+    ssize_t num = send(state->sock, (char *)data, 8, 0);
+    if (num != 8) {
+        socket_perror("replay_send");
+        return false;
+    }
+    state->packets_recv++;
+    return replay_pump(state, time);
+}
+
+// Feed a recorded emulator link through a fresh session, checking that the
+//   replies match the recording. The session is connected over a local socket
+//   pair, so only the adapter's own connections leave the machine.
+bool replay_run(const char *fname, const char *fname_config, const struct session_options *options, bool realtime)
+{
+    struct record record;
+    struct replay_state state = {
+        .mobile = NULL,
+        .sock = INVALID_SOCKET,
+        .realtime = realtime,
+    };
+    SOCKET pair[2] = {INVALID_SOCKET, INVALID_SOCKET};
+    bool poller_init = false;
+    bool ok = false;
+
+    if (!record_open(&record, fname, false)) return false;
+    if (!socket_poller_init(&state.poller)) goto error;
+    poller_init = true;
+    if (socket_pair(pair) == -1) goto error;
+    state.sock = pair[1];
+    if (socket_setblocking(state.sock, 0) == -1) goto error;
+
+    // The replies are expected as soon as the session has gone through its
+    //   loop, which is only the case when the link is handled by that loop
+    struct session_options replay_options = *options;
+    replay_options.link_thread = false;
+    state.mobile = session_new(fname_config, &replay_options);
+    if (!state.mobile) goto error;
+    if (!session_link(state.mobile, pair[0])) goto error;
+    pair[0] = INVALID_SOCKET;
+    if (!session_attach(state.mobile, &state.poller)) goto error;
+
+    struct record_entry entry;
+    uint64_t time = 0;
+    int rc;
+    state.start = timer_host_ns();
+    while ((rc = record_read(&record, &entry)) > 0) {
+        time += entry.time;
+        switch (entry.type) {
+        case RECORD_RECV:
+            if (!replay_send(&state, entry.data, time)) goto error;
+            break;
+        case RECORD_SEND:
+            if (!replay_expect(&state, entry.data, time)) goto error;
+            break;
+        case RECORD_TRANSFER:
+            state.transfers++;
+            break;
+        }
+    }
+    if (rc == -1) goto error;
+    ok = true;
+
+error:
+    if (state.mobile) {
+        double elapsed = (timer_host_ns() - state.start) / 1e9;
+        printf("packets_recv %u\n", state.packets_recv);
+        printf("packets_sent %u\n", state.packets_sent);
+        printf("mismatches %u\n", state.mismatches);
+        printf("transfers %u/%llu\n", state.transfers,
+            (unsigned long long)state.mobile->transfers);
+        printf("seconds %.6f\n", elapsed);
+        if (elapsed > 0) {
+            printf("transfers_per_second %.1f\n",
+                state.mobile->transfers / elapsed);
+        }
+        if (state.mismatches) ok = false;
+        session_free(state.mobile);
+    }
+    if (pair[0] != INVALID_SOCKET) socket_close(pair[0]);
+    if (pair[1] != INVALID_SOCKET) socket_close(pair[1]);
+    if (poller_init) socket_poller_deinit(&state.poller);
+    record_close(&record);
+    return ok;
+}
@@ -0,0 +1,8 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdbool.h>
+
+#include "session.h"
+
+bool replay_run(const char *fname, const char *fname_config, const struct session_options *options, bool realtime);
@@ -0,0 +1,968 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "session.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <wchar.h>
+
+#include <mobile.h>
+
+#include "bgblink.h"
+#include "config_file.h"
+#include "histogram.h"
+#include "log.h"
+#include "probe.h"
+#include "record.h"
+#include "socket.h"
+#include "socket_impl.h"
+#include "spsc.h"
+#include "thread.h"
+#include "timer.h"
+
+static const char *session_action_names[SESSION_ACTIONS] = {
+    "action_process_command_ns",
+    "action_drop_connection_ns",
+    "action_reset_ns",
+    "action_reset_serial_ns",
+    "action_change_32bit_mode_ns",
+    "action_write_config_ns",
+};
+
+#if LOG_LEVEL_MAX >= LOG_LEVEL_DEBUG
+static void impl_debug_log(void *user, const char *line)
+{
+    struct mobile_user *mobile = user;
+    log_debug(mobile->name, "%s", line);
+}
+#endif
+
+static bool impl_config_read(void *user, void *dest, const uintptr_t offset, const size_t size)
+{
+    struct mobile_user *mobile = user;
+    return config_file_read(&mobile->config, dest, offset, size);
+}
+
+static bool impl_config_write(void *user, const void *src, const uintptr_t offset, const size_t size)
+{
+    struct mobile_user *mobile = user;
+    return config_file_write(&mobile->config, src, offset, size);
+}
+
+// The emulator's clock, which may be updated by the link thread at any time
+static uint32_t session_bgb_clock(struct mobile_user *mobile)
+{
+    return __atomic_load_n(&mobile->bgb_clock, __ATOMIC_RELAXED);
+}
+
+static void impl_time_latch(void *user, unsigned timer)
+{
+    struct mobile_user *mobile = user;
+    timer_latch(&mobile->timers, timer, session_bgb_clock(mobile));
+}
+
+static bool impl_time_check_ms(void *user, unsigned timer, unsigned ms)
+{
+    struct mobile_user *mobile = user;
+    return timer_check(&mobile->timers, timer, session_bgb_clock(mobile), ms);
+}
+
+static bool impl_sock_open(void *user, unsigned conn, enum mobile_socktype type, enum mobile_addrtype addrtype, unsigned bindport)
+{
+    struct mobile_user *mobile = user;
+    bool ok = socket_impl_open(&mobile->socket, conn, type, addrtype, bindport);
+    PROBE(sock_open, mobile->id, conn, type, bindport, ok);
+    return ok;
+}
+
+static void impl_sock_close(void *user, unsigned conn)
+{
+    struct mobile_user *mobile = user;
+    socket_impl_close(&mobile->socket, conn);
+    PROBE(sock_close, mobile->id, conn);
+}
+
+static int impl_sock_connect(void *user, unsigned conn, const struct mobile_addr *addr)
+{
+    struct mobile_user *mobile = user;
+    int rc = socket_impl_connect(&mobile->socket, conn, addr);
+    PROBE(sock_connect, mobile->id, conn, rc);
+    return rc;
+}
+
+static bool impl_sock_listen(void *user, unsigned conn)
+{
+    struct mobile_user *mobile = user;
+    bool ok = socket_impl_listen(&mobile->socket, conn);
+    PROBE(sock_listen, mobile->id, conn, ok);
+    return ok;
+}
+
+static bool impl_sock_accept(void *user, unsigned conn)
+{
+    struct mobile_user *mobile = user;
+    bool ok = socket_impl_accept(&mobile->socket, conn);
+    PROBE(sock_accept, mobile->id, conn, ok);
+    return ok;
+}
+
+static int impl_sock_send(void *user, unsigned conn, const void *data, unsigned size, const struct mobile_addr *addr)
+{
+    struct mobile_user *mobile = user;
+    int rc = socket_impl_send(&mobile->socket, conn, data, size, addr);
+    PROBE(sock_send, mobile->id, conn, size, rc);
+    return rc;
+}
+
+static int impl_sock_recv(void *user, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
+{
+    struct mobile_user *mobile = user;
+    int rc = socket_impl_recv(&mobile->socket, conn, data, size, addr);
+    PROBE(sock_recv, mobile->id, conn, size, rc);
+    return rc;
+}
+
+static void update_title(struct mobile_user *mobile)
+{
+    wchar_t title[0x100];
+    size_t i = 0;
+
+    i += swprintf(title + i, (sizeof(title) / sizeof(*title)) - i,
+        L"Mobile Adapter - ");
+
+    if (mobile->number_peer[0]) {
+        i += swprintf(title + i, (sizeof(title) / sizeof(*title)) - i,
+            L"Call: %hs", mobile->number_peer);
+    } else {
+        i += swprintf(title + i, (sizeof(title) / sizeof(*title)) - i,
+            L"Disconnected");
+    }
+
+    if (mobile->number_user[0]) {
+        i += swprintf(title + i, (sizeof(title) / sizeof(*title)) - i,
+            L" (Your number: %hs)", mobile->number_user);
+    }
+
+#if defined(__unix__)
+    printf("\e]0;%ls\a", title);
+    fflush(stdout);
+#elif defined(_WIN32)
+    SetConsoleTitleW(title);
+#endif
+}
+
+static void impl_update_number(void *user, enum mobile_number type, const char *number)
+{
+    struct mobile_user *mobile = user;
+
+    char *dest = NULL;
+    switch (type) {
+        case MOBILE_NUMBER_USER: dest = mobile->number_user; break;
+        case MOBILE_NUMBER_PEER: dest = mobile->number_peer; break;
+        default: assert(false); return;
+    }
+
+    if (number) {
+        strncpy(dest, number, MOBILE_MAX_NUMBER_SIZE);
+        dest[MOBILE_MAX_NUMBER_SIZE] = '\0';
+    } else {
+        dest[0] = '\0';
+    }
+
+    if (mobile->title) update_title(mobile);
+}
+
+// Keep the link thread out of mobile_transfer(), see struct session_thread
+static void session_adapter_lock(struct mobile_user *mobile)
+{
+    if (mobile->thread) thread_mutex_lock(&mobile->thread->adapter_lock);
+}
+
+static void session_adapter_unlock(struct mobile_user *mobile)
+{
+    if (mobile->thread) thread_mutex_unlock(&mobile->thread->adapter_lock);
+}
+
+static enum mobile_action filter_actions(enum mobile_action actions)
+{
+    // Filter out the actions that aren't relevant to this emulator
+    return actions & ~MOBILE_ACTION_RESET_SERIAL;
+}
+
+static bool mobile_handle_loop(struct mobile_user *mobile)
+{
+    // Reset the adapter if requested
+    if (__atomic_exchange_n(&mobile->reset, false, __ATOMIC_ACQUIRE)) {
+        session_adapter_lock(mobile);
+        mobile_stop(mobile->adapter);
+        mobile_start(mobile->adapter);
+        session_adapter_unlock(mobile);
+    }
+
+    // Fetch action if none exists
+    if (mobile->action == MOBILE_ACTION_NONE) {
+        mobile->action =
+            filter_actions(mobile_actions_get(mobile->adapter));
+    }
+
+    // Process action
+    if (mobile->action != MOBILE_ACTION_NONE) {
+        PROBE(action_start, mobile->id, mobile->action);
+        uint64_t start = timer_host_ns();
+        mobile_actions_process(mobile->adapter, mobile->action);
+        uint64_t time = timer_host_ns() - start;
+        PROBE(action_done, mobile->id, mobile->action, time);
+
+        // Write the configuration out as soon as the adapter saves it
+        if ((mobile->action & MOBILE_ACTION_WRITE_CONFIG) &&
+                mobile->config.dirty) {
+            config_file_flush(&mobile->config);
+        }
+
+        // When several actions are processed at once, each gets the time
+        for (unsigned i = 0; i < SESSION_ACTIONS; i++) {
+            if (!(mobile->action & (1 << i))) continue;
+            histogram_record(&mobile->hist_actions[i], time);
+        }
+
+        // Fetch next action
+        mobile->action =
+            filter_actions(mobile_actions_get(mobile->adapter));
+    }
+    return true;
+}
+
+// Have the link thread wake up the session's thread, once it's done with the
+//   packets it has received
+static void session_notify(struct mobile_user *mobile)
+{
+    mobile->thread->notify_wanted = true;
+}
+
+// Account for a serial transfer, on the session's thread
+static void session_transfer_done(struct mobile_user *mobile, const struct session_transfer *transfer)
+{
+    command_decoder_transfer(&mobile->commands, transfer->c, transfer->r,
+        transfer->start);
+    histogram_record(&mobile->hist_transfer, transfer->time);
+    if (transfer->turnaround) {
+        histogram_record(&mobile->hist_turnaround, transfer->turnaround);
+    }
+    __atomic_fetch_add(&mobile->transfers, 1, __ATOMIC_RELAXED);
+}
+
+// Transfer a byte over the serial port, from whichever thread drives the link
+static unsigned char session_serial(struct mobile_user *mobile, unsigned char c, uint64_t turnaround)
+{
+    struct session_transfer transfer = {.c = c, .turnaround = turnaround};
+    PROBE(transfer_start, mobile->id, c);
+    session_adapter_lock(mobile);
+    transfer.start = timer_host_ns();
+    transfer.r = mobile_transfer(mobile->adapter, c);
+    transfer.time = timer_host_ns() - transfer.start;
+    session_adapter_unlock(mobile);
+    PROBE(transfer_done, mobile->id, c, transfer.r, transfer.time);
+    if (mobile->record) {
+        record_write(mobile->record, RECORD_TRANSFER,
+            (unsigned char []){c, transfer.r});
+    }
+
+    // The transfer belongs to the session's thread, which must also pick up
+    //   whatever the adapter has to do after this byte
+    if (mobile->thread) {
+        if (!spsc_push(&mobile->thread->transfers, &transfer)) {
+            __atomic_fetch_add(&mobile->thread->dropped, 1, __ATOMIC_RELAXED);
+        }
+        session_notify(mobile);
+    } else {
+        session_transfer_done(mobile, &transfer);
+    }
+    return transfer.r;
+}
+
+static unsigned char bgb_loop_transfer(void *user, unsigned char c)
+{
+    struct mobile_user *mobile = user;
+    return session_serial(mobile, c, mobile->bgb.turnaround);
+}
+
+static void bgb_loop_timestamp(void *user, uint32_t t)
+{
+    // Update the timestamp sent by the emulator
+    struct mobile_user *mobile = user;
+    t += mobile->bgb_clock_offset;
+
+    // Bail if the time difference is too big. This happens whenever the
+    //   emulator is reset, a new game is loaded, or a save state is loaded.
+    uint32_t diff = (t - session_bgb_clock(mobile)) & 0x7FFFFFFF;
+    if (diff > 0x1000) {
+        log_info(mobile->name, "[BGB] Emulator reset detected! Resetting adapter");
+        PROBE(reset, mobile->id, session_bgb_clock(mobile), t);
+        __atomic_store_n(&mobile->reset, true, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&mobile->resets, 1, __ATOMIC_RELAXED);
+        if (mobile->thread) session_notify(mobile);
+    }
+
+    __atomic_store_n(&mobile->bgb_clock, t, __ATOMIC_RELAXED);
+}
+
+static void bgb_loop_timestamp_init(void *user, uint32_t t)
+{
+    struct mobile_user *mobile = user;
+
+    // Initialize the clock, the adapter being started once it's known
+    __atomic_store_n(&mobile->bgb_clock, t, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&mobile->started, __ATOMIC_ACQUIRE)) {
+        mobile->bgb.callback_timestamp = bgb_loop_timestamp;
+        return;
+    }
+    bool init = __atomic_exchange_n(&mobile->bgb_clock_init, true,
+        __ATOMIC_RELEASE);
+    if (!init && mobile->thread) session_notify(mobile);
+}
+
+static void bgb_loop_timestamp_relink(void *user, uint32_t t)
+{
+    struct mobile_user *mobile = user;
+
+    // After reconnecting, carry on from where the clock was left, as the
+    //   adapter's timers were latched against it
+    mobile->bgb_clock_offset = session_bgb_clock(mobile) - t;
+    mobile->bgb.callback_timestamp = bgb_loop_timestamp;
+}
+
+static struct session_thread *session_thread_new(void)
+{
+    struct session_thread *thread = malloc(sizeof(struct session_thread));
+    if (!thread) {
+        perror("malloc");
+        return NULL;
+    }
+    thread->running = false;
+    thread->wake_ready = false;
+    thread->notify_ready = false;
+    thread->notify_wanted = false;
+    thread->notify_pending = false;
+    thread->stop = false;
+    thread->closed = false;
+    thread->dropped = 0;
+
+    if (!socket_poller_init(&thread->poller)) goto error;
+    if (!socket_wake_init(thread->wake)) goto error_poller;
+    if (!socket_poller_add(&thread->poller, thread->wake[1],
+            &thread->wake_ready)) {
+        goto error_wake;
+    }
+    if (!socket_wake_init(thread->notify)) goto error_wake;
+    if (!spsc_init(&thread->transfers, SESSION_THREAD_TRANSFERS,
+            sizeof(struct session_transfer))) {
+        goto error_notify;
+    }
+    thread_mutex_init(&thread->adapter_lock);
+    return thread;
+
+error_notify:
+    socket_wake_deinit(thread->notify);
+error_wake:
+    socket_wake_deinit(thread->wake);
+error_poller:
+    socket_poller_deinit(&thread->poller);
+error:
+    free(thread);
+    return NULL;
+}
+
+// Wait for the link thread to end, if it's running
+static void session_thread_stop(struct mobile_user *mobile)
+{
+    struct session_thread *thread = mobile->thread;
+    if (!thread->running) return;
+    __atomic_store_n(&thread->stop, true, __ATOMIC_RELEASE);
+    socket_wake(thread->wake);
+    thread_join(thread->thread);
+    thread->running = false;
+}
+
+static void session_thread_free(struct mobile_user *mobile)
+{
+    struct session_thread *thread = mobile->thread;
+    thread_mutex_destroy(&thread->adapter_lock);
+    spsc_deinit(&thread->transfers);
+    socket_wake_deinit(thread->notify);
+    socket_wake_deinit(thread->wake);
+    socket_poller_deinit(&thread->poller);
+    free(thread);
+    mobile->thread = NULL;
+    mobile->link_poller = NULL;
+}
+
+// Create an adapter, backed by the provided configuration file
+struct mobile_user *session_new(const char *fname_config, const struct session_options *options)
+{
+    struct mobile_user *mobile = NULL;
+    bool config_open = false;
+
+    // Initialize main data structure
+    mobile = malloc(sizeof(struct mobile_user));
+    if (!mobile) {
+        perror("malloc");
+        goto error;
+    }
+
+    mobile->adapter = NULL;
+    mobile->bgb_sock = INVALID_SOCKET;
+    mobile->shm = false;
+    shmlink_init(&mobile->shmlink);
+    mobile->shm_pending = false;
+    mobile->link_byte = MOBILE_SERIAL_IDLE_BYTE;
+    mobile->poller = NULL;
+    mobile->link_poller = NULL;
+    mobile->thread = NULL;
+    mobile->action = MOBILE_ACTION_NONE;
+    mobile->record = NULL;
+    mobile->name[0] = '\0';
+    mobile->id = 0;
+    mobile->transfers = 0;
+    mobile->resets = 0;
+    mobile->reconnects = 0;
+    mobile->connector = NULL;
+    mobile->reconnect_time = 0;
+    mobile->reconnect_delay = SESSION_RECONNECT_MIN;
+    mobile->title = false;
+    mobile->started = false;
+    mobile->reset = false;
+    mobile->bgb_clock = 0;
+    mobile->bgb_clock_init = false;
+    mobile->title_stale = false;
+    mobile->bgb_clock_offset = 0;
+    timer_init(&mobile->timers);
+    mobile->number_user[0] = '\0';
+    mobile->number_peer[0] = '\0';
+    memset(&mobile->bgb.stats, 0, sizeof(mobile->bgb.stats));
+    histogram_init(&mobile->hist_turnaround);
+    histogram_init(&mobile->hist_transfer);
+    command_decoder_init(&mobile->commands);
+    for (unsigned i = 0; i < SESSION_ACTIONS; i++) {
+        histogram_init(&mobile->hist_actions[i]);
+    }
+    socket_impl_init(&mobile->socket, NULL);
+    mobile->socket.send_buffering = options->send_buffering;
+    mobile->socket.pcap = options->pcap;
+    mobile->socket.dns = options->dns;
+    mobile->socket.dns_servers[0] = options->dns1;
+    mobile->socket.dns_servers[1] = options->dns2;
+    if (options->relay_pool) {
+        relay_pool_init(&mobile->socket.relay, &options->relay,
+            options->relay_token_update ? options->relay_token : NULL);
+    }
+
+    if (options->link_thread) {
+        mobile->thread = session_thread_new();
+        if (!mobile->thread) goto error;
+        mobile->link_poller = &mobile->thread->poller;
+    }
+
+    // Open or create configuration, at least CONFIG_SIZE bytes big
+    // With a database, the config's name is the key of its slot.
+    if (options->config_db) {
+        if (!config_file_open_db(&mobile->config, options->config_db,
+                fname_config, MOBILE_CONFIG_SIZE)) {
+            goto error;
+        }
+    } else if (!config_file_open(&mobile->config, fname_config,
+            MOBILE_CONFIG_SIZE)) {
+        goto error;
+    }
+    config_open = true;
+
+    // Initialize mobile library
+    mobile->adapter = mobile_new(mobile);
+    if (!mobile->adapter) {
+        perror("mobile_new");
+        goto error;
+    }
+#if LOG_LEVEL_MAX >= LOG_LEVEL_DEBUG
+    mobile_def_debug_log(mobile->adapter, impl_debug_log);
+#endif
+    mobile_def_config_read(mobile->adapter, impl_config_read);
+    mobile_def_config_write(mobile->adapter, impl_config_write);
+    mobile_def_time_latch(mobile->adapter, impl_time_latch);
+    mobile_def_time_check_ms(mobile->adapter, impl_time_check_ms);
+    mobile_def_sock_open(mobile->adapter, impl_sock_open);
+    mobile_def_sock_close(mobile->adapter, impl_sock_close);
+    mobile_def_sock_connect(mobile->adapter, impl_sock_connect);
+    mobile_def_sock_listen(mobile->adapter, impl_sock_listen);
+    mobile_def_sock_accept(mobile->adapter, impl_sock_accept);
+    mobile_def_sock_send(mobile->adapter, impl_sock_send);
+    mobile_def_sock_recv(mobile->adapter, impl_sock_recv);
+    mobile_def_update_number(mobile->adapter, impl_update_number);
+
+    mobile_config_load(mobile->adapter);
+    mobile_config_set_device(mobile->adapter, options->device,
+        options->device_unmetered);
+    mobile_config_set_dns(mobile->adapter, &options->dns1, MOBILE_DNS1);
+    mobile_config_set_dns(mobile->adapter, &options->dns2, MOBILE_DNS2);
+    mobile_config_set_p2p_port(mobile->adapter, options->p2p_port);
+    mobile_config_set_relay(mobile->adapter, &options->relay);
+    if (options->relay_token_update) {
+        mobile_config_set_relay_token(mobile->adapter, options->relay_token);
+    }
+    mobile_config_save(mobile->adapter);
+    if (mobile->config.dirty && !config_file_flush(&mobile->config)) {
+        goto error;
+    }
+
+    return mobile;
+
+error:
+    if (mobile) {
+        if (mobile->thread) session_thread_free(mobile);
+        if (config_open) config_file_close(&mobile->config);
+        free(mobile->adapter);
+        free(mobile);
+    }
+    return NULL;
+}
+
+void session_free(struct mobile_user *mobile)
+{
+    // Stop talking to the emulator before stopping the adapter
+    if (mobile->thread) session_thread_stop(mobile);
+    if (mobile->started) mobile_stop(mobile->adapter);
+
+    // Close all sockets
+    if (mobile->poller) session_detach(mobile);
+    if (mobile->thread) session_thread_free(mobile);
+    socket_impl_stop(&mobile->socket);
+    if (mobile->bgb_sock != INVALID_SOCKET) socket_close(mobile->bgb_sock);
+    shmlink_close(&mobile->shmlink);
+
+    if (mobile->record) {
+        record_close(mobile->record);
+        free(mobile->record);
+    }
+    if (mobile->connector) {
+        socket_connector_deinit(mobile->connector);
+        free(mobile->connector);
+    }
+    free(mobile->adapter);
+    config_file_close(&mobile->config);
+    free(mobile);
+}
+
+// Log the emulator link to a file, must be called before session_link()
+bool session_record(struct mobile_user *mobile, const char *fname)
+{
+    mobile->record = malloc(sizeof(struct record));
+    if (!mobile->record) {
+        perror("malloc");
+        return false;
+    }
+    if (!record_open(mobile->record, fname, true)) {
+        free(mobile->record);
+        mobile->record = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Reconnect to the emulator whenever the link drops, instead of ending
+// The adapter and its connections are kept around while reconnecting.
+bool session_reconnect(struct mobile_user *mobile, const char *host, const char *port)
+{
+    mobile->connector = malloc(sizeof(struct socket_connector));
+    if (!mobile->connector) {
+        perror("malloc");
+        return false;
+    }
+    if (!socket_connector_init(mobile->connector, host, port)) {
+        free(mobile->connector);
+        mobile->connector = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Start the BGB handshake over the emulator link
+// The adapter is started once the emulator's clock is known
+static bool session_link_bgb(struct mobile_user *mobile)
+{
+    mobile->bgb.record = mobile->record;
+    mobile->bgb.timed = true;
+    bool started = __atomic_load_n(&mobile->started, __ATOMIC_ACQUIRE);
+    if (!bgb_init(&mobile->bgb, mobile->bgb_sock, mobile->link_byte,
+            bgb_loop_transfer,
+            started ? bgb_loop_timestamp_relink : bgb_loop_timestamp_init,
+            mobile)) {
+        return false;
+    }
+
+    // The title is updated by the session's thread, which owns the numbers
+    __atomic_store_n(&mobile->title_stale, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Attach a connected emulator socket to the session, taking ownership of it
+bool session_link(struct mobile_user *mobile, SOCKET sock)
+{
+    mobile->bgb_sock = sock;
+
+    // Local sockets, such as the ones used for replays, don't do any batching
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getsockname(sock, (struct sockaddr *)&addr, &addrlen) == SOCKET_ERROR) {
+        socket_perror("getsockname");
+        return false;
+    }
+    if (addr.ss_family != AF_UNIX && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+            (void *)&(int){1}, sizeof(int)) == SOCKET_ERROR) {
+        socket_perror("setsockopt");
+        return false;
+    }
+
+    // The packets go through shared memory if the emulator hands it over
+    // Its reply is waited on by session_link_step(), like the handshake.
+    mobile->bgb.shm = NULL;
+    mobile->bgb.want_disconnect = false;
+    if (mobile->shm) {
+        if (socket_setblocking(sock, 0) == -1) return false;
+        if (!shmlink_request(&mobile->shmlink, sock)) return false;
+        mobile->shm_pending = true;
+        return true;
+    }
+    return session_link_bgb(mobile);
+}
+
+// Wait on the emulator link, and the shared memory link's eventfd if any
+static bool session_link_attach(struct mobile_user *mobile)
+{
+    if (!socket_poller_add(mobile->link_poller, mobile->bgb_sock,
+            &mobile->bgb.ready)) {
+        return false;
+    }
+    if (!shmlink_attach(&mobile->shmlink, mobile->link_poller,
+            &mobile->bgb.shm_ready)) {
+        socket_poller_del(mobile->link_poller, mobile->bgb_sock);
+        return false;
+    }
+
+    // Anything could've arrived while the link wasn't being waited on
+    mobile->bgb.ready = true;
+    return true;
+}
+
+static void session_link_detach(struct mobile_user *mobile)
+{
+    socket_poller_del(mobile->link_poller, mobile->bgb_sock);
+    shmlink_detach(&mobile->shmlink, mobile->link_poller);
+}
+
+// Drop the emulator link, to be reconnected by session_relink()
+static void session_unlink(struct mobile_user *mobile)
+{
+    log_info(mobile->name, "[BGB] Emulator disconnected, reconnecting");
+
+    if (mobile->link_poller) session_link_detach(mobile);
+    shmlink_close(&mobile->shmlink);
+    socket_close(mobile->bgb_sock);
+    mobile->bgb_sock = INVALID_SOCKET;
+    mobile->bgb.ready = false;
+
+    // The adapter's reply to the next serial transfer is still pending
+    if (!mobile->shm_pending) mobile->link_byte = mobile->bgb.byte;
+    mobile->shm_pending = false;
+    mobile->reconnect_time = timer_host_ns();
+    mobile->reconnect_delay = SESSION_RECONNECT_MIN;
+    socket_connector_start(mobile->connector);
+}
+
+// Make progress on reconnecting to the emulator, backing off on failure
+static bool session_relink(struct mobile_user *mobile)
+{
+    uint64_t now = timer_host_ns();
+    if (now < mobile->reconnect_time) return true;
+
+    SOCKET sock;
+    int rc = socket_connector_step(mobile->connector, &sock);
+    if (rc == 0) return true;
+    if (rc == -1) {
+        mobile->reconnect_time = now +
+            (uint64_t)mobile->reconnect_delay * 1000000;
+        mobile->reconnect_delay *= 2;
+        if (mobile->reconnect_delay > SESSION_RECONNECT_MAX) {
+            mobile->reconnect_delay = SESSION_RECONNECT_MAX;
+        }
+        socket_connector_start(mobile->connector);
+        return true;
+    }
+
+    if (!session_link(mobile, sock)) return false;
+    if (mobile->link_poller && !session_link_attach(mobile)) return false;
+    __atomic_fetch_add(&mobile->reconnects, 1, __ATOMIC_RELAXED);
+    log_info(mobile->name, "[BGB] Emulator reconnected");
+    if (mobile->thread) session_notify(mobile);
+    return true;
+}
+
+// Exchange packets with the emulator, once it's handed over the shared memory
+static bool session_link_step(struct mobile_user *mobile)
+{
+    if (mobile->shm_pending) {
+        int rc = shmlink_step(&mobile->shmlink, mobile->bgb_sock);
+        if (rc == 0) return true;
+        if (rc == -1) return false;
+        mobile->shm_pending = false;
+        mobile->bgb.shm = &mobile->shmlink;
+        if (!session_link_bgb(mobile)) return false;
+        if (mobile->link_poller && !shmlink_attach(&mobile->shmlink,
+                mobile->link_poller, &mobile->bgb.shm_ready)) {
+            return false;
+        }
+
+        // Packets the emulator queued before now weren't signalled, so
+        //   they're read right away
+    }
+    return bgb_loop(&mobile->bgb);
+}
+
+// Exchange packets with the emulator, reconnecting to it if enabled
+static bool session_link_loop(struct mobile_user *mobile)
+{
+    if (mobile->bgb_sock == INVALID_SOCKET) {
+        if (mobile->connector && !session_relink(mobile)) return false;
+    } else if (!session_link_step(mobile)) {
+        if (!mobile->connector || mobile->bgb.want_disconnect) return false;
+        session_unlink(mobile);
+    }
+    return true;
+}
+
+// Calculate how long the emulator link may be left alone for
+static int session_link_delay(struct mobile_user *mobile, int delay)
+{
+    // The shared memory is waited on until the emulator's reply times out
+    if (mobile->bgb_sock != INVALID_SOCKET && mobile->shm_pending) {
+        return shmlink_delay(&mobile->shmlink, delay);
+    }
+
+    // Replies the emulator hasn't taken yet are retried
+    if (mobile->bgb_sock != INVALID_SOCKET && bgb_pending(&mobile->bgb)) {
+        if (delay < 0 || delay > BGB_SEND_RETRY) delay = BGB_SEND_RETRY;
+    }
+
+    // Connection attempts are checked on every iteration
+    if (mobile->bgb_sock == INVALID_SOCKET && mobile->connector) {
+        uint64_t now = timer_host_ns();
+        int left = SESSION_WAIT_CONNECT;
+        if (mobile->reconnect_time > now) {
+            left = (mobile->reconnect_time - now + 999999) / 1000000;
+        }
+        if (delay < 0 || left < delay) delay = left;
+    }
+    return delay;
+}
+
+// Only the first notification since the session's thread last woke up is sent
+static void session_thread_notify(struct session_thread *thread)
+{
+    if (!thread->notify_wanted) return;
+    thread->notify_wanted = false;
+    if (__atomic_exchange_n(&thread->notify_pending, true, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    socket_wake(thread->notify);
+}
+
+static void session_thread_run(void *arg)
+{
+    struct mobile_user *mobile = arg;
+    struct session_thread *thread = mobile->thread;
+
+    while (!__atomic_load_n(&thread->stop, __ATOMIC_ACQUIRE)) {
+        if (thread->wake_ready) {
+            socket_wake_drain(thread->wake, &thread->wake_ready);
+        }
+        if (!session_link_loop(mobile)) {
+            __atomic_store_n(&thread->closed, true, __ATOMIC_RELEASE);
+            session_notify(mobile);
+            session_thread_notify(thread);
+            return;
+        }
+        session_thread_notify(thread);
+        socket_poller_wait(&thread->poller, session_link_delay(mobile, -1));
+    }
+}
+
+static bool session_thread_start(struct mobile_user *mobile)
+{
+    struct session_thread *thread = mobile->thread;
+    if (mobile->bgb_sock != INVALID_SOCKET && !session_link_attach(mobile)) {
+        return false;
+    }
+    if (!thread_create(&thread->thread, session_thread_run, mobile)) {
+        if (mobile->bgb_sock != INVALID_SOCKET) session_link_detach(mobile);
+        return false;
+    }
+    thread->running = true;
+    return true;
+}
+
+// Start waiting on the session's sockets through a poller
+// A session may only be handled by one thread at a time, the one waiting on
+//   its poller. It may be moved between pollers while no action is pending.
+// The link thread is started the first time the session is attached.
+bool session_attach(struct mobile_user *mobile, struct socket_poller *poller)
+{
+    mobile->poller = poller;
+    if (mobile->thread) {
+        struct session_thread *thread = mobile->thread;
+        if (!socket_poller_add(poller, thread->notify[1],
+                &thread->notify_ready)) {
+            mobile->poller = NULL;
+            return false;
+        }
+        thread->notify_ready = true;
+    } else {
+        mobile->link_poller = poller;
+        if (mobile->bgb_sock != INVALID_SOCKET &&
+                !session_link_attach(mobile)) {
+            mobile->poller = NULL;
+            mobile->link_poller = NULL;
+            return false;
+        }
+    }
+    if (!socket_impl_attach(&mobile->socket, poller)) {
+        session_detach(mobile);
+        return false;
+    }
+    if (mobile->thread && !mobile->thread->running &&
+            !session_thread_start(mobile)) {
+        session_detach(mobile);
+        return false;
+    }
+    return true;
+}
+
+void session_detach(struct mobile_user *mobile)
+{
+    socket_impl_detach(&mobile->socket);
+    if (mobile->thread) {
+        socket_poller_del(mobile->poller, mobile->thread->notify[1]);
+    } else {
+        if (mobile->bgb_sock != INVALID_SOCKET) session_link_detach(mobile);
+        mobile->link_poller = NULL;
+    }
+    mobile->poller = NULL;
+}
+
+// Pick up what the link thread handed over since the last iteration
+// Returns false once the link thread has ended.
+static bool session_thread_loop(struct mobile_user *mobile)
+{
+    struct session_thread *thread = mobile->thread;
+    if (thread->notify_ready) {
+        socket_wake_drain(thread->notify, &thread->notify_ready);
+    }
+
+    // Anything handed over after this point wakes this thread up again
+    __atomic_store_n(&thread->notify_pending, false, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    struct session_transfer transfer;
+    while (spsc_pop(&thread->transfers, &transfer)) {
+        session_transfer_done(mobile, &transfer);
+    }
+    __atomic_fetch_add(&mobile->transfers,
+        __atomic_exchange_n(&thread->dropped, 0, __ATOMIC_RELAXED),
+        __ATOMIC_RELAXED);
+    return !__atomic_load_n(&thread->closed, __ATOMIC_ACQUIRE);
+}
+
+// Handle everything the emulator and adapter need, without blocking
+bool session_loop(struct mobile_user *mobile)
+{
+    if (mobile->thread) {
+        if (!session_thread_loop(mobile)) return false;
+    } else if (!session_link_loop(mobile)) {
+        return false;
+    }
+
+    if (__atomic_exchange_n(&mobile->title_stale, false, __ATOMIC_ACQUIRE) &&
+            mobile->title) {
+        update_title(mobile);
+    }
+
+    if (!mobile->started) {
+        // Wait for the timestamp to be initialized
+        if (!__atomic_load_n(&mobile->bgb_clock_init, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+
+        // Start main mobile thread
+        session_adapter_lock(mobile);
+        mobile_start(mobile->adapter);
+        session_adapter_unlock(mobile);
+        __atomic_store_n(&mobile->started, true, __ATOMIC_RELEASE);
+    }
+
+    config_file_loop(&mobile->config);
+    bool ok = mobile_handle_loop(mobile);
+
+    // Everything the adapter sent during this iteration goes out at once
+    socket_impl_flush(&mobile->socket);
+
+    // Keep a relay connection ready for the next call
+    relay_pool_loop(&mobile->socket.relay, mobile->poller);
+    return ok;
+}
+
+// Update the emulator's clock, for sessions driven in-process instead of
+//   through an emulator link
+// Such emulators don't run into clock jumps, and call session_reset() instead.
+void session_clock(struct mobile_user *mobile, uint32_t t)
+{
+    __atomic_store_n(&mobile->bgb_clock, t, __ATOMIC_RELAXED);
+    __atomic_store_n(&mobile->bgb_clock_init, true, __ATOMIC_RELEASE);
+}
+
+// Reset the adapter along with the emulator
+void session_reset(struct mobile_user *mobile)
+{
+    __atomic_store_n(&mobile->reset, true, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&mobile->resets, 1, __ATOMIC_RELAXED);
+}
+
+// Transfer a byte over the serial port of a session driven in-process
+unsigned char session_transfer(struct mobile_user *mobile, unsigned char c)
+{
+    return session_serial(mobile, c, 0);
+}
+
+// Calculate how long the session may sleep for, capped at the provided delay
+int session_delay(struct mobile_user *mobile, int delay)
+{
+    delay = config_file_delay(&mobile->config, delay);
+    if (!mobile->thread) delay = session_link_delay(mobile, delay);
+    if (!mobile->started) return delay;
+    // The poller doesn't tell when sockets may be written to again
+    if (mobile->action != MOBILE_ACTION_NONE ||
+            socket_impl_pending(&mobile->socket) ||
+            relay_pool_busy(&mobile->socket.relay)) {
+        if (delay < 0 || delay > SESSION_WAIT_BUSY) delay = SESSION_WAIT_BUSY;
+    }
+    return timer_next(&mobile->timers, session_bgb_clock(mobile), delay);
+}
+
+// Print the latency histograms of the session
+void session_dump(struct mobile_user *mobile, FILE *stream)
+{
+    const char *scope = mobile->name[0] ? mobile->name : "session";
+    histogram_print(stream, scope, "turnaround_ns", &mobile->hist_turnaround);
+    histogram_print(stream, scope, "transfer_ns", &mobile->hist_transfer);
+    for (unsigned i = 0; i < SESSION_ACTIONS; i++) {
+        histogram_print(stream, scope, session_action_names[i],
+            &mobile->hist_actions[i]);
+    }
+    command_decoder_print(stream, scope, &mobile->commands);
+}
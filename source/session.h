@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <mobile.h>
+
+#include "bgblink.h"
+#include "command.h"
+#include "config_file.h"
+#include "histogram.h"
+#include "record.h"
+#include "shmlink.h"
+#include "socket.h"
+#include "socket_impl.h"
+#include "spsc.h"
+#include "thread.h"
+#include "timer.h"
+
+// Maximum time to sleep for while an action is being processed
+#define SESSION_WAIT_BUSY 100
+// Maximum time to sleep for while the adapter is idle
+#define SESSION_WAIT_IDLE 1000
+
+// Time between attempts to reconnect to the emulator, doubling each time
+#define SESSION_RECONNECT_MIN 100
+#define SESSION_RECONNECT_MAX 5000
+// Maximum time to sleep for while connecting to the emulator
+#define SESSION_WAIT_CONNECT 10
+
+// Maximum length of a session's name, used to tag its log output
+#define SESSION_NAME_SIZE 0x40
+
+// Serial transfers the link thread may be ahead of the session's thread by,
+//   before their timings are dropped. A power of two.
+#define SESSION_THREAD_TRANSFERS 4096
+
+// Amount of adapter actions timed separately, one per bit of mobile_action
+#define SESSION_ACTIONS 6
+
+// Adapter settings applied to every session when it's created
+struct session_options {
+    enum mobile_adapter_device device;
+    bool device_unmetered;
+    struct mobile_addr dns1;
+    struct mobile_addr dns2;
+    unsigned p2p_port;
+    struct mobile_addr relay;
+    bool relay_token_update;
+    unsigned char *relay_token;
+    struct config_db *config_db;
+    struct dns *dns;
+    bool send_buffering;
+    bool relay_pool;
+    bool reconnect;
+    bool link_thread;
+    struct pcap *pcap;
+};
+
+// A serial transfer, as handed over by the link thread
+struct session_transfer {
+    uint64_t start;  // When it began, in ns of timer_host_ns()
+    uint64_t time;  // Time taken by the adapter, in ns
+    uint64_t turnaround;  // Time the emulator waited on the reply, 0 if none
+    unsigned char c;
+    unsigned char r;
+};
+
+// Thread answering the emulator on its own, so the adapter's actions and
+//   connections, handled by the session's thread, never hold up a reply
+// The link thread owns the emulator link, and hands serial transfers over
+//   through a ring, after which it wakes up the session's thread through a
+//   socket, at most once until that thread has caught up. Everything else
+//   about the transfers, like the counters and the decoded commands, is only
+//   touched by the session's thread.
+// libmobile doesn't allow starting or stopping the adapter while a byte is
+//   being transferred, which the lock keeps from overlapping.
+struct session_thread {
+    thread_t thread;
+    bool running;
+    struct socket_poller poller;
+    SOCKET wake[2];  // Wakes up the link thread
+    bool wake_ready;
+    SOCKET notify[2];  // Wakes up the session's thread
+    bool notify_ready;
+    bool notify_wanted;  // Set by the link thread when it has anything new
+    bool notify_pending;  // Atomic, set until the session's thread wakes up
+    bool stop;  // Atomic, asks the link thread to end
+    bool closed;  // Atomic, set once the link thread has ended on its own
+    struct spsc transfers;  // Of struct session_transfer
+    uint64_t dropped;  // Atomic, transfers that didn't fit in the ring
+    thread_mutex_t adapter_lock;
+};
+
+struct mobile_user {
+    struct mobile_adapter *adapter;
+    struct socket_impl socket;
+    struct bgb_state bgb;
+    SOCKET bgb_sock;
+    bool shm;  // Set before linking to ask the emulator for shared memory
+    struct shmlink shmlink;
+    bool shm_pending;  // Set until the emulator has handed the memory over
+    unsigned char link_byte;  // Reply to the next transfer, kept across links
+    struct socket_poller *poller;
+    struct socket_poller *link_poller;  // The one the emulator link is in
+    struct session_thread *thread;  // Set when the link has its own thread
+    enum mobile_action action;
+    struct config_file config;
+    struct record *record;
+    struct socket_connector *connector;  // Set when reconnecting is allowed
+    uint64_t reconnect_time;
+    unsigned reconnect_delay;
+    char name[SESSION_NAME_SIZE];
+    unsigned id;
+    uint64_t transfers;
+    uint64_t resets;
+    uint64_t reconnects;
+    bool title;
+    uint32_t bgb_clock_offset;
+
+    // Shared with the link thread, if any, and only accessed atomically
+    bool started;
+    bool reset;
+    uint32_t bgb_clock;
+    bool bgb_clock_init;
+    bool title_stale;  // Set when the link changes, for update_title()
+
+    struct timer_state timers;
+    char number_user[MOBILE_MAX_NUMBER_SIZE + 1];
+    char number_peer[MOBILE_MAX_NUMBER_SIZE + 1];
+
+    // Latencies in nanoseconds, see session_dump()
+    struct histogram hist_turnaround;
+    struct histogram hist_transfer;
+    struct histogram hist_actions[SESSION_ACTIONS];
+
+    // Adapter commands, decoded by the session's thread
+    struct command_decoder commands;
+};
+
+struct mobile_user *session_new(const char *fname_config, const struct session_options *options);
+void session_free(struct mobile_user *mobile);
+bool session_record(struct mobile_user *mobile, const char *fname);
+bool session_reconnect(struct mobile_user *mobile, const char *host, const char *port);
+bool session_link(struct mobile_user *mobile, SOCKET sock);
+bool session_attach(struct mobile_user *mobile, struct socket_poller *poller);
+void session_detach(struct mobile_user *mobile);
+bool session_loop(struct mobile_user *mobile);
+void session_clock(struct mobile_user *mobile, uint32_t t);
+void session_reset(struct mobile_user *mobile);
+unsigned char session_transfer(struct mobile_user *mobile, unsigned char c);
+int session_delay(struct mobile_user *mobile, int delay);
+void session_dump(struct mobile_user *mobile, FILE *stream);
@@ -0,0 +1,309 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "shmlink.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "timer.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+void shmlink_init(struct shmlink *link)
+{
+    link->shared = NULL;
+    link->wake_adapter = -1;
+    link->wake_emulator = -1;
+    link->deadline = 0;
+}
+
+#if defined(__linux__)
+
+// Receive the reply to the request, along with the descriptors it carries
+// Returns 1 once it's been received, 0 if it hasn't arrived yet, and -1 on
+//   failure.
+static int shmlink_recv_fds(SOCKET sock, unsigned char *reply, int fds[3])
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * 3)];
+    } control;
+    struct iovec iov = {.iov_base = reply, .iov_len = 8};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (len == -1) {
+        if (errno == EWOULDBLOCK) return 0;
+        perror("recvmsg");
+        return -1;
+    }
+
+    // Whatever descriptors were received must be closed on failure
+    unsigned count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        unsigned num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (unsigned i = 0; i < num; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (count < 3) {
+                fds[count++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+    if (len != 8 || reply[0] != SHMLINK_CMD || reply[1] != SHMLINK_VERSION ||
+            count != 3) {
+        fprintf(stderr, "shmlink: The emulator refused the shared memory\n");
+        for (unsigned i = 0; i < count; i++) close(fds[i]);
+        return -1;
+    }
+    return 1;
+}
+
+// Ask the emulator for the shared memory, over its connected Unix socket
+// This happens before the BGB handshake. The reply is picked up by
+//   shmlink_step(), so nothing waits on the emulator in the meantime.
+bool shmlink_request(struct shmlink *link, SOCKET sock)
+{
+    unsigned char request[8] = {SHMLINK_CMD, SHMLINK_VERSION};
+    if (send(sock, (char *)request, sizeof(request), 0) != sizeof(request)) {
+        socket_perror("shmlink");
+        return false;
+    }
+    link->deadline = timer_host_ns() + (uint64_t)SHMLINK_TIMEOUT * 1000000;
+    return true;
+}
+
+// Map the shared memory once the emulator has replied to the request
+// Returns 1 once the link is open, 0 while the reply is still awaited, and
+//   -1 on failure, including when the emulator doesn't reply in time.
+int shmlink_step(struct shmlink *link, SOCKET sock)
+{
+    unsigned char reply[8];
+    int fds[3];
+    int rc = shmlink_recv_fds(sock, reply, fds);
+    if (rc == 0 && timer_host_ns() >= link->deadline) {
+        fprintf(stderr, "shmlink: The emulator didn't reply\n");
+        return -1;
+    }
+    if (rc != 1) return rc;
+
+    struct stat st;
+    if (fstat(fds[0], &st) == -1) {
+        perror("fstat");
+        goto error;
+    }
+    if ((size_t)st.st_size < sizeof(struct shmlink_shared)) {
+        fprintf(stderr, "shmlink: The shared memory is too small\n");
+        goto error;
+    }
+    struct shmlink_shared *shared = mmap(NULL, sizeof(*shared),
+        PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        goto error;
+    }
+    close(fds[0]);
+    if (memcmp(shared->magic, SHMLINK_MAGIC, sizeof(shared->magic)) != 0 ||
+            shared->packets != SHMLINK_PACKETS) {
+        fprintf(stderr, "shmlink: Unsupported shared memory layout\n");
+        munmap(shared, sizeof(*shared));
+        close(fds[1]);
+        close(fds[2]);
+        return -1;
+    }
+
+    // The adapter's eventfd is drained whenever the queue is read
+    // The flag is shared with the emulator's copy, which is only written to.
+    if (fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1) {
+        perror("fcntl");
+        munmap(shared, sizeof(*shared));
+        close(fds[1]);
+        close(fds[2]);
+        return -1;
+    }
+
+    link->shared = shared;
+    link->wake_adapter = fds[1];
+    link->wake_emulator = fds[2];
+    return 1;
+
+error:
+    for (unsigned i = 0; i < 3; i++) close(fds[i]);
+    return -1;
+}
+
+// Calculate how long until the emulator's reply is given up on, capped at the
+//   delay
+int shmlink_delay(struct shmlink *link, int delay)
+{
+    uint64_t now = timer_host_ns();
+    int left = 0;
+    if (link->deadline > now) {
+        left = (link->deadline - now + 999999) / 1000000;
+    }
+    if (delay < 0 || left < delay) delay = left;
+    return delay;
+}
+
+void shmlink_close(struct shmlink *link)
+{
+    if (!link->shared) return;
+    munmap(link->shared, sizeof(*link->shared));
+    close(link->wake_adapter);
+    close(link->wake_emulator);
+    shmlink_init(link);
+}
+
+bool shmlink_attach(struct shmlink *link, struct socket_poller *poller, bool *ready)
+{
+    if (!link->shared) return true;
+    return socket_poller_add(poller, link->wake_adapter, ready);
+}
+
+void shmlink_detach(struct shmlink *link, struct socket_poller *poller)
+{
+    if (!link->shared) return;
+    socket_poller_del(poller, link->wake_adapter);
+}
+
+static unsigned shmlink_pop(struct shmlink_queue *queue, unsigned char *data, unsigned size)
+{
+    uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = queue->tail;
+    unsigned len = 0;
+    while (tail != head && len + 8 <= size) {
+        memcpy(data + len, queue->packets[tail % SHMLINK_PACKETS], 8);
+        tail++;
+        len += 8;
+    }
+    __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+    return len;
+}
+
+// Take as many packets as fit, returns 0 once the queue has run dry, after
+//   which the emulator will signal the eventfd when it adds more
+unsigned shmlink_recv(struct shmlink *link, unsigned char *data, unsigned size)
+{
+    struct shmlink_queue *queue = &link->shared->to_adapter;
+
+    // Clear the eventfd, as its readiness is what woke the poller
+    uint64_t value;
+    if (read(link->wake_adapter, &value, sizeof(value)) == -1 &&
+            errno != EAGAIN) {
+        perror("shmlink: read");
+    }
+
+    unsigned len = shmlink_pop(queue, data, size);
+    if (len) {
+        __atomic_store_n(&queue->sleeping, 0, __ATOMIC_RELAXED);
+        return len;
+    }
+
+    // Check once more after announcing the sleep, so no packet is missed
+    __atomic_store_n(&queue->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    len = shmlink_pop(queue, data, size);
+    if (len) __atomic_store_n(&queue->sleeping, 0, __ATOMIC_RELAXED);
+    return len;
+}
+
+// Add as many packets as there's room for, returns the amount of bytes added
+unsigned shmlink_send(struct shmlink *link, const unsigned char *data, unsigned size)
+{
+    struct shmlink_queue *queue = &link->shared->to_emulator;
+    uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    uint32_t head = queue->head;
+    unsigned len = 0;
+    while (len + 8 <= size && head - tail < SHMLINK_PACKETS) {
+        memcpy(queue->packets[head % SHMLINK_PACKETS], data + len, 8);
+        head++;
+        len += 8;
+    }
+    if (!len) return 0;
+    __atomic_store_n(&queue->head, head, __ATOMIC_RELEASE);
+
+    // Only wake up the emulator if it's waiting on us
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->sleeping, __ATOMIC_RELAXED)) {
+        uint64_t value = 1;
+        if (write(link->wake_emulator, &value, sizeof(value)) == -1 &&
+                errno != EAGAIN) {
+            perror("shmlink: write");
+        }
+    }
+    return len;
+}
+
+#else
+
+bool shmlink_request(struct shmlink *link, SOCKET sock)
+{
+    (void)link;
+    (void)sock;
+    fprintf(stderr, "shmlink: Shared memory links require Linux\n");
+    return false;
+}
+
+int shmlink_step(struct shmlink *link, SOCKET sock)
+{
+    (void)link;
+    (void)sock;
+    return -1;
+}
+
+int shmlink_delay(struct shmlink *link, int delay)
+{
+    (void)link;
+    return delay;
+}
+
+void shmlink_close(struct shmlink *link)
+{
+    (void)link;
+}
+
+bool shmlink_attach(struct shmlink *link, struct socket_poller *poller, bool *ready)
+{
+    (void)link;
+    (void)poller;
+    (void)ready;
+    return true;
+}
+
+void shmlink_detach(struct shmlink *link, struct socket_poller *poller)
+{
+    (void)link;
+    (void)poller;
+}
+
+unsigned shmlink_recv(struct shmlink *link, unsigned char *data, unsigned size)
+{
+    (void)link;
+    (void)data;
+    (void)size;
+    return 0;
+}
+
+unsigned shmlink_send(struct shmlink *link, const unsigned char *data, unsigned size)
+{
+    (void)link;
+    (void)data;
+    (void)size;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "socket.h"
+
+// Host prefix selecting the shared memory link, followed by the path of the
+//   emulator's Unix socket
+#define SHMLINK_PREFIX "shm:"
+// Packet sent over the socket to request the shared memory, and replied with
+//   along with its file descriptors
+#define SHMLINK_CMD 0xF0
+#define SHMLINK_VERSION 1
+#define SHMLINK_MAGIC "BGBSHM01"
+// Size of each queue in packets, a power of two
+#define SHMLINK_PACKETS 256
+// Maximum time to wait for the emulator to hand over the shared memory, in
+//   milliseconds
+#define SHMLINK_TIMEOUT 1000
+
+// Queue of BGB packets, written by one side and read by the other
+// The positions only ever increase, wrapping around at 2^32.
+struct shmlink_queue {
+    uint32_t head;  // Written by the producer
+    uint32_t pad_head[15];
+    uint32_t tail;  // Written by the consumer
+    uint32_t sleeping;  // Set by the consumer before waiting on its eventfd
+    uint32_t pad_tail[14];
+    unsigned char packets[SHMLINK_PACKETS][8];
+};
+
+// Layout of the memory shared with the emulator
+// The emulator creates it, along with an eventfd for either side, and hands
+//   them over as SCM_RIGHTS in that order, in its reply to SHMLINK_CMD. Either
+//   side only signals the other's eventfd if it's sleeping. The adapter's
+//   eventfd is made non-blocking.
+struct shmlink_shared {
+    char magic[8];
+    uint32_t packets;
+    uint32_t pad[13];
+    struct shmlink_queue to_adapter;
+    struct shmlink_queue to_emulator;
+};
+
+// Exchanges the packets of the BGB protocol through shared memory instead of
+//   the socket, which is only kept to tell when the emulator goes away
+struct shmlink {
+    struct shmlink_shared *shared;
+    int wake_adapter;
+    int wake_emulator;
+    uint64_t deadline;  // For the emulator's reply, see shmlink_step()
+};
+
+void shmlink_init(struct shmlink *link);
+bool shmlink_request(struct shmlink *link, SOCKET sock);
+int shmlink_step(struct shmlink *link, SOCKET sock);
+int shmlink_delay(struct shmlink *link, int delay);
+void shmlink_close(struct shmlink *link);
+bool shmlink_attach(struct shmlink *link, struct socket_poller *poller, bool *ready);
+void shmlink_detach(struct shmlink *link, struct socket_poller *poller);
+unsigned shmlink_recv(struct shmlink *link, unsigned char *data, unsigned size);
+unsigned shmlink_send(struct shmlink *link, const unsigned char *data, unsigned size);
@@ -3,6 +3,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #if defined(__unix__)
@@ -10,30 +11,41 @@
 #include <poll.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #endif
+#ifdef SOCKET_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#include "timer.h"
+
+// Maximum amount of events fetched per socket_poller_wait call
+#define SOCKET_POLLER_EVENTS 64
+
+// Describe the last socket-related error
+const char *socket_strerror(char *buf, unsigned size)
+{
+#if defined(__unix__)
+    if (strerror_r(errno, buf, size)) buf[0] = '\0';
+#elif defined(_WIN32)
+    DWORD len = FormatMessageA(
+        FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+        NULL, WSAGetLastError(), 0, buf, size, NULL);
+    // The message ends in a newline
+    while (len && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) len--;
+    buf[len] = '\0';
+#endif
+    return buf;
+}
 
 // Print last socket-related error
 void socket_perror(const char *func)
 {
-    if (func) fprintf(stderr, "%s: ", func);
-#if defined(__unix__)
     char error[0x100];
-    if (strerror_r(errno, error, sizeof(error))) {
-        putc('\n', stderr);
-        return;
-    }
+    socket_strerror(error, sizeof(error));
+    if (func) fprintf(stderr, "%s: ", func);
     fprintf(stderr, "%s\n", error);
-#elif defined(_WIN32)
-    LPWSTR error = NULL;
-    if (!FormatMessageW(
-            FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM,
-            NULL, WSAGetLastError(), 0, (LPWSTR)&error, 0, NULL)) {
-        putc('\n', stderr);
-        return;
-    }
-    fprintf(stderr, "%ls", error);
-    LocalFree(error);
-#endif
 }
 
 // Convert a sockaddr to a printable string
@@ -52,6 +64,10 @@ int socket_straddr(char *res, unsigned res_len, struct sockaddr *addr, socklen_t
         struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
         inaddr = &addr6->sin6_addr;
         inport = ntohs(addr6->sin6_port) & 0xFFFF;
+    } else if (addr->sa_family == AF_UNIX) {
+        struct sockaddr_un *addr_un = (struct sockaddr_un *)addr;
+        snprintf(res, res_len, "%s%s", SOCKET_UNIX_PREFIX, addr_un->sun_path);
+        return 0;
     } else {
         return -1;
     }
@@ -70,27 +86,6 @@ int socket_straddr(char *res, unsigned res_len, struct sockaddr *addr, socklen_t
     return 0;
 }
 
-// Check if a socket has data in the receive buffer (or an error)
-int socket_hasdata(SOCKET socket)
-{
-#ifdef SOCKET_USE_POLL
-    struct pollfd fd = {.fd = socket, .events = POLLIN | POLLPRI};
-    int rc = poll(&fd, 1, 0);
-    if (rc == -1) socket_perror("poll");
-    return rc;
-#else
-    fd_set rfds, exfds;
-    FD_ZERO(&rfds);
-    FD_ZERO(&exfds);
-    FD_SET(socket, &rfds);
-    FD_SET(socket, &exfds);
-    struct timeval tv = {0};
-    int rc = select((int)socket + 1, &rfds, NULL, &exfds, &tv);
-    if (rc == -1) socket_perror("select");
-    return rc;
-#endif
-}
-
 // Check if a connect() call has completed
 int socket_isconnected(SOCKET socket)
 {
@@ -138,11 +133,36 @@ int socket_wait(SOCKET *sockets, unsigned count, int delay)
         FD_SET(sockets[i], &rfds);
     }
 
+    // A negative delay waits indefinitely, as it does with poll()
+    struct timeval tv = {
+        .tv_sec = delay / 1000,
+        .tv_usec = (delay % 1000) * 1000
+    };
+    int rc = select((int)maxfd + 1, &rfds, NULL, NULL,
+        delay < 0 ? NULL : &tv);
+    if (rc == -1) socket_perror("select");
+    return rc;
+#endif
+}
+
+// Wait for a socket to be able to accept more data
+int socket_waitwrite(SOCKET socket, int delay)
+{
+#ifdef SOCKET_USE_POLL
+    struct pollfd fd = {.fd = socket, .events = POLLOUT};
+    int rc = poll(&fd, 1, delay);
+    if (rc == -1) socket_perror("poll");
+    return rc;
+#else
+    fd_set wfds;
+    FD_ZERO(&wfds);
+    FD_SET(socket, &wfds);
     struct timeval tv = {
         .tv_sec = delay / 1000,
         .tv_usec = (delay % 1000) * 1000
     };
-    int rc = select((int)maxfd + 1, &rfds, NULL, NULL, &tv);
+    int rc = select((int)socket + 1, NULL, &wfds, NULL,
+        delay < 0 ? NULL : &tv);
     if (rc == -1) socket_perror("select");
     return rc;
 #endif
@@ -170,9 +190,67 @@ int socket_setblocking(SOCKET socket, int flag)
     return 0;
 }
 
-// Connect a socket to a user-provided hostname and port
-SOCKET socket_connect(const char *host, const char *port)
+// Close a TCP socket with a reset, discarding anything it has yet to send
+// The peer gets an error, instead of taking what it got for the whole stream.
+void socket_reset(SOCKET socket)
+{
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    if (setsockopt(socket, SOL_SOCKET, SO_LINGER, (void *)&linger,
+            sizeof(linger)) == SOCKET_ERROR) {
+        socket_perror("setsockopt");
+    }
+    socket_close(socket);
+}
+
+// Build the address of a Unix socket, if the host names one
+// Returns 1 if it does, 0 if it's a regular hostname, and -1 on error.
+static int socket_unix_addr(struct sockaddr_storage *addr, socklen_t *addrlen, const char *host)
 {
+    size_t prefix = strlen(SOCKET_UNIX_PREFIX);
+    if (!host || strncmp(host, SOCKET_UNIX_PREFIX, prefix) != 0) return 0;
+#if defined(__unix__)
+    const char *path = host + prefix;
+    struct sockaddr_un *addr_un = (struct sockaddr_un *)addr;
+    if (!*path || strlen(path) >= sizeof(addr_un->sun_path)) {
+        fprintf(stderr, "Invalid socket path: %s\n", path);
+        return -1;
+    }
+    memset(addr_un, 0, sizeof(*addr_un));
+    addr_un->sun_family = AF_UNIX;
+    memcpy(addr_un->sun_path, path, strlen(path));
+    *addrlen = sizeof(*addr_un);
+    return 1;
+#else
+    (void)addr;
+    (void)addrlen;
+    fprintf(stderr, "Unix sockets aren't supported on this system\n");
+    return -1;
+#endif
+}
+
+// Resolve the addresses of a host, ordering them to alternate between address
+//   families, starting with the preferred one
+bool socket_connector_init(struct socket_connector *conn, const char *host, const char *port)
+{
+    // Unix sockets have a single address, and no port
+    struct sockaddr_storage unix_addr;
+    socklen_t unix_addrlen;
+    int unix_rc = socket_unix_addr(&unix_addr, &unix_addrlen, host);
+    if (unix_rc == -1) return false;
+    if (unix_rc == 1) {
+        conn->addrs = malloc(sizeof(*conn->addrs));
+        if (!conn->addrs) {
+            perror("malloc");
+            return false;
+        }
+        conn->addrs[0].addr = unix_addr;
+        conn->addrs[0].addrlen = unix_addrlen;
+        conn->addrs_count = 1;
+        conn->attempts_count = 0;
+        socket_connector_start(conn);
+        return true;
+    }
+
     struct addrinfo hints = {
         .ai_family = AF_UNSPEC,
         .ai_socktype = SOCK_STREAM,
@@ -186,6 +264,257 @@ SOCKET socket_connect(const char *host, const char *port)
 #elif defined(_WIN32)
         fprintf(stderr, "getaddrinfo: Error %d: ", gai_errno);
         socket_perror(NULL);
+#endif
+        return false;
+    }
+
+    unsigned count = 0;
+    for (struct addrinfo *info = result; info; info = info->ai_next) count++;
+    conn->addrs = malloc(sizeof(*conn->addrs) * count);
+    if (!conn->addrs) {
+        perror("malloc");
+        freeaddrinfo(result);
+        return false;
+    }
+
+    // Take turns between the first family and the rest, keeping their order
+    struct addrinfo *first = result;
+    struct addrinfo *rest = result;
+    for (unsigned i = 0; i < count; i++) {
+        while (first && first->ai_family != result->ai_family) {
+            first = first->ai_next;
+        }
+        while (rest && rest->ai_family == result->ai_family) {
+            rest = rest->ai_next;
+        }
+        struct addrinfo **pick = (i % 2 && rest) || !first ? &rest : &first;
+        memcpy(&conn->addrs[i].addr, (*pick)->ai_addr, (*pick)->ai_addrlen);
+        conn->addrs[i].addrlen = (socklen_t)(*pick)->ai_addrlen;
+        *pick = (*pick)->ai_next;
+    }
+    conn->addrs_count = count;
+    freeaddrinfo(result);
+
+    conn->attempts_count = 0;
+    socket_connector_start(conn);
+    return true;
+}
+
+void socket_connector_deinit(struct socket_connector *conn)
+{
+    socket_connector_start(conn);
+    free(conn->addrs);
+}
+
+// Start over from the first address, abandoning any connection in progress
+void socket_connector_start(struct socket_connector *conn)
+{
+    for (unsigned i = 0; i < conn->attempts_count; i++) {
+        socket_close(conn->attempts[i]);
+    }
+    conn->attempts_count = 0;
+    conn->next = 0;
+    conn->attempt_time = 0;
+    conn->error = 0;
+}
+
+// Start connecting to the next address, returns 1 if it connected right away
+static int socket_connector_attempt(struct socket_connector *conn, SOCKET *sock)
+{
+    struct socket_connector_addr *addr = &conn->addrs[conn->next++];
+    int protocol = addr->addr.ss_family == AF_UNIX ? 0 : IPPROTO_TCP;
+    SOCKET attempt = socket(addr->addr.ss_family, SOCK_STREAM, protocol);
+    if (attempt == INVALID_SOCKET) {
+        conn->error = socket_geterror();
+        return -1;
+    }
+    if (socket_setblocking(attempt, 0) == -1) {
+        conn->error = socket_geterror();
+        socket_close(attempt);
+        return -1;
+    }
+    conn->attempt_time = timer_host_ns();
+    if (connect(attempt, (struct sockaddr *)&addr->addr,
+            addr->addrlen) == 0) {
+        *sock = attempt;
+        return 1;
+    }
+    int err = socket_geterror();
+    if (err != SOCKET_EWOULDBLOCK && err != SOCKET_EINPROGRESS) {
+        conn->error = err;
+        socket_close(attempt);
+        return -1;
+    }
+    conn->attempts[conn->attempts_count++] = attempt;
+    return 0;
+}
+
+// Make progress on the connection without blocking
+// Returns 1 once connected, setting the non-blocking socket, 0 while still in
+//   progress, and -1 once every address has failed.
+int socket_connector_step(struct socket_connector *conn, SOCKET *sock)
+{
+    *sock = INVALID_SOCKET;
+
+    // The first attempt to complete wins
+    unsigned i = 0;
+    while (i < conn->attempts_count) {
+        int rc = socket_isconnected(conn->attempts[i]);
+        if (rc == 0) {
+            i++;
+            continue;
+        }
+        SOCKET attempt = conn->attempts[i];
+        conn->attempts[i] = conn->attempts[--conn->attempts_count];
+        if (rc > 0) {
+            *sock = attempt;
+            socket_connector_start(conn);
+            return 1;
+        }
+        conn->error = socket_geterror();
+        socket_close(attempt);
+    }
+
+    // Give the next address a go if the last one is taking too long
+    uint64_t elapsed = (timer_host_ns() - conn->attempt_time) / 1000000;
+    while (conn->next < conn->addrs_count &&
+            conn->attempts_count < SOCKET_CONNECT_ATTEMPTS &&
+            (!conn->attempts_count || elapsed >= SOCKET_CONNECT_DELAY)) {
+        int rc = socket_connector_attempt(conn, sock);
+        if (rc == 1) {
+            socket_connector_start(conn);
+            return 1;
+        }
+        if (rc == 0) break;
+    }
+
+    elapsed = (timer_host_ns() - conn->attempt_time) / 1000000;
+    if (conn->attempts_count && elapsed >= SOCKET_CONNECT_TIMEOUT) {
+        conn->error = SOCKET_ETIMEDOUT;
+        for (i = 0; i < conn->attempts_count; i++) {
+            socket_close(conn->attempts[i]);
+        }
+        conn->attempts_count = 0;
+    }
+    if (!conn->attempts_count && conn->next >= conn->addrs_count) {
+        socket_seterror(conn->error);
+        return -1;
+    }
+    return 0;
+}
+
+// Wait until any connection attempt completes, or the next one is due
+int socket_connector_wait(struct socket_connector *conn, int delay)
+{
+    if (conn->next < conn->addrs_count) {
+        uint64_t elapsed = (timer_host_ns() - conn->attempt_time) / 1000000;
+        int left = elapsed < SOCKET_CONNECT_DELAY ?
+            SOCKET_CONNECT_DELAY - (int)elapsed : 0;
+        if (delay < 0 || left < delay) delay = left;
+    }
+
+#ifdef SOCKET_USE_POLL
+    struct pollfd fds[SOCKET_CONNECT_ATTEMPTS];
+    for (unsigned i = 0; i < conn->attempts_count; i++) {
+        fds[i] = (struct pollfd){
+            .fd = conn->attempts[i],
+            .events = POLLOUT
+        };
+    }
+    int rc = poll(fds, conn->attempts_count, delay);
+    if (rc == -1) socket_perror("poll");
+    return rc;
+#else
+    // Failed connections are only signaled as exceptions
+    SOCKET maxfd = 0;
+    fd_set wfds, exfds;
+    FD_ZERO(&wfds);
+    FD_ZERO(&exfds);
+    for (unsigned i = 0; i < conn->attempts_count; i++) {
+        maxfd = max(conn->attempts[i], maxfd);
+        FD_SET(conn->attempts[i], &wfds);
+        FD_SET(conn->attempts[i], &exfds);
+    }
+    struct timeval tv = {
+        .tv_sec = delay / 1000,
+        .tv_usec = (delay % 1000) * 1000
+    };
+    if (!conn->attempts_count) {
+        Sleep(delay);
+        return 0;
+    }
+    int rc = select((int)maxfd + 1, NULL, &wfds, &exfds,
+        delay < 0 ? NULL : &tv);
+    if (rc == -1) socket_perror("select");
+    return rc;
+#endif
+}
+
+// Connect a socket to a user-provided hostname and port, blocking until done
+SOCKET socket_connect(const char *host, const char *port)
+{
+    struct socket_connector conn;
+    if (!socket_connector_init(&conn, host, port)) return INVALID_SOCKET;
+
+    SOCKET sock;
+    int rc;
+    while ((rc = socket_connector_step(&conn, &sock)) == 0) {
+        if (socket_connector_wait(&conn, -1) == -1) break;
+    }
+    int error = socket_geterror();
+    socket_connector_deinit(&conn);
+    socket_seterror(error);
+    if (rc != 1) return INVALID_SOCKET;
+    return sock;
+}
+
+// Listen for connections on a Unix socket, replacing any stale one
+static SOCKET socket_listen_unix(struct sockaddr_storage *addr, socklen_t addrlen)
+{
+#if defined(__unix__)
+    struct sockaddr_un *addr_un = (struct sockaddr_un *)addr;
+    struct stat st;
+    if (stat(addr_un->sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(addr_un->sun_path);
+    }
+#endif
+
+    SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    if (bind(sock, (struct sockaddr *)addr, addrlen) == SOCKET_ERROR ||
+            listen(sock, SOMAXCONN) == SOCKET_ERROR ||
+            socket_setblocking(sock, 0) == -1) {
+        int error = socket_geterror();
+        socket_close(sock);
+        socket_seterror(error);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// Listen for connections on a user-provided hostname and port
+SOCKET socket_listen(const char *host, const char *port)
+{
+    struct sockaddr_storage unix_addr;
+    socklen_t unix_addrlen;
+    int unix_rc = socket_unix_addr(&unix_addr, &unix_addrlen, host);
+    if (unix_rc == -1) return INVALID_SOCKET;
+    if (unix_rc == 1) return socket_listen_unix(&unix_addr, unix_addrlen);
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_protocol = IPPROTO_TCP,
+        .ai_flags = AI_PASSIVE
+    };
+    struct addrinfo *result;
+    int gai_errno = getaddrinfo(host, port, &hints, &result);
+    if (gai_errno) {
+#if defined(__unix__)
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(gai_errno));
+#elif defined(_WIN32)
+        fprintf(stderr, "getaddrinfo: Error %d: ", gai_errno);
+        socket_perror(NULL);
 #endif
         return INVALID_SOCKET;
     }
@@ -200,7 +529,13 @@ SOCKET socket_connect(const char *host, const char *port)
             socket_perror("socket");
             continue;
         }
-        if (connect(sock, info->ai_addr, (int)info->ai_addrlen) == 0) break;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+                    (char *)&(int){1}, sizeof(int)) != SOCKET_ERROR &&
+                bind(sock, info->ai_addr, (int)info->ai_addrlen) == 0 &&
+                listen(sock, SOMAXCONN) == 0 &&
+                socket_setblocking(sock, 0) == 0) {
+            break;
+        }
         error = socket_geterror();
         socket_close(sock);
     }
@@ -209,3 +544,384 @@ SOCKET socket_connect(const char *host, const char *port)
     if (!info) return INVALID_SOCKET;
     return sock;
 }
+
+// Create a pair of sockets connected to each other
+int socket_pair(SOCKET sockets[2])
+{
+#if defined(__unix__)
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    return 0;
+#elif defined(_WIN32)
+    // Windows lacks socketpair(), connect two sockets over loopback instead
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = 0
+    };
+    socklen_t addrlen = sizeof(addr);
+    sockets[0] = sockets[1] = INVALID_SOCKET;
+
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET) {
+        socket_perror("socket");
+        return -1;
+    }
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) ==
+                SOCKET_ERROR ||
+            getsockname(listener, (struct sockaddr *)&addr, &addrlen) ==
+                SOCKET_ERROR ||
+            listen(listener, 1) == SOCKET_ERROR) {
+        socket_perror("socket_pair");
+        goto error;
+    }
+
+    sockets[0] = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sockets[0] == INVALID_SOCKET) {
+        socket_perror("socket");
+        goto error;
+    }
+    if (connect(sockets[0], (struct sockaddr *)&addr, sizeof(addr)) ==
+            SOCKET_ERROR) {
+        socket_perror("connect");
+        goto error;
+    }
+    sockets[1] = accept(listener, NULL, NULL);
+    if (sockets[1] == INVALID_SOCKET) {
+        socket_perror("accept");
+        goto error;
+    }
+    socket_close(listener);
+    return 0;
+
+error:
+    if (sockets[0] != INVALID_SOCKET) socket_close(sockets[0]);
+    socket_close(listener);
+    return -1;
+#endif
+}
+
+// Create a pair of sockets used to wake up a thread waiting on a poller
+// The thread waits on the second socket, the first one being written to.
+bool socket_wake_init(SOCKET wake[2])
+{
+    if (socket_pair(wake) == -1) return false;
+    if (socket_setblocking(wake[0], 0) == -1 ||
+            socket_setblocking(wake[1], 0) == -1) {
+        socket_close(wake[0]);
+        socket_close(wake[1]);
+        return false;
+    }
+    return true;
+}
+
+void socket_wake_deinit(SOCKET wake[2])
+{
+    socket_close(wake[0]);
+    socket_close(wake[1]);
+}
+
+void socket_wake(SOCKET wake[2])
+{
+    // If the buffer is full, the other end is bound to wake up anyway
+    send(wake[0], "", 1, 0);
+}
+
+void socket_wake_drain(SOCKET wake[2], bool *ready)
+{
+    char buf[0x40];
+    while (recv(wake[1], buf, sizeof(buf), 0) > 0);
+    *ready = false;
+}
+
+#ifdef SOCKET_USE_IO_URING
+// Size of the io_uring submission queue of every poller
+#define SOCKET_URING_ENTRIES 256
+
+// Completions of poll removals are told apart from the polls themselves
+#define SOCKET_URING_REMOVE (1ULL << 63)
+
+static bool socket_poller_uring_arm(struct socket_poller *poller, SOCKET socket)
+{
+    struct io_uring_sqe *sqe = uring_sqe(&poller->uring);
+    if (!sqe) {
+        fprintf(stderr, "io_uring: Submission queue full\n");
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = socket;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN | POLLPRI;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    sqe->poll32_events = sqe->poll32_events << 16 | sqe->poll32_events >> 16;
+#endif
+    sqe->user_data = socket;
+    return true;
+}
+
+// Flag the socket of a poll completion, rearming the poll if it has ended
+static void socket_poller_uring_handle(struct socket_poller *poller, struct io_uring_cqe *cqe)
+{
+    if (cqe->user_data & SOCKET_URING_REMOVE) return;
+    SOCKET socket = cqe->user_data;
+    if ((unsigned)socket >= poller->uring_flags_size) return;
+    bool *ready = poller->uring_flags[socket];
+    if (!ready) return;
+
+    // Any error will be noticed by the owner when reading from it
+    *ready = true;
+    if (cqe->flags & IORING_CQE_F_MORE) return;
+    if (cqe->res < 0) {
+        errno = -cqe->res;
+        perror("io_uring poll");
+        return;
+    }
+    socket_poller_uring_arm(poller, socket);
+}
+
+static bool socket_poller_uring_add(struct socket_poller *poller, SOCKET socket, bool *ready)
+{
+    if ((unsigned)socket >= poller->uring_flags_size) {
+        unsigned size = poller->uring_flags_size ?
+            poller->uring_flags_size : 64;
+        while (size <= (unsigned)socket) size *= 2;
+        bool **flags = realloc(poller->uring_flags, sizeof(*flags) * size);
+        if (!flags) {
+            perror("realloc");
+            return false;
+        }
+        for (unsigned i = poller->uring_flags_size; i < size; i++) {
+            flags[i] = NULL;
+        }
+        poller->uring_flags = flags;
+        poller->uring_flags_size = size;
+    }
+    if (!socket_poller_uring_arm(poller, socket)) return false;
+    poller->uring_flags[socket] = ready;
+    return true;
+}
+
+// Cancel the poll of a socket, waiting until it's certain no more completions
+//   will be posted for it, as they'd point to a flag that may be gone.
+static void socket_poller_uring_del(struct socket_poller *poller, SOCKET socket)
+{
+    if ((unsigned)socket >= poller->uring_flags_size) return;
+    if (!poller->uring_flags[socket]) return;
+    poller->uring_flags[socket] = NULL;
+
+    struct io_uring_sqe *sqe = uring_sqe(&poller->uring);
+    if (!sqe) {
+        fprintf(stderr, "io_uring: Submission queue full\n");
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = socket;
+    sqe->user_data = SOCKET_URING_REMOVE | socket;
+
+    bool removed = false;
+    bool ended = false;
+    while (!removed || !ended) {
+        if (uring_submit(&poller->uring, 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("io_uring_enter");
+            return;
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(&poller->uring))) {
+            if (cqe->user_data == (SOCKET_URING_REMOVE | socket)) {
+                removed = true;
+            } else if (cqe->user_data == (unsigned)socket) {
+                if (!(cqe->flags & IORING_CQE_F_MORE)) ended = true;
+            } else {
+                socket_poller_uring_handle(poller, cqe);
+            }
+            uring_cqe_seen(&poller->uring);
+        }
+    }
+}
+
+static int socket_poller_uring_wait(struct socket_poller *poller, int delay)
+{
+    int rc = uring_submit(&poller->uring, 1, delay);
+    if (rc == -1) {
+        if (errno != EINTR) perror("io_uring_enter");
+        return rc;
+    }
+
+    int count = 0;
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_cqe(&poller->uring))) {
+        socket_poller_uring_handle(poller, cqe);
+        uring_cqe_seen(&poller->uring);
+        count++;
+    }
+    return count;
+}
+#endif
+
+// Create an empty socket poller
+bool socket_poller_init(struct socket_poller *poller)
+{
+#ifdef SOCKET_USE_IO_URING
+    poller->uring_flags = NULL;
+    poller->uring_flags_size = 0;
+    poller->uring_ready = uring_init(&poller->uring, SOCKET_URING_ENTRIES);
+    if (poller->uring_ready) return true;
+#endif
+#ifdef SOCKET_USE_EPOLL
+    poller->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epoll == -1) {
+        perror("epoll_create1");
+        return false;
+    }
+#else
+    poller->entries = NULL;
+    poller->count = 0;
+    poller->size = 0;
+#endif
+    return true;
+}
+
+void socket_poller_deinit(struct socket_poller *poller)
+{
+#ifdef SOCKET_USE_IO_URING
+    free(poller->uring_flags);
+    if (poller->uring_ready) {
+        uring_deinit(&poller->uring);
+        return;
+    }
+#endif
+#ifdef SOCKET_USE_EPOLL
+    close(poller->epoll);
+#else
+    free(poller->entries);
+#endif
+}
+
+// Start watching a socket, setting *ready whenever it becomes readable.
+// The flag is only ever set by the poller, it's up to the owner of the socket
+//   to clear it once it runs out of data.
+bool socket_poller_add(struct socket_poller *poller, SOCKET socket, bool *ready)
+{
+#ifdef SOCKET_USE_IO_URING
+    if (poller->uring_ready) {
+        return socket_poller_uring_add(poller, socket, ready);
+    }
+#endif
+#ifdef SOCKET_USE_EPOLL
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLPRI,
+        .data.ptr = ready
+    };
+    if (epoll_ctl(poller->epoll, EPOLL_CTL_ADD, socket, &event) == -1) {
+        perror("epoll_ctl");
+        return false;
+    }
+#else
+    if (poller->count >= poller->size) {
+        unsigned size = poller->size ? poller->size * 2 : 8;
+        struct socket_poller_entry *entries =
+            realloc(poller->entries, sizeof(*entries) * size);
+        if (!entries) {
+            perror("realloc");
+            return false;
+        }
+        poller->entries = entries;
+        poller->size = size;
+    }
+    poller->entries[poller->count++] = (struct socket_poller_entry){
+        .socket = socket,
+        .ready = ready
+    };
+#endif
+    return true;
+}
+
+// Stop watching a socket, must be called before closing it
+void socket_poller_del(struct socket_poller *poller, SOCKET socket)
+{
+#ifdef SOCKET_USE_IO_URING
+    if (poller->uring_ready) {
+        socket_poller_uring_del(poller, socket);
+        return;
+    }
+#endif
+#ifdef SOCKET_USE_EPOLL
+    if (epoll_ctl(poller->epoll, EPOLL_CTL_DEL, socket, NULL) == -1) {
+        perror("epoll_ctl");
+    }
+#else
+    for (unsigned i = 0; i < poller->count; i++) {
+        if (poller->entries[i].socket != socket) continue;
+        poller->entries[i] = poller->entries[--poller->count];
+        return;
+    }
+#endif
+}
+
+// Wait for any of the sockets to become readable, flagging the ones that are
+int socket_poller_wait(struct socket_poller *poller, int delay)
+{
+#ifdef SOCKET_USE_IO_URING
+    if (poller->uring_ready) return socket_poller_uring_wait(poller, delay);
+#endif
+#if defined(SOCKET_USE_EPOLL)
+    struct epoll_event events[SOCKET_POLLER_EVENTS];
+    int rc = epoll_wait(poller->epoll, events, SOCKET_POLLER_EVENTS, delay);
+    if (rc == -1) {
+        if (errno != EINTR) perror("epoll_wait");
+        return rc;
+    }
+    for (int i = 0; i < rc; i++) *(bool *)events[i].data.ptr = true;
+    return rc;
+#elif defined(SOCKET_USE_POLL)
+    unsigned count = poller->count;
+    struct pollfd fds[count + 1];
+    for (unsigned i = 0; i < count; i++) {
+        fds[i] = (struct pollfd){
+            .fd = poller->entries[i].socket,
+            .events = POLLIN | POLLPRI
+        };
+    }
+    int rc = poll(fds, count, delay);
+    if (rc == -1) {
+        if (errno != EINTR) socket_perror("poll");
+        return rc;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        if (fds[i].revents) *poller->entries[i].ready = true;
+    }
+    return rc;
+#else
+    SOCKET maxfd = 0;
+    fd_set rfds, exfds;
+    FD_ZERO(&rfds);
+    FD_ZERO(&exfds);
+    for (unsigned i = 0; i < poller->count; i++) {
+        maxfd = max(poller->entries[i].socket, maxfd);
+        FD_SET(poller->entries[i].socket, &rfds);
+        FD_SET(poller->entries[i].socket, &exfds);
+    }
+
+    // A negative delay waits indefinitely, as it does with epoll_wait()
+    struct timeval tv = {
+        .tv_sec = delay / 1000,
+        .tv_usec = (delay % 1000) * 1000
+    };
+    int rc = select((int)maxfd + 1, &rfds, NULL, &exfds,
+        delay < 0 ? NULL : &tv);
+    if (rc == -1) {
+        socket_perror("select");
+        return rc;
+    }
+    for (unsigned i = 0; i < poller->count; i++) {
+        SOCKET fd = poller->entries[i].socket;
+        if (FD_ISSET(fd, &rfds) || FD_ISSET(fd, &exfds)) {
+            *poller->entries[i].ready = true;
+        }
+    }
+    return rc;
+#endif
+}
@@ -2,6 +2,8 @@
 #pragma once
 
 #include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #if defined(__unix__)
 #include <unistd.h>
@@ -15,6 +17,8 @@
 #error "Unsupported OS"
 #endif
 
+#include "uring.h"
+
 #if defined(__unix__)
 #define socket_close close
 #define socket_geterror() errno
@@ -23,10 +27,17 @@
 #define SOCKET_EINPROGRESS EINPROGRESS
 #define SOCKET_EALREADY EALREADY
 #define SOCKET_EISCONN EISCONN
+#define SOCKET_ETIMEDOUT ETIMEDOUT
 #define SOCKET_ERROR (-1)
 #define INVALID_SOCKET (-1)
 typedef int SOCKET;
 #define SOCKET_USE_POLL
+#if defined(__linux__)
+#define SOCKET_USE_EPOLL
+#if defined(WITH_IO_URING)
+#define SOCKET_USE_IO_URING
+#endif
+#endif
 #elif defined(_WIN32)
 #define socket_close closesocket
 #define socket_geterror() WSAGetLastError()
@@ -35,15 +46,81 @@ typedef int SOCKET;
 #define SOCKET_EINPROGRESS WSAEINPROGRESS
 #define SOCKET_EALREADY WSAEALREADY
 #define SOCKET_EISCONN WSAEISCONN
+#define SOCKET_ETIMEDOUT WSAETIMEDOUT
+#endif
+
+// Set of sockets waited on together, kept across calls
+struct socket_poller {
+#ifdef SOCKET_USE_EPOLL
+    int epoll;
+#ifdef SOCKET_USE_IO_URING
+    // When io_uring is available, it's used instead of epoll
+    // Every socket has a multishot poll request, identified by its number.
+    bool uring_ready;
+    struct uring uring;
+    bool **uring_flags;
+    unsigned uring_flags_size;
 #endif
+#else
+    struct socket_poller_entry {
+        SOCKET socket;
+        bool *ready;
+    } *entries;
+    unsigned count;
+    unsigned size;
+#endif
+};
+
+// Time between starting connections to each address of a host, in ms
+#define SOCKET_CONNECT_DELAY 250
+// Time after which the last connection attempt is abandoned, in ms
+#define SOCKET_CONNECT_TIMEOUT 10000
+// Connection attempts in flight at once
+#define SOCKET_CONNECT_ATTEMPTS 4
+// Host prefix selecting a Unix socket, followed by its path
+#define SOCKET_UNIX_PREFIX "unix:"
+
+// Non-blocking connection to a host, racing its addresses (RFC 8305)
+// The addresses are resolved once, and reused by every connection made.
+struct socket_connector {
+    struct socket_connector_addr {
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+    } *addrs;
+    unsigned addrs_count;
+    unsigned next;
+    SOCKET attempts[SOCKET_CONNECT_ATTEMPTS];
+    unsigned attempts_count;
+    uint64_t attempt_time;
+    int error;
+};
 
 // ipv6 addr + colon + 5 char port + terminator
 #define SOCKET_STRADDR_MAXLEN (INET6_ADDRSTRLEN + 7)
 
+const char *socket_strerror(char *buf, unsigned size);
 void socket_perror(const char *func);
 int socket_straddr(char *res, unsigned res_len, struct sockaddr *addr, socklen_t addrlen);
-int socket_hasdata(SOCKET socket);
 int socket_isconnected(SOCKET socket);
 int socket_wait(SOCKET *sockets, unsigned count, int delay);
+int socket_waitwrite(SOCKET socket, int delay);
 int socket_setblocking(SOCKET socket, int flag);
+void socket_reset(SOCKET socket);
+bool socket_connector_init(struct socket_connector *conn, const char *host, const char *port);
+void socket_connector_deinit(struct socket_connector *conn);
+void socket_connector_start(struct socket_connector *conn);
+int socket_connector_step(struct socket_connector *conn, SOCKET *sock);
+int socket_connector_wait(struct socket_connector *conn, int delay);
 SOCKET socket_connect(const char *host, const char *port);
+SOCKET socket_listen(const char *host, const char *port);
+int socket_pair(SOCKET sockets[2]);
+bool socket_wake_init(SOCKET wake[2]);
+void socket_wake_deinit(SOCKET wake[2]);
+void socket_wake(SOCKET wake[2]);
+void socket_wake_drain(SOCKET wake[2], bool *ready);
+
+bool socket_poller_init(struct socket_poller *poller);
+void socket_poller_deinit(struct socket_poller *poller);
+bool socket_poller_add(struct socket_poller *poller, SOCKET socket, bool *ready);
+void socket_poller_del(struct socket_poller *poller, SOCKET socket);
+int socket_poller_wait(struct socket_poller *poller, int delay);
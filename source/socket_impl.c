@@ -5,7 +5,9 @@
 #include <assert.h>
 #include <stdio.h>
 
+#include "log.h"
 #include "socket.h"
+#include "timer.h"
 
 union u_sockaddr {
     struct sockaddr addr;
@@ -13,20 +15,75 @@ union u_sockaddr {
     struct sockaddr_in6 addr6;
 };
 
-void socket_impl_init(struct socket_impl *state)
+void socket_impl_init(struct socket_impl *state, struct socket_poller *poller)
 {
     for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
         state->sockets[i] = INVALID_SOCKET;
+        state->ready[i] = false;
+        state->buffers[i].start = 0;
+        state->buffers[i].end = 0;
+        state->buffers[i].datagram = false;
+        state->sendbufs[i].len = 0;
+        state->sendbufs[i].error = false;
+        state->drains[i].socket = INVALID_SOCKET;
+        state->relay_handshake[i] = false;
+        state->relay_reply[i] = false;
+        state->flows[i].known = false;
+        for (unsigned j = 0; j < DNS_QUERIES; j++) {
+            state->dns_queries[i].queries[j].key_size = 0;
+        }
+        state->dns_queries[i].next = 0;
     }
+    state->send_buffering = false;
+    state->dns = NULL;
+    state->dns_servers[0].type = MOBILE_ADDRTYPE_NONE;
+    state->dns_servers[1].type = MOBILE_ADDRTYPE_NONE;
+    relay_pool_init(&state->relay, NULL, NULL);
+    state->poller = poller;
+    memset(state->stats, 0, sizeof(state->stats));
+    state->pcap = NULL;
 }
 
 void socket_impl_stop(struct socket_impl *state)
 {
+    // The session is going away, closed connections get one last flush
+    for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+        state->drains[i].deadline = 0;
+    }
+    socket_impl_flush(state);
     for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
         if (state->sockets[i] != INVALID_SOCKET) {
+            if (state->poller) {
+                socket_poller_del(state->poller, state->sockets[i]);
+            }
             socket_close(state->sockets[i]);
         }
     }
+    relay_pool_stop(&state->relay, state->poller);
+}
+
+// Start waiting on every open socket through a different poller
+bool socket_impl_attach(struct socket_impl *state, struct socket_poller *poller)
+{
+    state->poller = poller;
+    for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+        if (state->sockets[i] == INVALID_SOCKET) continue;
+        if (!socket_poller_add(poller, state->sockets[i], &state->ready[i])) {
+            return false;
+        }
+    }
+    return relay_pool_attach(&state->relay, poller);
+}
+
+// Stop waiting on every open socket, until socket_impl_attach is called
+void socket_impl_detach(struct socket_impl *state)
+{
+    for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+        if (state->sockets[i] == INVALID_SOCKET) continue;
+        socket_poller_del(state->poller, state->sockets[i]);
+    }
+    relay_pool_detach(&state->relay, state->poller);
+    state->poller = NULL;
 }
 
 static struct sockaddr *convert_sockaddr(socklen_t *addrlen, union u_sockaddr *u_addr, const struct mobile_addr *addr)
@@ -60,7 +117,7 @@ static struct sockaddr *convert_sockaddr(socklen_t *addrlen, union u_sockaddr *u
     }
 }
 
-bool socket_impl_open(struct socket_impl *state, unsigned conn, enum mobile_socktype type, enum mobile_addrtype addrtype, unsigned bindport)
+static bool socket_impl_open_sock(struct socket_impl *state, unsigned conn, enum mobile_socktype type, enum mobile_addrtype addrtype, unsigned bindport)
 {
     assert(state->sockets[conn] == INVALID_SOCKET);
 
@@ -80,7 +137,7 @@ bool socket_impl_open(struct socket_impl *state, unsigned conn, enum mobile_sock
 
     SOCKET sock = socket(sock_addrtype, sock_type, 0);
     if (sock == INVALID_SOCKET) {
-        socket_perror("socket");
+        log_socket_error(NULL, "socket");
         return false;
     }
     if (socket_setblocking(sock, 0) == -1) {
@@ -91,7 +148,7 @@ bool socket_impl_open(struct socket_impl *state, unsigned conn, enum mobile_sock
     // Set SO_REUSEADDR so that we can bind to the same port again after
     if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
             (char *)&(int){1}, sizeof(int)) == SOCKET_ERROR) {
-        socket_perror("setsockopt");
+        log_socket_error(NULL, "setsockopt");
         socket_close(sock);
         return false;
     }
@@ -100,7 +157,7 @@ bool socket_impl_open(struct socket_impl *state, unsigned conn, enum mobile_sock
     if (type == MOBILE_SOCKTYPE_TCP &&
             setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
                 (char *)&(int){1}, sizeof(int)) == SOCKET_ERROR) {
-        socket_perror("setsockopt");
+        log_socket_error(NULL, "setsockopt");
         socket_close(sock);
         return false;
     }
@@ -120,20 +177,203 @@ bool socket_impl_open(struct socket_impl *state, unsigned conn, enum mobile_sock
         rc = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
     }
     if (rc == SOCKET_ERROR) {
-        socket_perror("bind");
+        log_socket_error(NULL, "bind");
+        socket_close(sock);
+        return false;
+    }
+
+    if (!socket_poller_add(state->poller, sock, &state->ready[conn])) {
         socket_close(sock);
         return false;
     }
 
     state->sockets[conn] = sock;
+    state->ready[conn] = false;
+    state->types[conn] = type;
+    return true;
+}
+
+// Make up the start of a TCP stream in the capture, once connected
+static void socket_impl_capture_open(struct socket_impl *state, unsigned conn, bool active)
+{
+    if (!state->pcap) return;
+    pcap_tcp_open(state->pcap, &state->flows[conn], state->sockets[conn],
+        active);
+}
+
+// Capture what a connection slot just read ahead, an empty TCP read being
+//   the remote closing the connection
+static void socket_impl_capture_recv(struct socket_impl *state, unsigned conn, union u_sockaddr *u_addr, ssize_t len)
+{
+    struct socket_impl_buffer *buffer = &state->buffers[conn];
+    struct pcap_flow *flow = &state->flows[conn];
+    if (state->types[conn] != MOBILE_SOCKTYPE_TCP) {
+        pcap_udp_data(state->pcap, flow, state->sockets[conn], &u_addr->addr,
+            false, buffer->data, len);
+    } else if (len) {
+        pcap_tcp_data(state->pcap, flow, false, buffer->data, len);
+    } else {
+        pcap_tcp_close(state->pcap, flow, false);
+    }
+}
+
+// Write out as much of the gathered sends as the socket takes
+// The counters of the connection slot they were sent from are updated.
+static void socket_impl_flush_buf(struct socket_impl *state, unsigned conn, SOCKET sock, struct socket_impl_sendbuf *sendbuf, struct pcap_flow *flow)
+{
+    unsigned sent = 0;
+    while (sent < sendbuf->len) {
+        ssize_t len = send(sock, (char *)sendbuf->data + sent,
+            sendbuf->len - sent, 0);
+        if (len == SOCKET_ERROR) {
+            // Try again on the next flush, libmobile will be told it can't
+            //   send anything more in the meantime.
+            if (socket_geterror() == SOCKET_EWOULDBLOCK) break;
+
+            // The error is reported on libmobile's next send
+            __atomic_fetch_add(&state->stats[conn].failures, 1,
+                __ATOMIC_RELAXED);
+            log_socket_error(NULL, "send");
+            sendbuf->error = true;
+            sent = sendbuf->len;
+            break;
+        }
+        __atomic_fetch_add(&state->stats[conn].bytes_sent, len,
+            __ATOMIC_RELAXED);
+        if (state->pcap) {
+            pcap_tcp_data(state->pcap, flow, true, sendbuf->data + sent, len);
+        }
+        sent += len;
+    }
+    memmove(sendbuf->data, sendbuf->data + sent, sendbuf->len - sent);
+    sendbuf->len -= sent;
+}
+
+static void socket_impl_flush_conn(struct socket_impl *state, unsigned conn)
+{
+    socket_impl_flush_buf(state, conn, state->sockets[conn],
+        &state->sendbufs[conn], &state->flows[conn]);
+}
+
+// Close a connection that's done draining, resetting it if it couldn't
+static void socket_impl_drain_close(struct socket_impl *state, unsigned conn)
+{
+    struct socket_impl_drain *drain = &state->drains[conn];
+    if (drain->sendbuf.len) {
+        __atomic_fetch_add(&state->stats[conn].failures, 1, __ATOMIC_RELAXED);
+        log_warn(NULL, "Reset connection with %u unsent bytes",
+            drain->sendbuf.len);
+        socket_reset(drain->socket);
+    } else {
+        socket_close(drain->socket);
+    }
+    if (state->pcap) pcap_tcp_close(state->pcap, &drain->flow, true);
+    drain->socket = INVALID_SOCKET;
+}
+
+// Keep sending what a connection slot had gathered after it's closed, from
+//   socket_impl_flush(), instead of waiting for it on the spot
+static void socket_impl_drain(struct socket_impl *state, unsigned conn)
+{
+    struct socket_impl_drain *drain = &state->drains[conn];
+    if (drain->socket != INVALID_SOCKET) {
+        // The slot was closed again before the last one was done
+        socket_impl_flush_buf(state, conn, drain->socket, &drain->sendbuf,
+            &drain->flow);
+        socket_impl_drain_close(state, conn);
+    }
+    drain->socket = state->sockets[conn];
+    drain->sendbuf = state->sendbufs[conn];
+    drain->flow = state->flows[conn];
+    drain->deadline = timer_host_ns() +
+        (uint64_t)SOCKET_IMPL_DRAIN_TIMEOUT * 1000000;
+}
+
+// Write out every connection's gathered sends, once per loop iteration
+void socket_impl_flush(struct socket_impl *state)
+{
+    for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+        if (state->sendbufs[i].len) socket_impl_flush_conn(state, i);
+
+        struct socket_impl_drain *drain = &state->drains[i];
+        if (drain->socket == INVALID_SOCKET) continue;
+        socket_impl_flush_buf(state, i, drain->socket, &drain->sendbuf,
+            &drain->flow);
+        if (!drain->sendbuf.len || timer_host_ns() >= drain->deadline) {
+            socket_impl_drain_close(state, i);
+        }
+    }
+}
+
+// Check if any gathered sends are waiting on a socket to accept them
+bool socket_impl_pending(struct socket_impl *state)
+{
+    for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+        if (state->sendbufs[i].len) return true;
+        if (state->drains[i].socket != INVALID_SOCKET) return true;
+    }
+    return false;
+}
+
+bool socket_impl_open(struct socket_impl *state, unsigned conn, enum mobile_socktype type, enum mobile_addrtype addrtype, unsigned bindport)
+{
+    if (!socket_impl_open_sock(state, conn, type, addrtype, bindport)) {
+        __atomic_fetch_add(&state->stats[conn].failures, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    __atomic_fetch_add(&state->stats[conn].opens, 1, __ATOMIC_RELAXED);
     return true;
 }
 
 void socket_impl_close(struct socket_impl *state, unsigned conn)
 {
     assert(state->sockets[conn] != INVALID_SOCKET);
-    socket_close(state->sockets[conn]);
+
+    // Hand whatever libmobile sent last to the kernel, which keeps sending it
+    //   after the close. Anything the socket can't take right now is sent
+    //   later on, rather than stalling every other session.
+    struct socket_impl_sendbuf *sendbuf = &state->sendbufs[conn];
+    if (sendbuf->len) socket_impl_flush_conn(state, conn);
+    socket_poller_del(state->poller, state->sockets[conn]);
+    if (sendbuf->len) {
+        socket_impl_drain(state, conn);
+    } else {
+        if (state->pcap && state->types[conn] == MOBILE_SOCKTYPE_TCP) {
+            pcap_tcp_close(state->pcap, &state->flows[conn], true);
+        }
+        socket_close(state->sockets[conn]);
+    }
+    sendbuf->len = 0;
+    sendbuf->error = false;
+    state->flows[conn].known = false;
     state->sockets[conn] = INVALID_SOCKET;
+    state->ready[conn] = false;
+    state->buffers[conn].start = 0;
+    state->buffers[conn].end = 0;
+    state->buffers[conn].datagram = false;
+    state->relay_handshake[conn] = false;
+    state->relay_reply[conn] = false;
+    for (unsigned i = 0; i < DNS_QUERIES; i++) {
+        state->dns_queries[conn].queries[i].key_size = 0;
+    }
+    relay_pool_release(&state->relay, conn);
+}
+
+// Swap a connection slot's socket for the relay connection kept warm
+static bool socket_impl_connect_relay(struct socket_impl *state, unsigned conn)
+{
+    SOCKET sock = relay_pool_take(&state->relay, state->poller, conn);
+    if (sock == INVALID_SOCKET) return false;
+    if (!socket_poller_add(state->poller, sock, &state->ready[conn])) {
+        relay_pool_release(&state->relay, conn);
+        socket_close(sock);
+        return false;
+    }
+    socket_poller_del(state->poller, state->sockets[conn]);
+    socket_close(state->sockets[conn]);
+    state->sockets[conn] = sock;
+    state->ready[conn] = false;
+    return true;
 }
 
 int socket_impl_connect(struct socket_impl *state, unsigned conn, const struct mobile_addr *addr)
@@ -145,10 +385,27 @@ int socket_impl_connect(struct socket_impl *state, unsigned conn, const struct m
     socklen_t sock_addrlen;
     struct sockaddr *sock_addr = convert_sockaddr(&sock_addrlen, &u_addr, addr);
 
+    // Connections to the relay start off with the handshake
+    if (state->types[conn] == MOBILE_SOCKTYPE_TCP &&
+            relay_pool_match(&state->relay, addr)) {
+        if (socket_impl_connect_relay(state, conn)) {
+            state->relay_handshake[conn] = false;
+            __atomic_fetch_add(&state->stats[conn].connects, 1,
+                __ATOMIC_RELAXED);
+            socket_impl_capture_open(state, conn, true);
+            return 1;
+        }
+        state->relay_handshake[conn] = true;
+    }
+
     // Try to connect/check if we're connected
     int rc = connect(sock, sock_addr, sock_addrlen);
     int err = socket_geterror();
-    if (rc != SOCKET_ERROR) return 1;
+    if (rc != SOCKET_ERROR) {
+        __atomic_fetch_add(&state->stats[conn].connects, 1, __ATOMIC_RELAXED);
+        socket_impl_capture_open(state, conn, true);
+        return 1;
+    }
 
     // If the connection is in progress, try again in a bit.
     // On windows, connect() returns EISCONN rather than no error.
@@ -157,13 +414,19 @@ int socket_impl_connect(struct socket_impl *state, unsigned conn, const struct m
             err == SOCKET_EALREADY) {
         return 0;
     }
-    if (err == SOCKET_EISCONN) return 1;
+    if (err == SOCKET_EISCONN) {
+        __atomic_fetch_add(&state->stats[conn].connects, 1, __ATOMIC_RELAXED);
+        socket_impl_capture_open(state, conn, true);
+        return 1;
+    }
+    __atomic_fetch_add(&state->stats[conn].failures, 1, __ATOMIC_RELAXED);
 
     char sock_str[SOCKET_STRADDR_MAXLEN] = {0};
     socket_straddr(sock_str, sizeof(sock_str), sock_addr, sock_addrlen);
+    char error[0x100];
     socket_seterror(err);
-    fprintf(stderr, "Could not connect (%s): ", sock_str);
-    socket_perror(NULL);
+    log_error(NULL, "Could not connect (%s): %s", sock_str,
+        socket_strerror(error, sizeof(error)));
     return -1;
 }
 
@@ -173,7 +436,8 @@ bool socket_impl_listen(struct socket_impl *state, unsigned conn)
     assert(sock != INVALID_SOCKET);
 
     if (listen(sock, 1) == SOCKET_ERROR) {
-        socket_perror("listen");
+        __atomic_fetch_add(&state->stats[conn].failures, 1, __ATOMIC_RELAXED);
+        log_socket_error(NULL, "listen");
         return false;
     }
 
@@ -185,16 +449,126 @@ bool socket_impl_accept(struct socket_impl *state, unsigned conn)
     SOCKET sock = state->sockets[conn];
     assert(sock != INVALID_SOCKET);
 
-    if (socket_hasdata(sock) <= 0) return false;
+    if (!state->ready[conn]) return false;
     SOCKET newsock = accept(sock, NULL, NULL);
     if (newsock == INVALID_SOCKET) {
-        socket_perror("accept");
+        if (socket_geterror() == SOCKET_EWOULDBLOCK) {
+            state->ready[conn] = false;
+            return false;
+        }
+        __atomic_fetch_add(&state->stats[conn].failures, 1, __ATOMIC_RELAXED);
+        log_socket_error(NULL, "accept");
+        return false;
+    }
+    if (socket_setblocking(newsock, 0) == -1) {
+        socket_close(newsock);
+        return false;
+    }
+    if (!socket_poller_add(state->poller, newsock, &state->ready[conn])) {
+        socket_close(newsock);
         return false;
     }
-    if (socket_setblocking(newsock, 0) == -1) return false;
 
+    socket_poller_del(state->poller, sock);
     socket_close(sock);
     state->sockets[conn] = newsock;
+    state->ready[conn] = false;
+    socket_impl_capture_open(state, conn, false);
+    return true;
+}
+
+// Check if an address is the DNS port, or one of the configured DNS servers
+static bool socket_impl_dns_server(struct socket_impl *state, const struct mobile_addr *addr)
+{
+    if (addr->type == MOBILE_ADDRTYPE_IPV4) {
+        const struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
+        if (addr4->port == MOBILE_DNS_PORT) return true;
+        for (unsigned i = 0; i < 2; i++) {
+            const struct mobile_addr4 *server =
+                (struct mobile_addr4 *)&state->dns_servers[i];
+            if (server->type != MOBILE_ADDRTYPE_IPV4) continue;
+            if (server->port == addr4->port &&
+                    memcmp(server->host, addr4->host,
+                        sizeof(server->host)) == 0) {
+                return true;
+            }
+        }
+    } else if (addr->type == MOBILE_ADDRTYPE_IPV6) {
+        const struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
+        if (addr6->port == MOBILE_DNS_PORT) return true;
+        for (unsigned i = 0; i < 2; i++) {
+            const struct mobile_addr6 *server =
+                (struct mobile_addr6 *)&state->dns_servers[i];
+            if (server->type != MOBILE_ADDRTYPE_IPV6) continue;
+            if (server->port == addr6->port &&
+                    memcmp(server->host, addr6->host,
+                        sizeof(server->host)) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool socket_impl_addr_equal(const struct mobile_addr *a, const struct mobile_addr *b)
+{
+    if (a->type != b->type) return false;
+    if (a->type == MOBILE_ADDRTYPE_IPV4) {
+        const struct mobile_addr4 *a4 = (struct mobile_addr4 *)a;
+        const struct mobile_addr4 *b4 = (struct mobile_addr4 *)b;
+        return a4->port == b4->port &&
+            memcmp(a4->host, b4->host, sizeof(a4->host)) == 0;
+    } else if (a->type == MOBILE_ADDRTYPE_IPV6) {
+        const struct mobile_addr6 *a6 = (struct mobile_addr6 *)a;
+        const struct mobile_addr6 *b6 = (struct mobile_addr6 *)b;
+        return a6->port == b6->port &&
+            memcmp(a6->host, b6->host, sizeof(a6->host)) == 0;
+    }
+    return false;
+}
+
+// Remember a DNS query sent to a server, replacing the oldest one, so only
+//   the reply to it is cached
+static void socket_impl_dns_sent(struct socket_impl *state, unsigned conn, const void *data, const unsigned size, const struct mobile_addr *addr)
+{
+    struct socket_impl_dns_queries *sent = &state->dns_queries[conn];
+    unsigned i = sent->next;
+    if (!dns_query_init(state->dns, &sent->queries[i], data, size)) return;
+    memcpy(&sent->servers[i], addr, sizeof(sent->servers[i]));
+    sent->next = (i + 1) % DNS_QUERIES;
+}
+
+// Cache a server's reply, if it answers one of the queries sent to it
+static void socket_impl_dns_received(struct socket_impl *state, unsigned conn, const void *data, const unsigned size, const struct mobile_addr *addr)
+{
+    struct socket_impl_dns_queries *sent = &state->dns_queries[conn];
+    for (unsigned i = 0; i < DNS_QUERIES; i++) {
+        if (!sent->queries[i].key_size) continue;
+        if (!socket_impl_addr_equal(&sent->servers[i], addr)) continue;
+        if (!dns_store(state->dns, &sent->queries[i], data, size)) continue;
+        sent->queries[i].key_size = 0;
+        return;
+    }
+}
+
+// Answer a DNS query without sending it, placing the reply in the read-ahead
+//   buffer as if the server had sent it
+static bool socket_impl_dns_answer(struct socket_impl *state, unsigned conn, const void *data, const unsigned size, const struct mobile_addr *addr)
+{
+    struct socket_impl_buffer *buffer = &state->buffers[conn];
+
+    // Any datagram that hasn't been read yet would be lost
+    if (buffer->datagram || buffer->start != buffer->end) return false;
+
+    unsigned char reply[DNS_MESSAGE_SIZE];
+    unsigned reply_size = dns_answer(state->dns, data, size, reply);
+    if (!reply_size) return false;
+
+    memcpy(buffer->data, reply, reply_size);
+    buffer->start = 0;
+    buffer->end = reply_size;
+    buffer->datagram = true;
+    memcpy(&buffer->addr, addr, sizeof(buffer->addr));
     return true;
 }
 
@@ -203,6 +577,58 @@ int socket_impl_send(struct socket_impl *state, unsigned conn, const void *data,
     SOCKET sock = state->sockets[conn];
     assert(sock != INVALID_SOCKET);
 
+    // The handshake on a warm relay connection has already been sent, and
+    //   only needs to be the same one
+    if (state->relay.claimed == (int)conn) {
+        int rc = relay_pool_check(&state->relay, data, size);
+        if (rc < 0) {
+            log_warn(NULL, "Relay handshake changed, dropping connection");
+            relay_pool_learn_handshake(&state->relay, data, size);
+            return -1;
+        }
+        if (rc > 0) {
+            struct socket_impl_buffer *buffer = &state->buffers[conn];
+            memcpy(buffer->data, state->relay.reply, state->relay.reply_size);
+            buffer->start = 0;
+            buffer->end = state->relay.reply_size;
+        }
+        return (int)size;
+    }
+    if (state->relay_handshake[conn]) {
+        state->relay_handshake[conn] = false;
+        state->relay_reply[conn] = relay_pool_learn_handshake(&state->relay,
+            data, size);
+    }
+
+    // Gather TCP sends until the end of the loop iteration, any that don't
+    //   fit wait until the buffer has been flushed
+    struct socket_impl_sendbuf *sendbuf = &state->sendbufs[conn];
+    if (state->send_buffering && state->types[conn] == MOBILE_SOCKTYPE_TCP) {
+        if (sendbuf->error) {
+            sendbuf->error = false;
+            return -1;
+        }
+        unsigned space = sizeof(sendbuf->data) - sendbuf->len;
+        if (space < size) {
+            socket_impl_flush_conn(state, conn);
+            if (sendbuf->error) {
+                sendbuf->error = false;
+                return -1;
+            }
+            space = sizeof(sendbuf->data) - sendbuf->len;
+        }
+        if (space > size) space = size;
+        memcpy(sendbuf->data + sendbuf->len, data, space);
+        sendbuf->len += space;
+        return (int)space;
+    }
+
+    if (state->dns && addr && state->types[conn] == MOBILE_SOCKTYPE_UDP &&
+            socket_impl_dns_server(state, addr) &&
+            socket_impl_dns_answer(state, conn, data, size, addr)) {
+        return (int)size;
+    }
+
     union u_sockaddr u_addr;
     socklen_t sock_addrlen;
     struct sockaddr *sock_addr = convert_sockaddr(&sock_addrlen, &u_addr, addr);
@@ -213,72 +639,128 @@ int socket_impl_send(struct socket_impl *state, unsigned conn, const void *data,
         int err = socket_geterror();
         if (err == SOCKET_EWOULDBLOCK) return 0;
 
-        socket_perror("send");
+        __atomic_fetch_add(&state->stats[conn].failures, 1, __ATOMIC_RELAXED);
+        log_socket_error(NULL, "send");
         return -1;
     }
+    __atomic_fetch_add(&state->stats[conn].bytes_sent, len, __ATOMIC_RELAXED);
+    if (state->dns && addr && state->types[conn] == MOBILE_SOCKTYPE_UDP &&
+            (unsigned)len == size && socket_impl_dns_server(state, addr)) {
+        socket_impl_dns_sent(state, conn, data, size, addr);
+    }
+    if (state->pcap) {
+        if (state->types[conn] == MOBILE_SOCKTYPE_TCP) {
+            pcap_tcp_data(state->pcap, &state->flows[conn], true, data, len);
+        } else {
+            pcap_udp_data(state->pcap, &state->flows[conn], sock, sock_addr,
+                true, data, len);
+        }
+    }
     return (int)len;
 }
 
-int socket_impl_recv(struct socket_impl *state, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
+static void convert_mobile_addr(struct mobile_addr *addr, const union u_sockaddr *u_addr)
 {
-    SOCKET sock = state->sockets[conn];
-    assert(sock != INVALID_SOCKET);
+    if (u_addr->addr.sa_family == AF_INET) {
+        struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
+        addr4->type = MOBILE_ADDRTYPE_IPV4;
+        addr4->port = ntohs(u_addr->addr4.sin_port);
+        memcpy(addr4->host, &u_addr->addr4.sin_addr.s_addr,
+            sizeof(addr4->host));
+    } else if (u_addr->addr.sa_family == AF_INET6) {
+        struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
+        addr6->type = MOBILE_ADDRTYPE_IPV6;
+        addr6->port = ntohs(u_addr->addr6.sin6_port);
+        memcpy(addr6->host, &u_addr->addr6.sin6_addr.s6_addr,
+            sizeof(addr6->host));
+    } else {
+        addr->type = MOBILE_ADDRTYPE_NONE;
+    }
+}
+
+// Refill an empty read-ahead buffer with a single recv
+// Returns 1 if anything was received, or the value to return from recv if not.
+static int socket_impl_fill(struct socket_impl *state, unsigned conn)
+{
+    struct socket_impl_buffer *buffer = &state->buffers[conn];
 
-    // Make sure at least one byte is in the buffer
-    if (socket_hasdata(sock) <= 0) return 0;
+    // Only bother the socket if the poller flagged it
+    if (!state->ready[conn]) return 0;
 
     union u_sockaddr u_addr = {0};
     socklen_t sock_addrlen = sizeof(u_addr);
-    struct sockaddr *sock_addr = (struct sockaddr *)&u_addr;
-
-    ssize_t len;
-    if (data) {
-        // Retrieve at least 1 byte from the buffer
-        len = recvfrom(sock, data, size, 0, sock_addr, &sock_addrlen);
-    } else {
-        // Check if at least 1 byte is available in buffer
-        char c;
-        len = recvfrom(sock, &c, 1, MSG_PEEK, sock_addr, &sock_addrlen);
-    }
+    ssize_t len = recvfrom(state->sockets[conn], (char *)buffer->data,
+        sizeof(buffer->data), 0, &u_addr.addr, &sock_addrlen);
     if (len == SOCKET_ERROR) {
         // If the socket is nonblocking, we just haven't received anything.
-        // Though this shouldn't happen thanks to the socket_hasdata check.
-        if (socket_geterror() == SOCKET_EWOULDBLOCK) return 0;
-        socket_perror("recv");
+        // The socket has been drained, wait for the poller to flag it again.
+        if (socket_geterror() == SOCKET_EWOULDBLOCK) {
+            state->ready[conn] = false;
+            return 0;
+        }
+        __atomic_fetch_add(&state->stats[conn].failures, 1, __ATOMIC_RELAXED);
+        log_socket_error(NULL, "recv");
         return -1;
     }
 
-    // A length of 0 will be returned if the remote has disconnected.
-    if (len == 0) {
-        // Though it's only relevant to TCP sockets, as UDP sockets may receive
-        // zero-length datagrams.
-        int sock_type = 0;
-        socklen_t sock_type_len = sizeof(sock_type);
-        if (getsockopt(sock, SOL_SOCKET, SO_TYPE, (char *)&sock_type,
-                &sock_type_len) == SOCKET_ERROR) {
-            socket_perror("getsockopt");
-            return -1;
+    buffer->start = 0;
+    buffer->end = len;
+    if (state->pcap) socket_impl_capture_recv(state, conn, &u_addr, len);
+    if (state->types[conn] == MOBILE_SOCKTYPE_TCP) {
+        // A length of 0 will be returned if the remote has disconnected.
+        if (len == 0) return -2;
+
+        if (state->relay_reply[conn]) {
+            state->relay_reply[conn] = false;
+            relay_pool_learn_reply(&state->relay, buffer->data, len);
+        }
+
+        // Falling short of the buffer means the socket has been drained, as
+        //   the poller is level-triggered it'll flag it again if needed.
+        if ((size_t)len < sizeof(buffer->data)) state->ready[conn] = false;
+    } else {
+        // UDP sockets may receive zero-length datagrams, which still count
+        buffer->datagram = true;
+        convert_mobile_addr(&buffer->addr, &u_addr);
+        if (!sock_addrlen) buffer->addr.type = MOBILE_ADDRTYPE_NONE;
+
+        // Keep the answers of DNS servers around for the next queries
+        if (state->dns) {
+            socket_impl_dns_received(state, conn, buffer->data, len,
+                &buffer->addr);
         }
-        if (sock_type == SOCK_STREAM) return -2;
     }
+    return 1;
+}
 
+int socket_impl_recv(struct socket_impl *state, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
+{
+    assert(state->sockets[conn] != INVALID_SOCKET);
+    struct socket_impl_buffer *buffer = &state->buffers[conn];
+
+    if (buffer->start == buffer->end && !buffer->datagram) {
+        int rc = socket_impl_fill(state, conn);
+        if (rc <= 0) return rc;
+    }
+
+    // Checking whether data is available leaves it in the buffer
     if (!data) return 0;
 
-    if (addr && sock_addrlen) {
-        if (sock_addr->sa_family == AF_INET) {
-            struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
-            addr4->type = MOBILE_ADDRTYPE_IPV4;
-            addr4->port = ntohs(u_addr.addr4.sin_port);
-            memcpy(addr4->host, &u_addr.addr4.sin_addr.s_addr,
-                sizeof(addr4->host));
-        } else if (sock_addr->sa_family == AF_INET6) {
-            struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
-            addr6->type = MOBILE_ADDRTYPE_IPV6;
-            addr6->port = ntohs(u_addr.addr6.sin6_port);
-            memcpy(addr6->host, &u_addr.addr6.sin6_addr.s6_addr,
-                sizeof(addr6->host));
+    unsigned len = buffer->end - buffer->start;
+    if (len > size) len = size;
+    memcpy(data, buffer->data + buffer->start, len);
+    __atomic_fetch_add(&state->stats[conn].bytes_recv, len, __ATOMIC_RELAXED);
+
+    if (buffer->datagram) {
+        // The rest of the datagram is discarded, like recvfrom() does
+        if (addr && buffer->addr.type != MOBILE_ADDRTYPE_NONE) {
+            memcpy(addr, &buffer->addr, sizeof(*addr));
         }
+        buffer->start = 0;
+        buffer->end = 0;
+        buffer->datagram = false;
+    } else {
+        buffer->start += len;
     }
-
     return (int)len;
 }
@@ -1,16 +1,91 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #pragma once
 
+#include <stdint.h>
 #include <mobile.h>
 
+#include "dns.h"
+#include "pcap.h"
+#include "relay.h"
 #include "socket.h"
 
+// Size of the buffer every connection slot reads ahead into
+// TCP data is served from it until it runs out, while UDP datagrams are kept
+//   whole, one at a time, and anything beyond the size is truncated.
+#define SOCKET_IMPL_READAHEAD 0x1000
+
+struct socket_impl_buffer {
+    unsigned char data[SOCKET_IMPL_READAHEAD];
+    unsigned start;
+    unsigned end;
+    bool datagram;
+    struct mobile_addr addr;
+};
+
+// Size of the buffer TCP sends are gathered in when buffering is enabled
+#define SOCKET_IMPL_SENDBUF 0x1000
+
+struct socket_impl_sendbuf {
+    unsigned char data[SOCKET_IMPL_SENDBUF];
+    unsigned len;
+    bool error;
+};
+
+// Time a closed connection may keep sending what it had gathered, in ms
+#define SOCKET_IMPL_DRAIN_TIMEOUT 5000
+
+// A closed TCP connection, still sending what libmobile gave it last
+// It's reset if that doesn't go through in time, so the peer can't take the
+//   truncated stream for a complete one.
+struct socket_impl_drain {
+    SOCKET socket;  // INVALID_SOCKET if unused
+    struct socket_impl_sendbuf sendbuf;
+    struct pcap_flow flow;
+    uint64_t deadline;  // In ns, see timer_host_ns()
+};
+
+// DNS queries waiting on their reply, and the servers they were sent to
+struct socket_impl_dns_queries {
+    struct dns_query queries[DNS_QUERIES];
+    struct mobile_addr servers[DNS_QUERIES];
+    unsigned next;
+};
+
+// Counters kept for every connection slot, over the lifetime of the session
+struct socket_impl_stats {
+    uint64_t opens;
+    uint64_t connects;
+    uint64_t failures;
+    uint64_t bytes_sent;
+    uint64_t bytes_recv;
+};
+
 struct socket_impl {
     SOCKET sockets[MOBILE_MAX_CONNECTIONS];
+    bool ready[MOBILE_MAX_CONNECTIONS];
+    enum mobile_socktype types[MOBILE_MAX_CONNECTIONS];
+    struct socket_impl_buffer buffers[MOBILE_MAX_CONNECTIONS];
+    struct socket_impl_sendbuf sendbufs[MOBILE_MAX_CONNECTIONS];
+    struct socket_impl_drain drains[MOBILE_MAX_CONNECTIONS];
+    bool send_buffering;
+    struct dns *dns;  // Answers DNS queries locally, if set
+    struct mobile_addr dns_servers[2];
+    struct socket_impl_dns_queries dns_queries[MOBILE_MAX_CONNECTIONS];
+    struct relay_pool relay;
+    bool relay_handshake[MOBILE_MAX_CONNECTIONS];
+    bool relay_reply[MOBILE_MAX_CONNECTIONS];
+    struct socket_poller *poller;
+    struct socket_impl_stats stats[MOBILE_MAX_CONNECTIONS];
+    struct pcap *pcap;  // Captures the traffic, if set
+    struct pcap_flow flows[MOBILE_MAX_CONNECTIONS];
 };
 
-void socket_impl_init(struct socket_impl *state);
+void socket_impl_init(struct socket_impl *state, struct socket_poller *poller);
 void socket_impl_stop(struct socket_impl *state);
+bool socket_impl_attach(struct socket_impl *state, struct socket_poller *poller);
+void socket_impl_detach(struct socket_impl *state);
+void socket_impl_flush(struct socket_impl *state);
+bool socket_impl_pending(struct socket_impl *state);
 
 bool socket_impl_open(struct socket_impl *state, unsigned conn, enum mobile_socktype socktype, enum mobile_addrtype addrtype, unsigned bindport);
 void socket_impl_close(struct socket_impl *state, unsigned conn);
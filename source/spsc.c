@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "spsc.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+bool spsc_init(struct spsc *ring, uint32_t count, unsigned item_size)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->items = malloc((size_t)count * item_size);
+    if (!ring->items) {
+        perror("malloc");
+        return false;
+    }
+    ring->count = count;
+    ring->item_size = item_size;
+    return true;
+}
+
+void spsc_deinit(struct spsc *ring)
+{
+    free(ring->items);
+    ring->items = NULL;
+}
+
+// Add an item, returns false if the ring is full
+bool spsc_push(struct spsc *ring, const void *item)
+{
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= ring->count) return false;
+    memcpy(ring->items + (size_t)(head & (ring->count - 1)) * ring->item_size,
+        item, ring->item_size);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Take the oldest item, returns false if the ring is empty
+bool spsc_pop(struct spsc *ring, void *item)
+{
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail == head) return false;
+    memcpy(item,
+        ring->items + (size_t)(tail & (ring->count - 1)) * ring->item_size,
+        ring->item_size);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Wait-free ring of fixed-size items, pushed by one thread and popped by
+//   another. The positions only ever increase, wrapping around at 2^32.
+struct spsc {
+    uint32_t head;  // Written by the producer
+    uint32_t pad_head[15];
+    uint32_t tail;  // Written by the consumer
+    uint32_t pad_tail[15];
+    uint32_t count;  // A power of two
+    unsigned item_size;
+    unsigned char *items;
+};
+
+bool spsc_init(struct spsc *ring, uint32_t count, unsigned item_size);
+void spsc_deinit(struct spsc *ring);
+bool spsc_push(struct spsc *ring, const void *item);
+bool spsc_pop(struct spsc *ring, void *item);
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "thread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+
+struct thread_start {
+    thread_func func;
+    void *arg;
+};
+
+#if defined(__unix__)
+static void *thread_main(void *start_ptr)
+#elif defined(_WIN32)
+static DWORD WINAPI thread_main(LPVOID start_ptr)
+#endif
+{
+    struct thread_start start = *(struct thread_start *)start_ptr;
+    free(start_ptr);
+    start.func(start.arg);
+    return 0;
+}
+
+bool thread_create(thread_t *thread, thread_func func, void *arg)
+{
+    struct thread_start *start = malloc(sizeof(struct thread_start));
+    if (!start) {
+        perror("malloc");
+        return false;
+    }
+    start->func = func;
+    start->arg = arg;
+
+#if defined(__unix__)
+    // Leave the signal handling to the main thread, the new thread inherits
+    //   the mask it's created with
+    sigset_t set, oldset;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    int rc = pthread_create(thread, NULL, thread_main, start);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (rc) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+        free(start);
+        return false;
+    }
+#elif defined(_WIN32)
+    *thread = CreateThread(NULL, 0, thread_main, start, 0, NULL);
+    if (!*thread) {
+        fprintf(stderr, "CreateThread failed with error: %lu\n",
+            GetLastError());
+        free(start);
+        return false;
+    }
+#endif
+    return true;
+}
+
+void thread_join(thread_t thread)
+{
+#if defined(__unix__)
+    pthread_join(thread, NULL);
+#elif defined(_WIN32)
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#endif
+}
+
+void thread_sleep(unsigned ms)
+{
+#if defined(__unix__)
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+#elif defined(_WIN32)
+    Sleep(ms);
+#endif
+}
+
+void thread_mutex_init(thread_mutex_t *mutex)
+{
+#if defined(__unix__)
+    pthread_mutex_init(mutex, NULL);
+#elif defined(_WIN32)
+    InitializeCriticalSection(mutex);
+#endif
+}
+
+void thread_mutex_destroy(thread_mutex_t *mutex)
+{
+#if defined(__unix__)
+    pthread_mutex_destroy(mutex);
+#elif defined(_WIN32)
+    DeleteCriticalSection(mutex);
+#endif
+}
+
+void thread_mutex_lock(thread_mutex_t *mutex)
+{
+#if defined(__unix__)
+    pthread_mutex_lock(mutex);
+#elif defined(_WIN32)
+    EnterCriticalSection(mutex);
+#endif
+}
+
+void thread_mutex_unlock(thread_mutex_t *mutex)
+{
+#if defined(__unix__)
+    pthread_mutex_unlock(mutex);
+#elif defined(_WIN32)
+    LeaveCriticalSection(mutex);
+#endif
+}
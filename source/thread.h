@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdbool.h>
+
+#if defined(__unix__)
+#include <pthread.h>
+typedef pthread_t thread_t;
+typedef pthread_mutex_t thread_mutex_t;
+#elif defined(_WIN32)
+#include <windows.h>
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION thread_mutex_t;
+#endif
+
+typedef void (*thread_func)(void *);
+
+bool thread_create(thread_t *thread, thread_func func, void *arg);
+void thread_join(thread_t thread);
+void thread_sleep(unsigned ms);
+void thread_mutex_init(thread_mutex_t *mutex);
+void thread_mutex_destroy(thread_mutex_t *mutex);
+void thread_mutex_lock(thread_mutex_t *mutex);
+void thread_mutex_unlock(thread_mutex_t *mutex);
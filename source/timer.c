@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "timer.h"
+
+#if defined(__unix__)
+#include <time.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+// Convert milliseconds to emulator clock ticks
+static uint32_t timer_ticks(unsigned ms)
+{
+    return (uint32_t)((double)ms * TIMER_CLOCK_RATE / 1000);
+}
+
+// Amount of ticks left until a deadline, or 0 if it has passed
+static uint32_t timer_left(uint32_t deadline, uint32_t clock)
+{
+    // The emulator clock is 31 bits wide, anything that's more than half of
+    //   its range away is considered to be in the past.
+    uint32_t diff = (deadline - clock) & 0x7FFFFFFF;
+    if (diff >= 0x40000000) return 0;
+    return diff;
+}
+
+void timer_init(struct timer_state *state)
+{
+    for (unsigned i = 0; i < MOBILE_MAX_TIMERS; i++) {
+        state->latch[i] = 0;
+        state->deadline[i] = 0;
+        state->armed[i] = false;
+    }
+}
+
+void timer_latch(struct timer_state *state, unsigned timer, uint32_t clock)
+{
+    __atomic_store_n(&state->latch[timer], clock, __ATOMIC_RELAXED);
+
+    // The deadline is only known once the timer is checked
+    __atomic_store_n(&state->armed[timer], false, __ATOMIC_RELAXED);
+}
+
+bool timer_check(struct timer_state *state, unsigned timer, uint32_t clock, unsigned ms)
+{
+    uint32_t ticks = timer_ticks(ms);
+    uint32_t latch = __atomic_load_n(&state->latch[timer], __ATOMIC_RELAXED);
+    bool expired = ((clock - latch) & 0x7FFFFFFF) >= ticks;
+
+    // Remember when the timer expires, so the main loop can wake up for it
+    __atomic_store_n(&state->deadline[timer], latch + ticks, __ATOMIC_RELAXED);
+    __atomic_store_n(&state->armed[timer], !expired, __ATOMIC_RELAXED);
+    return expired;
+}
+
+// Calculate how many milliseconds can be waited until the nearest timer
+//   expires, capped at the provided delay.
+int timer_next(struct timer_state *state, uint32_t clock, int delay)
+{
+    for (unsigned i = 0; i < MOBILE_MAX_TIMERS; i++) {
+        if (!__atomic_load_n(&state->armed[i], __ATOMIC_RELAXED)) continue;
+
+        // Timers that expired without being checked again won't be waited on
+        uint32_t deadline =
+            __atomic_load_n(&state->deadline[i], __ATOMIC_RELAXED);
+        uint32_t left = timer_left(deadline, clock);
+        if (!left) {
+            __atomic_store_n(&state->armed[i], false, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Round up, waking up early would be pointless
+        uint64_t ms = ((uint64_t)left * 1000 + TIMER_CLOCK_RATE - 1) /
+            TIMER_CLOCK_RATE;
+        if (ms < (uint64_t)delay) delay = (int)ms;
+    }
+    return delay;
+}
+
+// Read the host's monotonic clock, in nanoseconds
+uint64_t timer_host_ns(void)
+{
+#if defined(__unix__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#elif defined(_WIN32)
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)((double)count.QuadPart * 1000000000 / freq.QuadPart);
+#endif
+}
+
+// Read the host's wall clock, in nanoseconds since the Unix epoch
+uint64_t timer_real_ns(void)
+{
+#if defined(__unix__)
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#elif defined(_WIN32)
+    // FILETIME counts 100ns intervals since 1601
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    uint64_t time = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (time - 116444736000000000ULL) * 100;
+#endif
+}
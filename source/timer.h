@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <mobile.h>
+
+// Rate at which the emulator clock ticks
+#define TIMER_CLOCK_RATE (1 << 21)
+
+// Timers may be latched by whichever thread transfers the serial bytes, so
+//   every field is accessed atomically
+struct timer_state {
+    uint32_t latch[MOBILE_MAX_TIMERS];
+    uint32_t deadline[MOBILE_MAX_TIMERS];
+    bool armed[MOBILE_MAX_TIMERS];
+};
+
+void timer_init(struct timer_state *state);
+void timer_latch(struct timer_state *state, unsigned timer, uint32_t clock);
+bool timer_check(struct timer_state *state, unsigned timer, uint32_t clock, unsigned ms);
+int timer_next(struct timer_state *state, uint32_t clock, int delay);
+uint64_t timer_host_ns(void);
+uint64_t timer_real_ns(void);
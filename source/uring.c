@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "uring.h"
+
+#if defined(__linux__) && defined(WITH_IO_URING)
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+        arg, arg_size);
+}
+
+// Create a ring with room for the given amount of submissions
+// Fails on kernels without multishot poll (Linux 5.13), or where io_uring has
+//   been disabled, in which case the caller should fall back to epoll.
+bool uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd == -1) return false;
+    if (!(params.features & IORING_FEAT_EXT_ARG) ||
+            !(params.features & IORING_FEAT_NODROP) ||
+            !(params.features & IORING_FEAT_RSRC_TAGS)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return false;
+    }
+
+    ring->sq_map_size = params.sq_off.array +
+        params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) goto error;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) goto error_sq;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto error_cq;
+
+    unsigned char *sq = ring->sq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_pending = 0;
+
+    unsigned char *cq = ring->cq_map;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+
+error_cq:
+    if (ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+error_sq:
+    munmap(ring->sq_map, ring->sq_map_size);
+error:
+    perror("mmap");
+    close(ring->fd);
+    return false;
+}
+
+void uring_deinit(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+// Get a cleared submission entry, it's submitted with the next uring_submit()
+struct io_uring_sqe *uring_sqe(struct uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    if (tail - head >= ring->sq_entries) {
+        // Make room by handing the queued entries to the kernel
+        if (uring_submit(ring, 0, 0) == -1) return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->sq_entries) return NULL;
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
+}
+
+// Submit the queued entries, and wait for an amount of completions
+// The delay is in milliseconds, negative to wait forever. Returns -1 on error,
+//   0 if the delay ran out, and 1 otherwise.
+int uring_submit(struct uring *ring, unsigned wait, int delay)
+{
+    struct __kernel_timespec ts = {
+        .tv_sec = delay / 1000,
+        .tv_nsec = (delay % 1000) * 1000000
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = delay >= 0 ? (uintptr_t)&ts : 0
+    };
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    if (wait) flags |= IORING_ENTER_GETEVENTS;
+
+    int rc = uring_enter(ring->fd, ring->sq_pending, wait, flags, &arg,
+        sizeof(arg));
+    if (rc == -1) {
+        if (errno == ETIME) return 0;
+        return -1;
+    }
+    ring->sq_pending -= rc;
+    return 1;
+}
+
+// Peek at the oldest completion, if any
+struct io_uring_cqe *uring_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+#endif
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#if defined(__linux__) && defined(WITH_IO_URING)
+#include <stddef.h>
+#include <stdbool.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring submission and completion queues, set up through the
+//   system calls directly so no library is needed
+struct uring {
+    int fd;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_pending;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+bool uring_init(struct uring *ring, unsigned entries);
+void uring_deinit(struct uring *ring);
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, unsigned wait, int delay);
+struct io_uring_cqe *uring_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+#endif
@@ -2,6 +2,7 @@
 
 import sys
 import os
+import ctypes
 import time
 import socket
 import struct
@@ -30,6 +31,7 @@ class BGBMaster:
         sock.listen(1)
         self.sock = sock
         self.conn = None
+        self.fragment = False
 
         self.time = int(time.time() * 2**21)
         self.timeoffset = 0
@@ -68,6 +70,11 @@ class BGBMaster:
             pack["b4"],
             pack["timestamp"]
         )
+        if self.fragment:
+            # Split the packet to exercise reassembly on the other end
+            self.conn.send(pack[:3])
+            time.sleep(0.001)
+            pack = pack[3:]
         self.conn.send(pack)
 
     def accept(self):
@@ -79,6 +86,7 @@ class BGBMaster:
         self.sock.close()
         self.sock = None
         self.conn = conn
+        self.conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
 
         # Expect handshake
         pack = self.recv()
@@ -168,6 +176,73 @@ class BGBMaster:
         return byte_ret
 
 
+class BGBLibrary:
+    # Same interface as BGBMaster, for an adapter linked in-process through
+    #   the functions in mobile_bgb.h
+    def __init__(self, config="config_test.bin"):
+        lib = ctypes.CDLL(library_path())
+        lib.mobile_bgb_new.restype = ctypes.c_void_p
+        lib.mobile_bgb_new.argtypes = [ctypes.c_char_p, ctypes.c_void_p]
+        lib.mobile_bgb_free.restype = None
+        lib.mobile_bgb_free.argtypes = [ctypes.c_void_p]
+        lib.mobile_bgb_clock.restype = None
+        lib.mobile_bgb_clock.argtypes = [ctypes.c_void_p, ctypes.c_uint32]
+        lib.mobile_bgb_transfer.restype = ctypes.c_ubyte
+        lib.mobile_bgb_transfer.argtypes = [ctypes.c_void_p, ctypes.c_ubyte,
+                                            ctypes.c_uint32]
+        lib.mobile_bgb_poll.restype = ctypes.c_bool
+        lib.mobile_bgb_poll.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        self.lib = lib
+
+        # NULL options select the defaults
+        self.bgb = lib.mobile_bgb_new(config.encode(), None)
+        if not self.bgb:
+            raise Exception("BGBLibrary: mobile_bgb_new failed")
+
+        self.time = int(time.time() * 2**21)
+        self.timeoffset = 0
+
+    def close(self):
+        if self.bgb is not None:
+            self.lib.mobile_bgb_free(self.bgb)
+            self.bgb = None
+
+    def poll(self):
+        if not self.lib.mobile_bgb_poll(self.bgb, 0):
+            raise Exception("BGBLibrary.poll: Adapter failed")
+
+    def add_time(self, offset):
+        # Offset in seconds
+        self.timeoffset += int(offset * 2**21)
+        self.update()
+
+    def get_time(self):
+        return int(self.time + self.timeoffset) & 0x7FFFFFFF
+
+    def update(self):
+        self.time = int(time.time() * 2**21)
+        self.lib.mobile_bgb_clock(self.bgb, self.get_time())
+        self.poll()
+
+    def transfer(self, byte):
+        self.time = int(time.time() * 2**21)
+        byte_ret = self.lib.mobile_bgb_transfer(self.bgb, byte,
+                                                self.get_time())
+        self.poll()
+        return byte_ret
+
+
+def library_path():
+    path = os.getenv("TEST_CFG_LIB")
+    if path:
+        return path
+    if sys.platform == "win32":
+        return "./libmobile-bgb.dll"
+    if sys.platform == "darwin":
+        return "./libmobile-bgb.dylib"
+    return "./libmobile-bgb.so"
+
+
 class MobileCmdError(Exception):
     def __init__(self, code, *args):
         super().__init__(*args)
@@ -358,6 +433,20 @@ class Mobile:
         self.bus.transfer(0x4B)
         self.mode_32bit = mode_32bit
 
+    def cmd_eeprom_read(self, offset, size):
+        res = self.transfer(Mobile.MOBILE_COMMAND_EEPROM_READ, offset, size)
+        if not res or res[0] != offset:
+            raise Exception(
+                    "Mobile.cmd_eeprom_read: Unexpected reply: %s" % res)
+        return res[1:]
+
+    def cmd_eeprom_write(self, offset, data):
+        res = self.transfer(Mobile.MOBILE_COMMAND_EEPROM_WRITE,
+                            offset, *data)
+        if not res or res[0] != offset:
+            raise Exception(
+                    "Mobile.cmd_eeprom_write: Unexpected reply: %s" % res)
+
     def cmd_ppp_connect(self, s_id="nozomi", s_pass="wahaha1",
                         dns1=(0, 0, 0, 0), dns2=(0, 0, 0, 0)):
         res = self.transfer(
@@ -497,11 +586,15 @@ class SimpleTCPServer:
 
 
 class SimpleDNSServer:
-    def __init__(self, host="127.0.0.1", port=5353):
+    def __init__(self, host="127.0.0.1", port=5353, ttl=0, mismatch=False):
         sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
         sock.bind((host, port))
         self.sock = sock
         self.proc = None
+        self.ttl = ttl
+
+        # Answer with the wrong ID, then fail the query with the right one
+        self.mismatch = mismatch
 
     def __enter__(self):
         self.run()
@@ -572,17 +665,28 @@ class SimpleDNSServer:
             return
         resname = self.make_name(qname)
         resdata = self.query(qname, qtype)
+        if self.mismatch:
+            resdata = bytes([6, 6, 6, 6])
 
         # Encode result
         res = bytearray()
-        res += struct.pack("!HHHHHH", pid, 0x8180, 1, 1, 0, 0)
+        res += struct.pack("!HHHHHH", pid ^ 0xFFFF if self.mismatch else pid,
+                           0x8180, 1, 1, 0, 0)
         res += resname
         res += struct.pack("!HH", qtype, qclass)
         res += b'\xc0\x0c'
-        res += struct.pack("!HHIH", qtype, qclass, 0, len(resdata))
+        res += struct.pack("!HHIH", qtype, qclass, self.ttl, len(resdata))
         res += resdata
         self.sock.sendto(res, addr)
 
+        if self.mismatch:
+            # Server failure, without any answer
+            res = bytearray()
+            res += struct.pack("!HHHHHH", pid, 0x8182, 1, 0, 0, 0)
+            res += resname
+            res += struct.pack("!HH", qtype, qclass)
+            self.sock.sendto(res, addr)
+
 
 class SimpleRelayServer:
     def __init__(self, host="127.0.0.1", port=31227):
@@ -727,9 +831,34 @@ def mobile_process_test(*args, **kwargs):
     return _deco
 
 
+# The library is only there when built as a shared library
+def mobile_library_test():
+    def _deco(func):
+        @unittest.skipUnless(os.path.exists(library_path()),
+                             "shared library not built")
+        def deco(self):
+            bus = BGBLibrary()
+            try:
+                func(self, Mobile(bus))
+            finally:
+                bus.close()
+        return deco
+    return _deco
+
+
 class Tests(unittest.TestCase):
-    @mobile_process_test("--device", "9")
-    def test_simple(self, m):
+    @classmethod
+    def setUpClass(cls):
+        with open("dns_static_test.txt", "w") as f:
+            f.write("# Test table\n")
+            f.write("10.0.0.1 static.test alias.test\n")
+            f.write("::1 v6only.test\n")
+
+    @classmethod
+    def tearDownClass(cls):
+        os.remove("dns_static_test.txt")
+
+    def check_simple(self, m):
         m.cmd_start()
         status = m.cmd_check_status()
         self.assertEqual(status["state"], 0)
@@ -737,6 +866,14 @@ class Tests(unittest.TestCase):
         self.assertEqual(status["flags"], 0)
         m.cmd_end()
 
+    @mobile_process_test("--device", "9")
+    def test_simple(self, m):
+        self.check_simple(m)
+
+    @mobile_process_test("--device", "9", "--link-thread")
+    def test_simple_link_thread(self, m):
+        self.check_simple(m)
+
     @mobile_process_test()
     def test_session_double_init(self, m):
         m.cmd_start()
@@ -756,6 +893,34 @@ class Tests(unittest.TestCase):
         m.cmd_start()
         m.cmd_end()
 
+    @mobile_library_test()
+    def test_library_simple(self, m):
+        m.cmd_start()
+        status = m.cmd_check_status()
+        self.assertEqual(status["state"], 0)
+        self.assertEqual(status["flags"], 0)
+        m.cmd_end()
+
+    @mobile_library_test()
+    def test_library_session_timeout(self, m):
+        m.cmd_start()
+
+        # Trigger automatic session end
+        m.bus.add_time(5)
+        time.sleep(0.1)
+        m.bus.update()
+
+        # Try to re-initialize the session
+        m.cmd_start()
+        m.cmd_end()
+
+    @mobile_process_test()
+    def test_fragmented_packets(self, m):
+        m.bus.fragment = True
+        m.cmd_start()
+        m.cmd_check_status()
+        m.cmd_end()
+
     @mobile_process_test()
     def test_mode_32bit(self, m):
         m.cmd_start()
@@ -850,8 +1015,7 @@ class Tests(unittest.TestCase):
         m.cmd_offline()
         m.cmd_end()
 
-    @mobile_process_test()
-    def test_tcp_client(self, m):
+    def check_tcp_client(self, m):
         for x in range(2):
             # Log in to ISP
             m.cmd_start()
@@ -886,6 +1050,43 @@ class Tests(unittest.TestCase):
             # Test auto cleanup by ending session without closing connections
             m.cmd_end()
 
+    @mobile_process_test()
+    def test_tcp_client(self, m):
+        self.check_tcp_client(m)
+
+    @mobile_process_test("--link-thread")
+    def test_tcp_client_link_thread(self, m):
+        self.check_tcp_client(m)
+
+    @mobile_process_test("--buffer-sends")
+    def test_tcp_client_buffered_close(self, m):
+        m.cmd_start()
+        m.cmd_tel("0755311973")
+        m.cmd_ppp_connect()
+
+        data = bytes(range(200)) * 20
+
+        with SimpleTCPServer("127.0.0.1", 8767) as t:
+            cc = m.cmd_tcp_connect((127, 0, 0, 1), 8767)
+            t.accept()
+            t.conn.settimeout(10)
+
+            # Close right after sending, before the server reads anything
+            for x in range(0, len(data), 200):
+                self.assertEqual(m.cmd_data(cc, data[x:x + 200]), b"")
+            m.cmd_tcp_disconnect(cc)
+
+            # Everything must arrive, followed by a clean end of stream
+            d = b""
+            while True:
+                r = t.recv(4096)
+                if not r:
+                    break
+                d += r
+            self.assertEqual(d, data)
+
+        m.cmd_end()
+
     @mobile_process_test("--dns2", "127.0.0.1", "--dns_port", "5353")
     def test_dns_query(self, m):
         m.cmd_start()
@@ -908,6 +1109,91 @@ class Tests(unittest.TestCase):
         m.cmd_offline()
         m.cmd_end()
 
+    @mobile_process_test("--dns2", "127.0.0.1", "--dns_port", "5353",
+                         "--dns-static", "dns_static_test.txt")
+    def test_dns_query_static(self, m):
+        m.cmd_start()
+        m.cmd_tel("0755311973")
+        m.cmd_ppp_connect()
+
+        # Answered without any server running
+        self.assertEqual(m.cmd_dns_request("static.test"), (10, 0, 0, 1))
+        self.assertEqual(m.cmd_dns_request("alias.test"), (10, 0, 0, 1))
+
+        # The name is known, but only has an IPv6 address
+        self.assertEqual(m.cmd_dns_request("v6only.test"),
+                         (255, 255, 255, 255))
+
+        m.cmd_ppp_disconnect()
+        m.cmd_offline()
+        m.cmd_end()
+
+    @mobile_process_test("--dns2", "127.0.0.1", "--dns_port", "5353",
+                         "--dns-cache")
+    def test_dns_query_cache(self, m):
+        m.cmd_start()
+        m.cmd_tel("0755311973")
+        m.cmd_ppp_connect()
+
+        with SimpleDNSServer(ttl=60):
+            self.assertEqual(m.cmd_dns_request("example.com"),
+                             (93, 184, 216, 34))
+
+        # The server is gone, the repeated query is answered from the cache
+        self.assertEqual(m.cmd_dns_request("example.com"), (93, 184, 216, 34))
+        self.assertEqual(m.cmd_dns_request("localhost"), (255, 255, 255, 255))
+
+        m.cmd_ppp_disconnect()
+        m.cmd_offline()
+        m.cmd_end()
+
+    @mobile_process_test("--dns2", "127.0.0.1", "--dns_port", "5353",
+                         "--dns-cache")
+    def test_dns_query_cache_mismatch(self, m):
+        m.cmd_start()
+        m.cmd_tel("0755311973")
+        m.cmd_ppp_connect()
+
+        with SimpleDNSServer(ttl=60, mismatch=True):
+            self.assertEqual(m.cmd_dns_request("example.com"),
+                             (255, 255, 255, 255))
+
+        # The reply with the wrong ID must not have been cached
+        self.assertEqual(m.cmd_dns_request("example.com"),
+                         (255, 255, 255, 255))
+
+        m.cmd_ppp_disconnect()
+        m.cmd_offline()
+        m.cmd_end()
+
+    def test_config_db(self):
+        db = "config_test.db"
+        tool = "./mobile-configdb"
+        config = bytes(x * 7 & 0xFF for x in range(0x200))
+        try:
+            with open("config_test_in.bin", "wb") as f:
+                f.write(config)
+            subprocess.run([tool, db, "create", "4"], check=True)
+            subprocess.run([tool, db, "import", "config_test.bin",
+                            "config_test_in.bin"], check=True)
+
+            # The session runs on the imported config, and changes it
+            with MobileProcess("--config-db", db) as m:
+                m.cmd_start()
+                self.assertEqual(m.cmd_eeprom_read(0, 0x80), config[:0x80])
+                m.cmd_eeprom_write(0x10, b"Hello")
+                m.cmd_end()
+
+            subprocess.run([tool, db, "export", "config_test.bin",
+                            "config_test_out.bin"], check=True)
+            with open("config_test_out.bin", "rb") as f:
+                self.assertEqual(f.read(),
+                                 config[:0x10] + b"Hello" + config[0x15:])
+        finally:
+            for fname in [db, "config_test_in.bin", "config_test_out.bin"]:
+                if os.path.exists(fname):
+                    os.remove(fname)
+
     @unittest.skipIf(os.getenv("TEST_CFG_REALRELAY"), "Needs fake relay")
     @mobile_process_test("--relay", "127.0.0.1")
     def test_relay_fluke(self, m):
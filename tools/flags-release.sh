@@ -1,3 +1,8 @@
 #!/bin/sh
 export CFLAGS="-Os -flto -fuse-linker-plugin $CFLAGS"
+# LOG_LEVEL_MAX=error|warn|info strips the more verbose messages from the build
+case "$LOG_LEVEL_MAX" in
+    error|warn|info|debug)
+        export CFLAGS="-DLOG_LEVEL_MAX=LOG_LEVEL_$(echo "$LOG_LEVEL_MAX" | tr a-z A-Z) $CFLAGS";;
+esac
 test "$(basename "$0")" = 'flags-release.sh' && exec "$@" || true